@@ -0,0 +1,600 @@
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+#include "packr.hpp"
+#include "reader.hpp"
+
+#define MAX_TRIALS 64
+
+namespace fs = std::filesystem;
+
+// Benchmark settings, taken from the command line
+struct BenchConfig {
+    std::string work_dir = "bench_work";
+    std::string out_path = "bench_results.json";
+    std::vector<int> threads = { 1, 2, 4, 8 };
+    std::vector<std::string> corpora; // Empty = all of them
+    std::vector<std::string> operations; // Empty = all of them
+    double scale = 1.0; // Multiplies every corpus' size
+    int warmups = 1;
+    int trials = 5;
+};
+
+// Struct for a generated input directory
+struct Corpus {
+    std::string name;
+    std::string path;
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+};
+
+// Struct for one row of the report
+struct BenchResult {
+    std::string corpus;
+    std::string operation;
+    int threads = 1;
+    uint64_t files = 0;
+    uint64_t bytes = 0; // Uncompressed bytes the operation handles
+    uint64_t archive_bytes = 0;
+    int trials = 0;
+    double min_seconds = 0;
+    double median_seconds = 0;
+    double mean_seconds = 0;
+    double mb_per_s = 0; // From the median
+    double files_per_s = 0;
+    double speedup = 0; // Against the same operation on 1 thread
+    long peak_rss_kb = 0;
+    bool ok = false;
+};
+
+// Deterministic generator, so every run benchmarks the same bytes
+struct Rng {
+    uint64_t state;
+    Rng(uint64_t seed) : state(seed * 0x9E3779B97F4A7C15ULL + 1) {}
+
+    uint64_t next() {
+        // xorshift64*
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+    uint64_t range(uint64_t low, uint64_t high) { return low + next() % (high - low + 1); }
+};
+
+// Text that compresses about as well as source code does
+void write_text(const std::string& path, uint64_t size, Rng& rng) {
+    static const char* words[] = {
+        "int", "return", "const", "std::vector", "for", "if", "else", "while", "auto", "struct",
+        "size_t", "uint32_t", "void", "static", "char*", "data", "size", "index", "count", "buffer",
+        "header", "file", "path", "result", "value", "error", "offset", "chunk", "thread", "lock",
+        "=", "==", "+=", "(", ")", "{", "}", ";", "->", "<<", "0", "1", "nullptr", "true", "false",
+    };
+    const size_t word_count = sizeof(words) / sizeof(words[0]);
+
+    std::string text;
+    text.reserve(size);
+    while (text.size() < size) {
+        text.append(rng.range(0, 3) * 4, ' ');
+        uint64_t line_words = rng.range(1, 12);
+        for (uint64_t w = 0; w < line_words; w++) {
+            text += words[rng.next() % word_count];
+            text += ' ';
+        }
+        text += '\n';
+    }
+    text.resize(size);
+
+    std::ofstream(path, std::ios::binary).write(text.data(), text.size());
+}
+
+// Data no compressor can shrink
+void write_noise(const std::string& path, uint64_t size, Rng& rng) {
+    std::vector<char> data(size);
+    for (uint64_t i = 0; i < size; i += 8) {
+        uint64_t word = rng.next();
+        std::memcpy(data.data() + i, &word, std::min<uint64_t>(8, size - i));
+    }
+    std::ofstream(path, std::ios::binary).write(data.data(), data.size());
+}
+
+void count_corpus(Corpus& corpus) {
+    corpus.files = 0;
+    corpus.bytes = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(corpus.path)) {
+        if (entry.is_regular_file()) {
+            corpus.files++;
+            corpus.bytes += entry.file_size();
+        }
+    }
+}
+
+// Build a corpus unless an earlier run already did
+Corpus make_corpus(const std::string& name, const BenchConfig& config) {
+    Corpus corpus;
+    corpus.name = name;
+    corpus.path = config.work_dir + "/corpora/" + name;
+
+    // The scale is part of the name, so corpora of different sizes never mix
+    std::string stamp = corpus.path + ".done";
+    std::ostringstream expected;
+    expected << config.scale;
+    std::string found;
+    std::getline(std::ifstream(stamp), found);
+    if (fs::exists(corpus.path) && found == expected.str()) {
+        count_corpus(corpus);
+        return corpus;
+    }
+
+    std::cerr << "Generating corpus " << name << "..." << std::endl;
+    fs::remove_all(corpus.path);
+    fs::create_directories(corpus.path);
+    Rng rng(name.size() * 131 + name[0]);
+    auto scaled = [&](double count) { return std::max<uint64_t>(1, static_cast<uint64_t>(count * config.scale)); };
+
+    if (name == "tiny") {
+        // Many small files spread over a few directories
+        uint64_t files = scaled(4000);
+        for (uint64_t i = 0; i < files; i++) {
+            std::string dir = corpus.path + "/dir_" + std::to_string(i % 40);
+            fs::create_directories(dir);
+            write_text(dir + "/file_" + std::to_string(i) + ".txt", rng.range(64, 4096), rng);
+        }
+    }
+    else if (name == "huge") {
+        // A few files much bigger than a block
+        for (int i = 0; i < 2; i++) {
+            write_text(corpus.path + "/huge_" + std::to_string(i) + ".log", scaled(32 << 20), rng);
+        }
+    }
+    else if (name == "incompressible") {
+        for (int i = 0; i < 4; i++) {
+            write_noise(corpus.path + "/noise_" + std::to_string(i) + ".bin", scaled(8 << 20), rng);
+        }
+    }
+    else if (name == "mixed") {
+        // A source tree: nested directories, sources of every size, some binaries and vendored copies
+        uint64_t files = scaled(600);
+        std::vector<std::string> written;
+        for (uint64_t i = 0; i < files; i++) {
+            std::string dir = corpus.path + "/module_" + std::to_string(i % 8) +
+                              "/part_" + std::to_string(i % 5) + "/sub_" + std::to_string(i % 3);
+            fs::create_directories(dir);
+            std::string path = dir + "/source_" + std::to_string(i);
+
+            uint64_t kind = rng.range(0, 19);
+            if (kind == 0) {
+                write_noise(path + ".bin", rng.range(16 << 10, 512 << 10), rng);
+            }
+            else if (kind == 1 && !written.empty()) {
+                fs::copy_file(written[rng.next() % written.size()], path + ".cpp");
+            }
+            else {
+                write_text(path + ".cpp", rng.range(1 << 10, 96 << 10), rng);
+                written.push_back(path + ".cpp");
+            }
+        }
+    }
+    else {
+        throw std::runtime_error("Unknown corpus: " + name);
+    }
+
+    std::ofstream(stamp) << expected.str() << "\n";
+    count_corpus(corpus);
+    return corpus;
+}
+
+// Struct a measuring child sends back to the parent
+struct TrialReport {
+    int trials = 0;
+    double seconds[MAX_TRIALS];
+    uint64_t archive_bytes = 0;
+    bool ok = false;
+};
+
+// Struct for an operation: setup once, reset before every trial, then the timed run
+struct Operation {
+    std::string name;
+    bool parallel;
+    std::function<void(const Corpus&, const std::string&, int)> setup;
+    std::function<void(const std::string&)> reset;
+    std::function<void(const Corpus&, const std::string&, int)> run;
+};
+
+std::vector<Operation> get_operations() {
+    // Every operation works inside its own directory dir
+    auto compressed = [](const Corpus& corpus, const std::string& dir, int threads) {
+        std::string in = corpus.path;
+        std::string out = dir + "/input.packr";
+        Packr::compress_parallel(in, out, threads);
+    };
+    auto archived = [](const Corpus& corpus, const std::string& dir, int) {
+        std::string in = corpus.path;
+        std::string out = dir + "/input.packr";
+        Packr::archive(in, out);
+    };
+    auto none = [](const Corpus&, const std::string&, int) {};
+    auto clear_output = [](const std::string& dir) {
+        fs::remove_all(dir + "/output");
+        fs::remove(dir + "/output.packr");
+    };
+
+    std::vector<Operation> operations;
+    operations.push_back({ "archive", false, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            Packr::archive(in, out);
+        } });
+    operations.push_back({ "unarchive", false, archived, clear_output,
+        [](const Corpus&, const std::string& dir, int) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            Packr::unarchive(in, out);
+        } });
+    operations.push_back({ "compress", false, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            Packr::compress(in, out);
+        } });
+    operations.push_back({ "decompress", false, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            Packr::decompress(in, out);
+        } });
+    operations.push_back({ "compress_parallel", true, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            Packr::compress_parallel(in, out, threads);
+        } });
+    operations.push_back({ "decompress_parallel", true, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int threads) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            Packr::decompress_parallel(in, out, threads);
+        } });
+    // The same two with every file read and written through batched io_uring calls
+    operations.push_back({ "compress_parallel_uring", true, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            PackrOptions options;
+            options.io_backend = IO_BACKEND_URING;
+            Packr::compress_parallel(in, out, threads, options);
+        } });
+    operations.push_back({ "decompress_parallel_uring", true, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int threads) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            PackrOptions options;
+            options.io_backend = IO_BACKEND_URING;
+            Packr::decompress_parallel(in, out, threads, options);
+        } });
+    // The same two with the LZ codec, for its decoding speed against Deflate's
+    operations.push_back({ "compress_parallel_lz", true, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            PackrOptions options;
+            options.codec = CODEC_LZ;
+            Packr::compress_parallel(in, out, threads, options);
+        } });
+    operations.push_back({ "decompress_parallel_lz", true,
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string in = corpus.path, out = dir + "/input.packr";
+            PackrOptions options;
+            options.codec = CODEC_LZ;
+            Packr::compress_parallel(in, out, threads, options);
+        },
+        clear_output,
+        [](const Corpus&, const std::string& dir, int threads) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            Packr::decompress_parallel(in, out, threads);
+        } });
+    // Every compression level, for its speed and its ratio (archive_bytes)
+    for (int level = 0; level <= PACKR_MAX_LEVEL; level++) {
+        operations.push_back({ "compress_level_" + std::to_string(level), true, none, clear_output,
+            [level](const Corpus& corpus, const std::string& dir, int threads) {
+                std::string in = corpus.path, out = dir + "/output.packr";
+                PackrOptions options;
+                options.level = level;
+                Packr::compress_parallel(in, out, threads, options);
+            } });
+    }
+    // Auto mode on every core, alone and with a speed budget it trades ratio for
+    operations.push_back({ "compress_auto", false, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            Packr::compress_parallel(in, out, PACKR_AUTO_THREADS);
+        } });
+    operations.push_back({ "compress_auto_50mbs", false, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int) {
+            std::string in = corpus.path, out = dir + "/output.packr";
+            PackrOptions options;
+            options.target_speed = 50;
+            Packr::compress_parallel(in, out, PACKR_AUTO_THREADS, options);
+        } });
+    operations.push_back({ "extract", false, compressed, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int) {
+            std::string in = dir + "/input.packr", out = dir + "/output";
+            Packr::extract(in, out, corpus.path + "/*");
+        } });
+    operations.push_back({ "list", false, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int) {
+            std::string in = dir + "/input.packr";
+            Packr::list(in);
+        } });
+    // Load every file in-process, with all of them prefetched on the pool first
+    operations.push_back({ "read_assets", true, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int threads) {
+            PackrReader reader(dir + "/input.packr", 64 << 20, threads);
+            std::vector<std::string> paths = reader.list();
+            reader.prefetch(paths);
+            for (const std::string& path : paths) reader.read(path);
+        } });
+    // Pack into a pipe and extract from it at the same time, the archive never touches the disk
+    operations.push_back({ "pipe_roundtrip", true, none, clear_output,
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string in = corpus.path, out = dir + "/output";
+            int fds[2];
+            if (pipe(fds) != 0) throw std::runtime_error("pipe failed");
+            std::thread packer([&]() {
+                Packr::compress_stream(in, fds[1], threads);
+                close(fds[1]);
+            });
+            Packr::decompress_stream(fds[0], out, threads);
+            packer.join();
+            close(fds[0]);
+        } });
+    operations.push_back({ "verify", true, compressed, clear_output,
+        [](const Corpus&, const std::string& dir, int threads) {
+            std::string in = dir + "/input.packr";
+            if (!Packr::verify(in, threads)) throw std::runtime_error("verify failed");
+        } });
+    // Nothing changed since the archive was made, so this measures the copy path
+    operations.push_back({ "update", true, compressed,
+        [](const std::string& dir) {
+            fs::remove(dir + "/output.packr");
+            fs::copy_file(dir + "/input.packr", dir + "/output.packr");
+        },
+        [](const Corpus& corpus, const std::string& dir, int threads) {
+            std::string archive = dir + "/output.packr", in = corpus.path;
+            Packr::update(archive, in, threads);
+        } });
+    return operations;
+}
+
+// Run an operation's trials in a child process, so its peak RSS is its own
+// and Packr's thread pool never exists in the parent that forks
+BenchResult measure(const Operation& operation, const Corpus& corpus, int threads, const BenchConfig& config) {
+    BenchResult result;
+    result.corpus = corpus.name;
+    result.operation = operation.name;
+    result.threads = threads;
+    result.files = corpus.files;
+    result.bytes = corpus.bytes;
+
+    std::string dir = config.work_dir + "/runs/" + corpus.name + "_" + operation.name + "_" + std::to_string(threads);
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        throw std::runtime_error("Failed to create pipe");
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        throw std::runtime_error("Failed to fork");
+    }
+    if (pid == 0) {
+        close(fds[0]);
+
+        // Packr reports progress on stdout, keep it out of the way
+        std::ofstream null_stream("/dev/null");
+        std::cout.rdbuf(null_stream.rdbuf());
+        std::cerr.rdbuf(null_stream.rdbuf());
+
+        TrialReport report;
+        try {
+            operation.setup(corpus, dir, threads);
+            for (int i = 0; i < config.warmups + config.trials; i++) {
+                operation.reset(dir);
+                auto start = std::chrono::steady_clock::now();
+                operation.run(corpus, dir, threads);
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                if (i >= config.warmups) {
+                    report.seconds[report.trials++] = seconds;
+                }
+            }
+            if (fs::exists(dir + "/output.packr")) {
+                report.archive_bytes = fs::file_size(dir + "/output.packr");
+            }
+            else if (fs::exists(dir + "/input.packr")) {
+                report.archive_bytes = fs::file_size(dir + "/input.packr");
+            }
+            report.ok = true;
+        }
+        catch (const std::exception&) {
+            report.ok = false;
+        }
+
+        ssize_t written = write(fds[1], &report, sizeof(report));
+        (void)written;
+        close(fds[1]);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    TrialReport report;
+    bool received = read(fds[0], &report, sizeof(report)) == static_cast<ssize_t>(sizeof(report));
+    close(fds[0]);
+
+    int status = 0;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+#ifdef __APPLE__
+    result.peak_rss_kb = usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    result.peak_rss_kb = usage.ru_maxrss;
+#endif
+
+    fs::remove_all(dir);
+    if (!received || !report.ok || report.trials == 0) {
+        return result;
+    }
+
+    std::vector<double> seconds(report.seconds, report.seconds + report.trials);
+    std::sort(seconds.begin(), seconds.end());
+    result.ok = true;
+    result.trials = report.trials;
+    result.archive_bytes = report.archive_bytes;
+    result.min_seconds = seconds.front();
+    result.median_seconds = seconds[seconds.size() / 2];
+    for (double s : seconds) result.mean_seconds += s;
+    result.mean_seconds /= seconds.size();
+
+    double median = std::max(result.median_seconds, 1e-9);
+    result.mb_per_s = result.bytes / 1e6 / median;
+    result.files_per_s = result.files / median;
+    return result;
+}
+
+void write_json(const std::string& path, const std::vector<BenchResult>& results, const BenchConfig& config) {
+    std::ofstream out(path);
+    out << "{\n  \"version\": \"" << PACKR_VERSION << "\",\n"
+        << "  \"scale\": " << config.scale << ",\n"
+        << "  \"warmups\": " << config.warmups << ",\n"
+        << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        out << "    {\"corpus\": \"" << r.corpus << "\", \"operation\": \"" << r.operation
+            << "\", \"threads\": " << r.threads << ", \"ok\": " << (r.ok ? "true" : "false")
+            << ", \"files\": " << r.files << ", \"bytes\": " << r.bytes
+            << ", \"archive_bytes\": " << r.archive_bytes << ", \"trials\": " << r.trials
+            << ", \"min_s\": " << r.min_seconds << ", \"median_s\": " << r.median_seconds
+            << ", \"mean_s\": " << r.mean_seconds << ", \"mb_per_s\": " << r.mb_per_s
+            << ", \"files_per_s\": " << r.files_per_s << ", \"speedup\": " << r.speedup
+            << ", \"peak_rss_kb\": " << r.peak_rss_kb << "}"
+            << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+}
+
+void write_csv(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream out(path);
+    out << "version,corpus,operation,threads,ok,files,bytes,archive_bytes,trials,"
+           "min_s,median_s,mean_s,mb_per_s,files_per_s,speedup,peak_rss_kb\n";
+    for (const BenchResult& r : results) {
+        out << PACKR_VERSION << "," << r.corpus << "," << r.operation << "," << r.threads << ","
+            << r.ok << "," << r.files << "," << r.bytes << "," << r.archive_bytes << "," << r.trials << ","
+            << r.min_seconds << "," << r.median_seconds << "," << r.mean_seconds << ","
+            << r.mb_per_s << "," << r.files_per_s << "," << r.speedup << "," << r.peak_rss_kb << "\n";
+    }
+}
+
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+void print_usage() {
+    std::cout << "Usage: bench [options]\n"
+              << "  --out PATH         Results file, .csv for CSV, JSON otherwise (default bench_results.json)\n"
+              << "  --dir PATH         Where corpora and outputs go (default bench_work)\n"
+              << "  --threads LIST     Thread counts for the parallel operations (default 1,2,4,8)\n"
+              << "  --corpora LIST     Any of tiny,huge,incompressible,mixed (default all)\n"
+              << "  --operations LIST  Operations to run (default all)\n"
+              << "  --scale X          Multiply every corpus' size (default 1)\n"
+              << "  --warmups N        Untimed runs before the trials (default 1)\n"
+              << "  --trials N         Timed runs (default 5)\n";
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help") {
+            print_usage();
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            print_usage();
+            return 1;
+        }
+
+        std::string value = argv[++i];
+        if (arg == "--out") config.out_path = value;
+        else if (arg == "--dir") config.work_dir = value;
+        else if (arg == "--corpora") config.corpora = split_list(value);
+        else if (arg == "--operations") config.operations = split_list(value);
+        else if (arg == "--scale") config.scale = std::stod(value);
+        else if (arg == "--warmups") config.warmups = std::stoi(value);
+        else if (arg == "--trials") config.trials = std::clamp(std::stoi(value), 1, MAX_TRIALS);
+        else if (arg == "--threads") {
+            config.threads.clear();
+            for (const std::string& item : split_list(value)) config.threads.push_back(std::stoi(item));
+        }
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+    if (config.corpora.empty()) {
+        config.corpora = { "tiny", "huge", "incompressible", "mixed" };
+    }
+
+    std::vector<Corpus> corpora;
+    for (const std::string& name : config.corpora) {
+        corpora.push_back(make_corpus(name, config));
+    }
+
+    std::vector<BenchResult> results;
+    for (const Corpus& corpus : corpora) {
+        for (const Operation& operation : get_operations()) {
+            if (!config.operations.empty() &&
+                std::find(config.operations.begin(), config.operations.end(), operation.name) == config.operations.end()) {
+                continue;
+            }
+
+            // Sequential operations run once, parallel ones once per thread count
+            std::vector<int> thread_counts = operation.parallel ? config.threads : std::vector<int>{ 1 };
+            double single_thread = 0;
+            for (int threads : thread_counts) {
+                BenchResult result = measure(operation, corpus, threads, config);
+                if (threads == 1 && result.ok) single_thread = result.median_seconds;
+                if (single_thread > 0 && result.ok) result.speedup = single_thread / result.median_seconds;
+
+                std::cout << corpus.name << " " << operation.name << " (" << threads << " threads): ";
+                if (result.ok) {
+                    std::cout << result.mb_per_s << " MB/s, " << result.files_per_s << " files/s, peak RSS "
+                              << result.peak_rss_kb / 1024 << " MiB" << std::endl;
+                }
+                else {
+                    std::cout << "FAILED" << std::endl;
+                }
+                results.push_back(result);
+            }
+        }
+    }
+
+    bool csv = config.out_path.size() >= 4 && config.out_path.compare(config.out_path.size() - 4, 4, ".csv") == 0;
+    if (csv) write_csv(config.out_path, results);
+    else write_json(config.out_path, results, config);
+    std::cout << "Wrote " << results.size() << " results to " << config.out_path << std::endl;
+
+    for (const BenchResult& r : results) {
+        if (!r.ok) return 1;
+    }
+    return 0;
+}
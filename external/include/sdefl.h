@@ -119,7 +119,7 @@ extern "C" {
 #define SDEFL_WIN_SIZ   SDEFL_MAX_OFF
 #define SDEFL_WIN_MSK   (SDEFL_WIN_SIZ-1)
 
-#define SDEFL_HASH_BITS 15
+#define SDEFL_HASH_BITS 16
 #define SDEFL_HASH_SIZ  (1 << SDEFL_HASH_BITS)
 #define SDEFL_HASH_MSK  (SDEFL_HASH_SIZ-1)
 
@@ -166,6 +166,7 @@ struct sdefl {
 };
 extern int sdefl_bound(int in_len);
 extern int sdeflate(struct sdefl *s, void *o, const void *i, int n, int lvl);
+extern int sdeflate_dict(struct sdefl *s, void *o, const void *i, int dict_len, int n, int lvl);
 extern int zsdeflate(struct sdefl *s, void *o, const void *i, int n, int lvl);
 
 #ifdef __cplusplus
@@ -179,6 +180,11 @@ extern int zsdeflate(struct sdefl *s, void *o, const void *i, int n, int lvl);
 #include <assert.h> /* assert */
 #include <string.h> /* memcpy */
 #include <limits.h> /* CHAR_BIT */
+#if defined(__AVX2__)
+#include <immintrin.h> /* match length compares */
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #define SDEFL_NIL               (-1)
 #define SDEFL_MAX_MATCH         258
@@ -224,9 +230,11 @@ sdefl_uload32(const void *p) {
   return n;
 }
 static unsigned
-sdefl_hash32(const void *p) {
-  unsigned n = sdefl_uload32(p);
-  return (n * 0x9E377989) >> (32 - SDEFL_HASH_BITS);
+sdefl_hash32(const unsigned char *p, int hash_len) {
+  /* hashing a fifth byte thins out the chains of common 4-byte prefixes */
+  unsigned n = sdefl_uload32(p) * 0x9E377989;
+  if (hash_len > 4) n += p[4] * 0xC2B2AE3Du;
+  return n >> (32 - SDEFL_HASH_BITS);
 }
 static void
 sdefl_put(unsigned char **dst, struct sdefl *s, int code, int bitcnt) {
@@ -550,81 +558,176 @@ struct sdefl_match {
   int off;
   int len;
 };
+/* match finder settings per level, zlib style:
+ * chain - hash chain entries searched at most
+ * good  - search only a quarter of the chain when a match this long is already pending
+ * lazy  - look one byte ahead for a longer match unless the match is this long (0 = greedy)
+ * nice  - stop searching as soon as a match this long is found
+ * hash  - bytes hashed, 4 or 5 */
+struct sdefl_lvl {
+  short chain, good, lazy, nice, hash;
+};
+static const struct sdefl_lvl sdefl_lvls[SDEFL_LVL_MAX + 1] = {
+  {   2,  4,   0,   8, 4}, /* 0: greedy, skips over long matches */
+  {   4,  4,   0,  16, 4}, /* 1 */
+  {   8,  8,   0,  24, 4}, /* 2: greedy */
+  {  16,  8,   0,  32, 4}, /* 3 */
+  {  32, 16,   0,  48, 4}, /* 4 */
+  {  64, 16,  32,  96, 5}, /* 5: lazy */
+  { 128, 16,  32, 128, 5}, /* 6 */
+  { 256, 32, 128, 258, 5}, /* 7 */
+  {2048, 32, 258, 258, 4}, /* 8: every 4-byte match counts */
+};
+static int
+sdefl_match_len(const unsigned char *a, const unsigned char *b, int n, int max_match) {
+  /* compare 32, 16 or 8 bytes at a time, the first differing byte ends the match */
+#if defined(__AVX2__)
+  while (n + 32 <= max_match) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(const void*)(a + n));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(const void*)(b + n));
+    unsigned neq = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (neq) return n + __builtin_ctz(neq);
+    n += 32;
+  }
+#endif
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+  while (n + 16 <= max_match) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(const void*)(a + n));
+    __m128i y = _mm_loadu_si128((const __m128i*)(const void*)(b + n));
+    unsigned neq = 0xFFFFu ^ (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+    if (neq) return n + __builtin_ctz(neq);
+    n += 16;
+  }
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  while (n + 8 <= max_match) {
+    unsigned long long x, y;
+    memcpy(&x, a + n, sizeof(x));
+    memcpy(&y, b + n, sizeof(y));
+    if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+    n += 8;
+  }
+#endif
+  while (n < max_match && a[n] == b[n]) n++;
+  return n;
+}
 static void
-sdefl_fnd(struct sdefl_match *m, const struct sdefl *s,
-          int chain_len, int max_match, const unsigned char *in, int p) {
-  int i = s->tbl[sdefl_hash32(&in[p])];
+sdefl_fnd(struct sdefl_match *m, const struct sdefl *s, int chain_len, int max_match,
+          int nice_match, int hash_len, const unsigned char *in, int p) {
+  /* only matches longer than m->len count, it must be below max_match */
+  int i = s->tbl[sdefl_hash32(&in[p], hash_len)];
   int limit = ((p-SDEFL_WIN_SIZ)<SDEFL_NIL)?SDEFL_NIL:(p-SDEFL_WIN_SIZ);
+  unsigned first = sdefl_uload32(&in[p]);
   while (i > limit) {
-    if (in[i+m->len] == in[p+m->len] &&
-        (sdefl_uload32(&in[i]) == sdefl_uload32(&in[p]))){
-      int n = SDEFL_MIN_MATCH;
-      while (n < max_match && in[i+n] == in[p+n]) n++;
+    if (in[i+m->len] == in[p+m->len] && sdefl_uload32(&in[i]) == first) {
+      int n = sdefl_match_len(&in[i], &in[p], SDEFL_MIN_MATCH, max_match);
       if (n > m->len) {
         m->len = n, m->off = p - i;
-        if (n == max_match) break;
+        if (n >= nice_match) break;
       }
     }
     if (!(--chain_len)) break;
     i = s->prv[i&SDEFL_WIN_MSK];
   }
 }
+static void
+sdefl_ins(struct sdefl *s, const unsigned char *in, int in_len, int hash_len, int from, int to) {
+  /* add positions [from, to) to the hash chains, skipping the last few bytes */
+  for (; from < to && in_len - from > SDEFL_MIN_MATCH; ++from) {
+    unsigned h = sdefl_hash32(&in[from], hash_len);
+    s->prv[from&SDEFL_WIN_MSK] = s->tbl[h];
+    s->tbl[h] = from;
+  }
+}
 static int
 sdefl_compr(struct sdefl *s, unsigned char *out, const unsigned char *in,
-            int in_len, int lvl) {
+            int start, int in_len, int lvl) {
   unsigned char *q = out;
-  static const unsigned char pref[] = {8,10,14,24,30,48,65,96,130};
-  int max_chain = (lvl < 8) ? (1 << (lvl + 1)): (1 << 13);
-  int n, i = 0, litlen = 0;
+  const struct sdefl_lvl *cfg;
+  int n, i = start, litlen = 0;
+  struct sdefl_match prev = {0}; /* lazy match found at i-1, not emitted yet */
+  if (lvl < SDEFL_LVL_MIN) lvl = SDEFL_LVL_MIN;
+  if (lvl > SDEFL_LVL_MAX) lvl = SDEFL_LVL_MAX;
+  cfg = &sdefl_lvls[lvl];
   for (n = 0; n < SDEFL_HASH_SIZ; ++n) {
     s->tbl[n] = SDEFL_NIL;
   }
+  /* prime the match finder with the preset dictionary in front of the data */
+  sdefl_ins(s, in, in_len, cfg->hash, 0, start);
   do {int blk_end = i + SDEFL_BLK_MAX < in_len ? i + SDEFL_BLK_MAX : in_len;
-    while (i < blk_end) {
-      struct sdefl_match m = {0};
+    /* a block also ends before its sequence buffer can overflow */
+    while (i < blk_end && s->seq_cnt + 4 < SDEFL_SEQ_SIZ) {
+      struct sdefl_match m = prev;
       int max_match = ((in_len-i)>SDEFL_MAX_MATCH) ? SDEFL_MAX_MATCH:(in_len-i);
-      int nice_match = pref[lvl] < max_match ? pref[lvl] : max_match;
-      int run = 1, inc = 1, run_inc;
-      if (max_match > SDEFL_MIN_MATCH) {
-        sdefl_fnd(&m, s, max_chain, max_match, in, i);
+      int nice_match = cfg->nice < max_match ? cfg->nice : max_match;
+      if (max_match > SDEFL_MIN_MATCH && m.len < max_match && (!prev.len || prev.len < cfg->lazy)) {
+        int chain = prev.len >= cfg->good ? (cfg->chain >> 2) + 1 : cfg->chain;
+        sdefl_fnd(&m, s, chain, max_match, nice_match, cfg->hash, in, i);
       }
-      if (lvl >= 5 && m.len >= SDEFL_MIN_MATCH && m.len < nice_match){
-        struct sdefl_match m2 = {0};
-        sdefl_fnd(&m2, s, max_chain, m.len+1, in, i+1);
-        m.len = (m2.len > m.len) ? 0 : m.len;
+      if (prev.len) {
+        if (m.len > prev.len) {
+          /* the match one byte later is longer, the pending one becomes a literal */
+          s->freq.lit[in[i-1]]++;
+          litlen++;
+          prev = m;
+          sdefl_ins(s, in, in_len, cfg->hash, i, i + 1);
+          i++;
+          continue;
+        }
+        /* otherwise emit the pending match, it started at i-1 */
+        if (litlen) {
+          sdefl_seq(s, i - 1 - litlen, litlen);
+          litlen = 0;
+        }
+        sdefl_seq(s, -prev.off, prev.len);
+        sdefl_reg_match(s, prev.off, prev.len);
+        sdefl_ins(s, in, in_len, cfg->hash, i, i - 1 + prev.len);
+        i += prev.len - 1;
+        prev.len = 0;
+        continue;
       }
       if (m.len >= SDEFL_MIN_MATCH) {
+        if (m.len < cfg->lazy && i + 1 < blk_end) {
+          /* hold it back to see whether the next position does better */
+          prev = m;
+          sdefl_ins(s, in, in_len, cfg->hash, i, i + 1);
+          i++;
+          continue;
+        }
         if (litlen) {
           sdefl_seq(s, i - litlen, litlen);
           litlen = 0;
         }
         sdefl_seq(s, -m.off, m.len);
         sdefl_reg_match(s, m.off, m.len);
-        if (lvl < 2 && m.len >= nice_match) {
-          inc = m.len;
-        } else {
-          run = m.len;
-        }
+        /* the fastest levels don't index the inside of long matches */
+        sdefl_ins(s, in, in_len, cfg->hash, i, (lvl < 2 && m.len >= nice_match) ? i + 1 : i + m.len);
+        i += m.len;
       } else {
         s->freq.lit[in[i]]++;
         litlen++;
+        sdefl_ins(s, in, in_len, cfg->hash, i, i + 1);
+        i++;
       }
-      run_inc = run * inc;
-      if (in_len - (i + run_inc) > SDEFL_MIN_MATCH) {
-        while (run-- > 0) {
-          unsigned h = sdefl_hash32(&in[i]);
-          s->prv[i&SDEFL_WIN_MSK] = s->tbl[h];
-          s->tbl[h] = i, i += inc;
-        }
-      } else {
-        i += run_inc;
+    }
+    if (prev.len) {
+      /* the block ended right after a pending match, emit it as it is */
+      if (litlen) {
+        sdefl_seq(s, i - 1 - litlen, litlen);
+        litlen = 0;
       }
+      sdefl_seq(s, -prev.off, prev.len);
+      sdefl_reg_match(s, prev.off, prev.len);
+      sdefl_ins(s, in, in_len, cfg->hash, i, i - 1 + prev.len);
+      i += prev.len - 1;
+      prev.len = 0;
     }
     if (litlen) {
       sdefl_seq(s, i - litlen, litlen);
       litlen = 0;
     }
-    sdefl_flush(&q, s, blk_end == in_len, in);
+    sdefl_flush(&q, s, i >= in_len, in);
   } while (i < in_len);
 
   if (s->bitcnt)
@@ -634,7 +737,17 @@ sdefl_compr(struct sdefl *s, unsigned char *out, const unsigned char *in,
 extern int
 sdeflate(struct sdefl *s, void *out, const void *in, int n, int lvl) {
   s->bits = s->bitcnt = 0;
-  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, n, lvl);
+  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, 0, n, lvl);
+}
+extern int
+sdeflate_dict(struct sdefl *s, void *out, const void *in, int dict_len, int n, int lvl) {
+  /* in holds dict_len bytes of preset dictionary followed by the n bytes to compress */
+  if (dict_len > SDEFL_WIN_SIZ) {
+    in = (const unsigned char*)in + (dict_len - SDEFL_WIN_SIZ);
+    dict_len = SDEFL_WIN_SIZ;
+  }
+  s->bits = s->bitcnt = 0;
+  return sdefl_compr(s, (unsigned char*)out, (const unsigned char*)in, dict_len, dict_len + n, lvl);
 }
 static unsigned
 sdefl_adler32(unsigned adler32, const unsigned char *in, int in_len) {
@@ -676,7 +789,7 @@ zsdeflate(struct sdefl *s, void *out, const void *in, int n, int lvl) {
   s->bits = s->bitcnt = 0;
   sdefl_put(&q, s, 0x78, 8); /* deflate, 32k window */
   sdefl_put(&q, s, 0x01, 8); /* fast compression */
-  q += sdefl_compr(s, q, (const unsigned char*)in, n, lvl);
+  q += sdefl_compr(s, q, (const unsigned char*)in, 0, n, lvl);
 
   /* append adler checksum */
   a = sdefl_adler32(SDEFL_ADLER_INIT, (const unsigned char*)in, n);
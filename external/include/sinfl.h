@@ -129,6 +129,7 @@ struct sinfl {
   unsigned dsts[SINFL_OFF_TBL_SIZE];
 };
 extern int sinflate(void *out, int cap, const void *in, int size);
+extern int sinflate_dict(void *out, int dict_len, int cap, const void *in, int size);
 extern int zsinflate(void *out, int cap, const void *in, int size);
 
 #ifdef __cplusplus
@@ -365,7 +366,7 @@ sinfl_decode(struct sinfl *s, const unsigned *tbl, int bit_len) {
   return (key >> 16) & 0x0fff;
 }
 static int
-sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size) {
+sinfl_decompress(unsigned char *out, int dict_len, int cap, const unsigned char *in, int size) {
   static const unsigned char order[] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
   static const short dbase[30+2] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
       257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
@@ -377,7 +378,7 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
       4,4,4,5,5,5,5,0,0,0};
 
   const unsigned char *oe = out + cap;
-  const unsigned char *e = in + size, *o = out;
+  const unsigned char *e = in + size, *o = out, *win = out - dict_len;
   enum sinfl_states {hdr,stored,fixed,dyn,blk};
   enum sinfl_states state = hdr;
   struct sinfl s = {0};
@@ -484,7 +485,7 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
         int dsym = sinfl_decode(&s, s.dsts, 8);
         int offs = sinfl__get(&s, dbits[dsym]) + dbase[dsym];
         unsigned char *dst = out, *src = out - offs;
-        if (sinfl_unlikely(offs > (int)(out-o))) {
+        if (sinfl_unlikely(offs > (int)(out-win))) {
           return (int)(out-o);
         }
         out = out + len;
@@ -557,7 +558,12 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
 }
 extern int
 sinflate(void *out, int cap, const void *in, int size) {
-  return sinfl_decompress((unsigned char*)out, cap, (const unsigned char*)in, size);
+  return sinfl_decompress((unsigned char*)out, 0, cap, (const unsigned char*)in, size);
+}
+extern int
+sinflate_dict(void *out, int dict_len, int cap, const void *in, int size) {
+  /* out holds dict_len bytes of preset dictionary, the data is inflated right after them */
+  return sinfl_decompress((unsigned char*)out + dict_len, dict_len, cap, (const unsigned char*)in, size);
 }
 static unsigned
 sinfl_adler32(unsigned adler32, const unsigned char *in, int in_len) {
@@ -591,7 +597,7 @@ zsinflate(void *out, int cap, const void *mem, int size) {
   const unsigned char *in = (const unsigned char*)mem;
   if (size >= 6) {
     const unsigned char *eob = in + size - 4;
-    int n = sinfl_decompress((unsigned char*)out, cap, in + 2u, size);
+    int n = sinfl_decompress((unsigned char*)out, 0, cap, in + 2u, size);
     unsigned a = sinfl_adler32(1u, (unsigned char*)out, n);
     unsigned h = eob[0] << 24 | eob[1] << 16 | eob[2] << 8 | eob[3] << 0;
     return a == h ? n : -1;
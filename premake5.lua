@@ -12,6 +12,7 @@ project "exec"
    files {"src/**.cpp"}
    includedirs {"external/include/", "src/"}
    libdirs {"external/lib/"}
+   defines {"PACKR_TRACE"} -- Per-stage instrumentation, remove to compile it out
 
    filter "configurations:Debug"
        defines {"DEBUG", "ENABLE_XENON_LOGGER"}
@@ -20,3 +21,18 @@ project "exec"
    filter "configurations:Release"
        defines { "NDEBUG" }
        optimize "On"
+
+
+-- Benchmarks always build optimized, timings of a debug build mean nothing
+project "bench"
+   kind "ConsoleApp"
+   language "C++"
+   cppdialect "C++17"
+   targetdir "build"
+   objdir "build/obj/bench/"
+   files {"src/**.cpp", "bench/**.cpp"}
+   removefiles {"src/tests.cpp"}
+   includedirs {"external/include/", "src/"}
+   libdirs {"external/lib/"}
+   defines { "NDEBUG", "PACKR_TRACE" }
+   optimize "On"
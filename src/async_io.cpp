@@ -0,0 +1,326 @@
+#include "async_io.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <climits>
+#include <sched.h>
+
+#ifdef __linux__
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+    #include <sys/mman.h>
+#endif
+
+// Phases of a batch, every request goes through all three
+enum {
+    PHASE_OPEN = 0,
+    PHASE_TRANSFER,
+    PHASE_CLOSE,
+};
+static const long PENDING = LONG_MIN; // Result of an operation that never completed
+
+// Read or write the rest of a request on an open descriptor, returns the bytes done or -errno
+static long transfer_blocking(int fd, const IoRequest& request, size_t done) {
+    while (done < request.size) {
+        ssize_t count = request.write
+            ? pwrite(fd, request.data + done, request.size - done, static_cast<off_t>(request.offset + done))
+            : pread(fd, request.data + done, request.size - done, static_cast<off_t>(request.offset + done));
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        if (count == 0) break;
+        done += static_cast<size_t>(count);
+    }
+    return static_cast<long>(done);
+}
+
+void AsyncIo::run_blocking(IoRequest& request) {
+    int fd = open(request.path, request.open_flags | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        request.result = -errno;
+        return;
+    }
+    request.result = transfer_blocking(fd, request, 0);
+    close(fd);
+}
+
+AsyncIo::AsyncIo(IoBackend backend, unsigned depth)
+    : backend(backend), depth(std::max(depth, 1u)) {
+    if (backend == IO_BACKEND_URING) {
+        setup_ring();
+    }
+}
+
+AsyncIo::~AsyncIo() {
+    close_ring();
+}
+
+AsyncIo& AsyncIo::local(IoBackend backend, unsigned depth) {
+    thread_local std::unique_ptr<AsyncIo> io;
+    if (!io || io->backend != backend || io->depth != std::max(depth, 1u)) {
+        io.reset(new AsyncIo(backend, depth));
+    }
+    return *io;
+}
+
+void AsyncIo::run(IoRequest* requests, size_t count) {
+    size_t done = 0;
+    if (ring_fd >= 0) {
+        done = run_ring(requests, count);
+    }
+
+    // Without a ring, or once it failed, requests run one at a time
+    for (size_t i = done; i < count; i++) {
+        run_blocking(requests[i]);
+    }
+}
+
+#ifdef __linux__
+
+bool AsyncIo::setup_ring() {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    int fd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+    if (fd < 0) {
+        return false; // Not built into the kernel, or disabled for this process
+    }
+    ring_fd = fd;
+
+    // Every operation a batch uses must be supported, openat, read, write and close came with 5.6
+    const unsigned probe_ops = 256;
+    std::unique_ptr<char[]> probe_memory(new char[sizeof(io_uring_probe) + probe_ops * sizeof(io_uring_probe_op)]());
+    io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(probe_memory.get());
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, probe_ops) < 0) {
+        close_ring();
+        return false;
+    }
+    for (int op : { IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE }) {
+        if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+            close_ring();
+            return false;
+        }
+    }
+
+    // Map the submission and completion rings, a single mapping holds both on newer kernels
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+    }
+
+    void* mapping = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (mapping == MAP_FAILED) {
+        close_ring();
+        return false;
+    }
+    sq_ring = mapping;
+
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    }
+    else {
+        mapping = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (mapping == MAP_FAILED) {
+            close_ring();
+            return false;
+        }
+        cq_ring = mapping;
+    }
+
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    mapping = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (mapping == MAP_FAILED) {
+        close_ring();
+        return false;
+    }
+    sqes = mapping;
+
+    char* sq = static_cast<char*>(sq_ring);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = cq + params.cq_off.cqes;
+
+    entries = std::min(params.sq_entries, depth);
+    return true;
+}
+
+void AsyncIo::close_ring() {
+    if (sqes) munmap(sqes, sqes_size);
+    if (cq_ring && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+    if (sq_ring) munmap(sq_ring, sq_ring_size);
+    sqes = sq_ring = cq_ring = nullptr;
+    if (ring_fd >= 0) close(ring_fd);
+    ring_fd = -1;
+}
+
+bool AsyncIo::run_phase(int phase, IoRequest* requests, const unsigned* active, unsigned count,
+                        const int* fds, long* results) {
+    if (count == 0) return true;
+    std::fill(results, results + count, PENDING);
+
+    // Queue one operation per active request, tagged with its place in the batch
+    io_uring_sqe* queue = static_cast<io_uring_sqe*>(sqes);
+    unsigned first_tail = *sq_tail;
+    unsigned tail = first_tail;
+    for (unsigned i = 0; i < count; i++) {
+        const IoRequest& request = requests[active[i]];
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &queue[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+
+        if (phase == PHASE_OPEN) {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = reinterpret_cast<uint64_t>(request.path);
+            sqe->len = 0644;
+            sqe->open_flags = static_cast<uint32_t>(request.open_flags | O_CLOEXEC);
+        }
+        else if (phase == PHASE_TRANSFER) {
+            sqe->opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe->fd = fds[i];
+            sqe->addr = reinterpret_cast<uint64_t>(request.data);
+            sqe->len = static_cast<uint32_t>(request.size);
+            sqe->off = request.offset;
+        }
+        else {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fds[i];
+        }
+        sqe->user_data = i;
+        sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    // Submit them all and wait for every completion, usually with a single syscall
+    unsigned submitted = 0;
+    unsigned completed = 0;
+    while (completed < count) {
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, count - submitted, count - completed,
+                                           IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+
+            // Take back what the kernel never picked up, and wait for what it did, which may still
+            // use the buffers and descriptors. Only operations left PENDING are redone without the ring
+            unsigned picked_up = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) - first_tail;
+            __atomic_store_n(sq_tail, first_tail + picked_up, __ATOMIC_RELEASE);
+            reap(picked_up, completed, results);
+            return false;
+        }
+        submitted += static_cast<unsigned>(ret);
+        reap(0, completed, results);
+    }
+    return true;
+}
+
+void AsyncIo::reap(unsigned outstanding, unsigned& completed, long* results) {
+    io_uring_cqe* completions = static_cast<io_uring_cqe*>(cqes);
+    while (true) {
+        unsigned head = *cq_head;
+        unsigned end = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        while (head != end) {
+            const io_uring_cqe& cqe = completions[head & *cq_mask];
+            results[cqe.user_data] = cqe.res;
+            head++;
+            completed++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        if (completed >= outstanding) return;
+
+        // Wait for the rest, if the ring can't even do that the kernel still posts them as they finish
+        int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, 0, outstanding - completed,
+                                           IORING_ENTER_GETEVENTS, nullptr, 0));
+        if (ret < 0 && errno != EINTR) {
+            sched_yield();
+        }
+    }
+}
+
+size_t AsyncIo::run_ring(IoRequest* requests, size_t count) {
+    std::vector<unsigned> active(entries);
+    std::vector<int> fds(entries);
+    std::vector<long> results(entries);
+
+    for (size_t first = 0; first < count; first += entries) {
+        unsigned batch = static_cast<unsigned>(std::min<size_t>(entries, count - first));
+        IoRequest* part = requests + first;
+
+        // Open every file of the batch at once. If the ring breaks down, the files it
+        // never got to are handled directly and the ones it opened carry on without it
+        for (unsigned i = 0; i < batch; i++) active[i] = i;
+        bool ring_ok = run_phase(PHASE_OPEN, part, active.data(), batch, nullptr, results.data());
+        unsigned opened = 0;
+        for (unsigned i = 0; i < batch; i++) {
+            if (results[i] == PENDING) {
+                run_blocking(part[i]);
+                continue;
+            }
+            if (results[i] < 0) {
+                part[i].result = results[i];
+                continue;
+            }
+            active[opened] = i;
+            fds[opened] = static_cast<int>(results[i]);
+            opened++;
+        }
+
+        // Then read or write all of them, finishing short or missing transfers directly
+        if (ring_ok) {
+            ring_ok = run_phase(PHASE_TRANSFER, part, active.data(), opened, fds.data(), results.data());
+        }
+        else {
+            std::fill(results.begin(), results.begin() + opened, PENDING);
+        }
+        for (unsigned i = 0; i < opened; i++) {
+            IoRequest& request = part[active[i]];
+            if (results[i] == PENDING) {
+                request.result = transfer_blocking(fds[i], request, 0);
+            }
+            else if (results[i] > 0 && static_cast<size_t>(results[i]) < request.size) {
+                request.result = transfer_blocking(fds[i], request, static_cast<size_t>(results[i]));
+            }
+            else {
+                request.result = results[i];
+            }
+        }
+
+        // And close them, only closing directly what the ring didn't
+        if (ring_ok) {
+            ring_ok = run_phase(PHASE_CLOSE, part, active.data(), opened, fds.data(), results.data());
+        }
+        else {
+            std::fill(results.begin(), results.begin() + opened, PENDING);
+        }
+        if (!ring_ok) {
+            for (unsigned i = 0; i < opened; i++) {
+                if (results[i] == PENDING) close(fds[i]);
+            }
+            close_ring();
+            return first + batch;
+        }
+    }
+    return count;
+}
+
+#else
+
+// io_uring is Linux only, everything else uses the blocking calls
+bool AsyncIo::setup_ring() { return false; }
+void AsyncIo::close_ring() {}
+bool AsyncIo::run_phase(int, IoRequest*, const unsigned*, unsigned, const int*, long*) { return false; }
+void AsyncIo::reap(unsigned, unsigned&, long*) {}
+size_t AsyncIo::run_ring(IoRequest*, size_t) { return 0; }
+
+#endif
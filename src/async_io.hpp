@@ -0,0 +1,74 @@
+#ifndef ASYNC_IO_HPP
+    #define ASYNC_IO_HPP
+    #include <cstdint>
+    #include <cstddef>
+    #include <vector>
+
+    // Backends for reading input files and writing extracted ones
+    enum IoBackend {
+        IO_BACKEND_PREAD = 0, // Blocking open/pread/pwrite/close, one file at a time
+        IO_BACKEND_URING, // io_uring on Linux, falls back to pread where it isn't available
+    };
+
+    // Struct for one whole-file operation: open path, read or write size bytes at offset, close
+    struct IoRequest {
+        const char* path = nullptr;
+        int open_flags = 0; // O_RDONLY for reads, O_WRONLY (| O_CREAT | O_TRUNC) for writes
+        bool write = false;
+        uint64_t offset = 0;
+        char* data = nullptr;
+        size_t size = 0;
+        long result = 0; // Bytes transferred, or -errno
+
+        bool done() const { return result >= 0 && static_cast<size_t>(result) == size; }
+    };
+
+    // Implements batched file I/O for one thread. With io_uring, the opens, transfers and
+    // closes of up to depth requests are each submitted with a single syscall, so many small
+    // files cost a handful of syscalls instead of four each
+    class AsyncIo {
+        private:
+            IoBackend backend;
+            unsigned depth;
+            int ring_fd = -1;
+            unsigned entries = 0; // Requests per batch, the ring's size
+
+            // Rings shared with the kernel
+            void* sq_ring = nullptr;
+            size_t sq_ring_size = 0;
+            void* cq_ring = nullptr;
+            size_t cq_ring_size = 0;
+            void* sqes = nullptr;
+            size_t sqes_size = 0;
+            unsigned* sq_head = nullptr;
+            unsigned* sq_tail = nullptr;
+            unsigned* sq_mask = nullptr;
+            unsigned* sq_array = nullptr;
+            unsigned* cq_head = nullptr;
+            unsigned* cq_tail = nullptr;
+            unsigned* cq_mask = nullptr;
+            void* cqes = nullptr;
+
+            bool setup_ring();
+            void close_ring();
+            size_t run_ring(IoRequest* requests, size_t count); // Returns how many requests it ran
+            bool run_phase(int phase, IoRequest* requests, const unsigned* active, unsigned count,
+                           const int* fds, long* results); // False if the ring broke, after what it started finished
+            void reap(unsigned outstanding, unsigned& completed, long* results); // Wait for operations already submitted
+            static void run_blocking(IoRequest& request);
+        public:
+            AsyncIo(IoBackend backend, unsigned depth = 64);
+            ~AsyncIo();
+            AsyncIo(const AsyncIo&) = delete;
+            AsyncIo& operator=(const AsyncIo&) = delete;
+
+            bool uses_uring() const { return ring_fd >= 0; }
+
+            // Run every request, filling in its result
+            void run(IoRequest* requests, size_t count);
+            void run(std::vector<IoRequest>& requests) { run(requests.data(), requests.size()); }
+
+            // This thread's instance for a backend, recreated when the backend or depth changes
+            static AsyncIo& local(IoBackend backend, unsigned depth);
+    };
+#endif
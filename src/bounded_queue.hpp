@@ -0,0 +1,67 @@
+#ifndef BOUNDED_QUEUE_HPP
+    #define BOUNDED_QUEUE_HPP
+    #include <deque>
+    #include <mutex>
+    #include <condition_variable>
+
+    // Implements a fixed-capacity queue connecting two pipeline stages.
+    // push() blocks while the queue is full, pop() blocks while it is empty.
+    // Once closed, push() fails and pop() fails after the last item is taken.
+    template <typename T>
+    class BoundedQueue {
+        private:
+            std::deque<T> items;
+            size_t capacity;
+            bool closed = false;
+
+            std::mutex mutex;
+            std::condition_variable not_full;
+            std::condition_variable not_empty;
+        public:
+            BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1) {}
+
+            bool push(T item) {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+                if (closed) return false;
+
+                items.push_back(std::move(item));
+                lock.unlock();
+                not_empty.notify_one();
+                return true;
+            }
+
+            bool pop(T& item) {
+                std::unique_lock<std::mutex> lock(mutex);
+                not_empty.wait(lock, [&] { return closed || !items.empty(); });
+                if (items.empty()) return false;
+
+                item = std::move(items.front());
+                items.pop_front();
+                lock.unlock();
+                not_full.notify_one();
+                return true;
+            }
+
+            // Take an item only if one is waiting
+            bool try_pop(T& item) {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (items.empty()) return false;
+
+                item = std::move(items.front());
+                items.pop_front();
+                lock.unlock();
+                not_full.notify_one();
+                return true;
+            }
+
+            void close() {
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    closed = true;
+                }
+                not_full.notify_all();
+                not_empty.notify_all();
+            }
+    };
+#endif
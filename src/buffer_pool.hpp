@@ -0,0 +1,99 @@
+#ifndef BUFFER_POOL_HPP
+    #define BUFFER_POOL_HPP
+    #include <cstddef>
+    #include <memory>
+    #include <vector>
+    #include <mutex>
+
+    // Implements a move-only byte buffer that is never zero-filled.
+    // Its capacity only grows, so a buffer reused for chunks of up to
+    // some size stops allocating once it reached that size.
+    class Buffer {
+        private:
+            std::unique_ptr<char[]> bytes;
+            size_t length = 0;
+            size_t room = 0;
+        public:
+            Buffer() = default;
+            Buffer(Buffer&& other) noexcept { swap(other); }
+            Buffer& operator=(Buffer&& other) noexcept {
+                swap(other);
+                return *this;
+            }
+            Buffer(const Buffer&) = delete;
+            Buffer& operator=(const Buffer&) = delete;
+
+            // Make the buffer size bytes long, its old contents are lost if it has to grow
+            void prepare(size_t size) {
+                if (size > room) {
+                    bytes.reset(new char[size]);
+                    room = size;
+                }
+                length = size;
+            }
+            void shrink(size_t size) { if (size < length) length = size; } // Keeps the contents
+
+            char* data() { return bytes.get(); }
+            const char* data() const { return bytes.get(); }
+            size_t size() const { return length; }
+            size_t capacity() const { return room; }
+
+            void swap(Buffer& other) noexcept {
+                std::swap(bytes, other.bytes);
+                std::swap(length, other.length);
+                std::swap(room, other.room);
+            }
+    };
+
+    // Implements a free list of buffers, so chunk buffers are recycled instead of reallocated.
+    // Every thread has its own through local(), a pipeline passing buffers
+    // from one thread to another shares one instead.
+    class BufferPool {
+        private:
+            std::mutex mutex;
+            std::vector<Buffer> buffers;
+            size_t max_buffers;
+        public:
+            BufferPool(size_t max_buffers = 4) : max_buffers(max_buffers) {}
+
+            // Take a buffer of size bytes, reusing one big enough if there is any
+            Buffer acquire(size_t size) {
+                Buffer buffer;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!buffers.empty()) {
+                        // Smallest that fits, or else the biggest, which grows the least
+                        size_t best = 0;
+                        for (size_t i = 1; i < buffers.size(); i++) {
+                            bool fits = buffers[i].capacity() >= size;
+                            bool best_fits = buffers[best].capacity() >= size;
+                            if (fits ? (!best_fits || buffers[i].capacity() < buffers[best].capacity())
+                                     : (!best_fits && buffers[i].capacity() > buffers[best].capacity())) {
+                                best = i;
+                            }
+                        }
+                        buffer = std::move(buffers[best]);
+                        buffers[best] = std::move(buffers.back());
+                        buffers.pop_back();
+                    }
+                }
+                buffer.prepare(size);
+                return buffer;
+            }
+
+            // Give a buffer back, it is freed if the pool is already full
+            void release(Buffer buffer) {
+                if (buffer.capacity() == 0) return;
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (buffers.size() < max_buffers) {
+                    buffers.push_back(std::move(buffer));
+                }
+            }
+
+            static BufferPool& local() {
+                thread_local BufferPool pool;
+                return pool;
+            }
+    };
+#endif
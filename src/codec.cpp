@@ -0,0 +1,263 @@
+#include "codec.hpp"
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#define SINFL_IMPLEMENTATION
+#define SDEFL_IMPLEMENTATION
+#include "sinfl.h"
+#include "sdefl.h"
+
+// Deflate through the bundled sdefl/sinfl
+class DeflateCodec : public Codec {
+    public:
+        const char* name() const override { return "deflate"; }
+
+        size_t bound(size_t size) const override {
+            return static_cast<size_t>(sdefl_bound(static_cast<int>(size)));
+        }
+
+        uint32_t compress(const char* data, uint32_t size, uint32_t dict_size, char* out, int level) const override {
+            thread_local sdefl ctx{};
+            if (dict_size == 0) {
+                return static_cast<uint32_t>(sdeflate(&ctx, out, data, static_cast<int>(size), level));
+            }
+            return static_cast<uint32_t>(sdeflate_dict(&ctx, out, data - dict_size, static_cast<int>(dict_size),
+                                                       static_cast<int>(size), level));
+        }
+
+        long decompress(const char* in, uint32_t in_size, char* out, uint32_t dict_size,
+                        uint32_t capacity) const override {
+            return sinflate_dict(out, static_cast<int>(dict_size), static_cast<int>(capacity),
+                                 in, static_cast<int>(in_size));
+        }
+};
+
+// LZ4 block format: sequences of a token (literal length << 4 | match length - 4), extra
+// length bytes, the literals, a 16-bit offset and extra match length bytes. The last
+// sequence only holds literals, and matches end well before the data does, which lets
+// the decoder copy 16 bytes at a time
+static const int LZ_MIN_MATCH = 4;
+static const int LZ_LAST_LITERALS = 5; // The data always ends with this many literals
+static const int LZ_MATCH_LIMIT = 12; // No match starts closer than this to the end
+static const uint32_t LZ_MAX_OFFSET = 65535;
+static const int LZ_HASH_BITS = 16;
+static const uint32_t LZ_WINDOW_MASK = 0xFFFF;
+
+static inline uint32_t lz_read32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(const unsigned char* p) {
+    return (lz_read32(p) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Count the bytes a and b share, up to limit, eight at a time
+static inline size_t lz_match_length(const unsigned char* a, const unsigned char* b, size_t limit) {
+    size_t n = 0;
+#if defined(__GNUC__) || defined(__clang__)
+    while (n + 8 <= limit) {
+        uint64_t x, y;
+        std::memcpy(&x, a + n, sizeof(x));
+        std::memcpy(&y, b + n, sizeof(y));
+        if (x != y) return n + (__builtin_ctzll(x ^ y) >> 3);
+        n += 8;
+    }
+#endif
+    while (n < limit && a[n] == b[n]) n++;
+    return n;
+}
+
+static inline unsigned char* lz_write_length(unsigned char* op, size_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = static_cast<unsigned char>(length);
+    return op;
+}
+
+static inline unsigned char* lz_write_sequence(unsigned char* op, const unsigned char* literals, size_t literal_count,
+                                               uint32_t offset, size_t match_length) {
+    unsigned char* token = op++;
+    *token = static_cast<unsigned char>(std::min<size_t>(literal_count, 15) << 4);
+    if (literal_count >= 15) op = lz_write_length(op, literal_count - 15);
+    std::memcpy(op, literals, literal_count);
+    op += literal_count;
+    if (match_length == 0) return op; // Last literals
+
+    *op++ = static_cast<unsigned char>(offset);
+    *op++ = static_cast<unsigned char>(offset >> 8);
+    size_t extra = match_length - LZ_MIN_MATCH;
+    *token |= static_cast<unsigned char>(std::min<size_t>(extra, 15));
+    if (extra >= 15) op = lz_write_length(op, extra - 15);
+    return op;
+}
+
+// Read an extended length, false when it runs past the input
+static inline bool lz_read_length(const unsigned char*& ip, const unsigned char* iend, size_t& length) {
+    unsigned char byte;
+    do {
+        if (ip >= iend) return false;
+        byte = *ip++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+// LZ4-class codec: a single hash probe at the fast levels, a short hash chain at the higher
+// ones, and a decoder that is little more than memcpy
+class LzCodec : public Codec {
+    public:
+        const char* name() const override { return "lz"; }
+
+        size_t bound(size_t size) const override {
+            return size + size / 255 + 16;
+        }
+
+        uint32_t compress(const char* data, uint32_t size, uint32_t dict_size, char* out, int level) const override {
+            dict_size = std::min(dict_size, LZ_MAX_OFFSET);
+            const unsigned char* base = reinterpret_cast<const unsigned char*>(data) - dict_size;
+            const unsigned char* anchor = base + dict_size;
+            const unsigned char* end = anchor + size;
+            unsigned char* op = reinterpret_cast<unsigned char*>(out);
+
+            // Positions are kept relative to base, the chain links the previous 64 KiB
+            thread_local std::vector<int32_t> head;
+            thread_local std::vector<int32_t> chain;
+            head.assign(size_t(1) << LZ_HASH_BITS, -1);
+            chain.resize(LZ_WINDOW_MASK + 1);
+            int depth = level <= 2 ? 1 : std::min(1 << (level - 2), 64);
+            auto insert = [&](const unsigned char* p) {
+                uint32_t h = lz_hash(p);
+                int32_t position = static_cast<int32_t>(p - base);
+                chain[position & LZ_WINDOW_MASK] = head[h];
+                head[h] = position;
+            };
+            for (const unsigned char* p = base; p < anchor && p + LZ_MIN_MATCH <= end; p++) {
+                insert(p);
+            }
+
+            if (size > static_cast<uint32_t>(LZ_MATCH_LIMIT)) {
+                const unsigned char* ip = anchor;
+                const unsigned char* match_limit = end - LZ_MATCH_LIMIT;
+                const unsigned char* length_limit = end - LZ_LAST_LITERALS;
+                unsigned misses = 0; // Incompressible stretches are skipped faster and faster
+                while (ip <= match_limit) {
+                    // Find the longest match among the chain's first depth candidates
+                    int32_t position = static_cast<int32_t>(ip - base);
+                    int32_t candidate = head[lz_hash(ip)];
+                    uint32_t first = lz_read32(ip);
+                    size_t best_length = 0;
+                    int32_t best = -1;
+                    for (int tries = depth; candidate >= 0 && tries > 0; tries--) {
+                        if (static_cast<uint32_t>(position - candidate) > LZ_MAX_OFFSET) break;
+                        const unsigned char* ref = base + candidate;
+                        if (lz_read32(ref) == first) {
+                            size_t length = LZ_MIN_MATCH + lz_match_length(ref + LZ_MIN_MATCH, ip + LZ_MIN_MATCH,
+                                                                           length_limit - ip - LZ_MIN_MATCH);
+                            if (length > best_length) {
+                                best_length = length;
+                                best = candidate;
+                            }
+                        }
+                        candidate = chain[candidate & LZ_WINDOW_MASK];
+                    }
+                    insert(ip);
+
+                    if (best < 0) {
+                        ip += 1 + (misses++ >> 6);
+                        continue;
+                    }
+                    misses = 0;
+
+                    // Matches often start a little earlier than the hash found them
+                    const unsigned char* ref = base + best;
+                    while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                        ip--;
+                        ref--;
+                        best_length++;
+                    }
+
+                    op = lz_write_sequence(op, anchor, ip - anchor, static_cast<uint32_t>(ip - ref), best_length);
+                    const unsigned char* next = ip + best_length;
+
+                    // The chained levels index the whole match, the fast ones only its end
+                    const unsigned char* p = depth > 1 ? ip + 1 : std::max(ip + 1, next - 2);
+                    for (; p < next && p <= match_limit; p++) {
+                        insert(p);
+                    }
+                    ip = next;
+                    anchor = ip;
+                }
+            }
+
+            op = lz_write_sequence(op, anchor, end - anchor, 0, 0);
+            return static_cast<uint32_t>(op - reinterpret_cast<unsigned char*>(out));
+        }
+
+        long decompress(const char* in, uint32_t in_size, char* out, uint32_t dict_size,
+                        uint32_t capacity) const override {
+            const unsigned char* ip = reinterpret_cast<const unsigned char*>(in);
+            const unsigned char* iend = ip + in_size;
+            unsigned char* low = reinterpret_cast<unsigned char*>(out); // Matches may reach into the dictionary
+            unsigned char* op = low + dict_size;
+            unsigned char* oend = op + capacity;
+
+            for (;;) {
+                if (ip >= iend) return -1;
+                unsigned token = *ip++;
+
+                // Literals, short runs are copied 16 bytes at once when there is room
+                size_t literals = token >> 4;
+                if (literals == 15 && !lz_read_length(ip, iend, literals)) return -1;
+                if (literals > static_cast<size_t>(iend - ip) || literals > static_cast<size_t>(oend - op)) return -1;
+                if (literals <= 16 && iend - ip >= 16 && oend - op >= 16) {
+                    std::memcpy(op, ip, 16);
+                }
+                else if (literals > 0) {
+                    std::memcpy(op, ip, literals);
+                }
+                op += literals;
+                ip += literals;
+                if (ip == iend) break;
+
+                // Match
+                if (iend - ip < 2) return -1;
+                size_t offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+                ip += 2;
+                if (offset == 0 || offset > static_cast<size_t>(op - low)) return -1;
+                size_t length = token & 15;
+                if (length == 15 && !lz_read_length(ip, iend, length)) return -1;
+                length += LZ_MIN_MATCH;
+                if (length > static_cast<size_t>(oend - op)) return -1;
+
+                const unsigned char* match = op - offset;
+                unsigned char* match_end = op + length;
+                if (offset >= 16 && static_cast<size_t>(oend - op) >= length + 15) {
+                    for (; op < match_end; op += 16, match += 16) std::memcpy(op, match, 16);
+                }
+                else if (offset >= 8 && static_cast<size_t>(oend - op) >= length + 7) {
+                    for (; op < match_end; op += 8, match += 8) std::memcpy(op, match, 8);
+                }
+                else {
+                    // Overlapping copies repeat the last offset bytes, one byte at a time
+                    for (; op < match_end; op++, match++) *op = *match;
+                }
+                op = match_end;
+            }
+            return static_cast<long>(op - (low + dict_size));
+        }
+};
+
+const Codec* Codec::get(uint32_t id) {
+    static const DeflateCodec deflate;
+    static const LzCodec lz;
+    switch (id) {
+        case CODEC_DEFLATE: return &deflate;
+        case CODEC_LZ: return &lz;
+        default: return nullptr;
+    }
+}
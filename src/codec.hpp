@@ -0,0 +1,29 @@
+#ifndef CODEC_HPP
+    #define CODEC_HPP
+    #include <cstdint>
+    #include <cstddef>
+
+    // Codecs a chunk can be compressed with, recorded in its header
+    enum CodecId {
+        CODEC_DEFLATE = 0, // sdefl/sinfl Deflate, the best ratio
+        CODEC_LZ, // Byte-oriented LZ77 in the LZ4 block format, trades ratio for much faster decoding
+        CODEC_COUNT,
+        CODEC_AUTO = 255, // Options only: picked per chunk from a sample of its data
+    };
+
+    // Implements an interface every codec provides. Both directions can be primed with a preset
+    // dictionary: compress finds dict_size bytes of it right before data, decompress finds
+    // them right before out and writes behind them
+    class Codec {
+        public:
+            virtual ~Codec() = default;
+
+            virtual const char* name() const = 0;
+            virtual size_t bound(size_t size) const = 0; // Largest compressed size of size bytes
+            virtual uint32_t compress(const char* data, uint32_t size, uint32_t dict_size, char* out, int level) const = 0;
+            virtual long decompress(const char* in, uint32_t in_size, char* out, uint32_t dict_size,
+                                    uint32_t capacity) const = 0; // Bytes written, or -1 for corrupt data
+
+            static const Codec* get(uint32_t id); // nullptr for ids this build doesn't know
+    };
+#endif
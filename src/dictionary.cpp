@@ -0,0 +1,110 @@
+#include "dictionary.hpp"
+#include <cstring>
+#include <algorithm>
+
+// Substrings are counted as k-mers of 8 bytes, dictionaries are made of 64-byte segments
+static const size_t KMER_SIZE = 8;
+static const size_t SEGMENT_SIZE = 64;
+static const int TABLE_BITS = 20;
+
+static inline uint32_t hash_kmer(const char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return static_cast<uint32_t>((v * 0x9E3779B185EBCA87ULL) >> (64 - TABLE_BITS));
+}
+
+// Struct for a segment picked for the dictionary
+struct Segment {
+    size_t sample;
+    size_t offset;
+    size_t size;
+    uint64_t score;
+};
+
+std::string train_dictionary(const std::vector<std::string>& samples, size_t dict_size) {
+    if (dict_size == 0) return std::string();
+
+    // Count how many samples every k-mer occurs in, once per sample
+    std::vector<uint32_t> counts(size_t(1) << TABLE_BITS, 0);
+    std::vector<uint32_t> last_sample(size_t(1) << TABLE_BITS, UINT32_MAX);
+    uint64_t total = 0;
+    for (size_t s = 0; s < samples.size(); s++) {
+        const std::string& sample = samples[s];
+        for (size_t p = 0; p + KMER_SIZE <= sample.size(); p++) {
+            uint32_t h = hash_kmer(sample.data() + p);
+            if (last_sample[h] != s) {
+                last_sample[h] = static_cast<uint32_t>(s);
+                counts[h]++;
+            }
+        }
+        total += sample.size();
+    }
+
+    // A k-mer only scores when other samples share it, a segment scores the sum of its k-mers.
+    // Prefix sums over a sample's k-mers give any window's score at once
+    std::vector<uint64_t> prefix;
+    auto build_prefix = [&](const std::string& sample) {
+        size_t kmers = sample.size() >= KMER_SIZE ? sample.size() - KMER_SIZE + 1 : 0;
+        prefix.assign(kmers + 1, 0);
+        for (size_t p = 0; p < kmers; p++) {
+            uint32_t count = counts[hash_kmer(sample.data() + p)];
+            prefix[p + 1] = prefix[p] + (count >= 2 ? count : 0);
+        }
+    };
+
+    // Split the samples into one epoch per segment the dictionary holds and keep the best
+    // segment of each, so the dictionary covers the whole input set and not just its start
+    size_t segment_count = std::max<size_t>(dict_size / SEGMENT_SIZE, 1);
+    uint64_t epoch_size = std::max<uint64_t>(total / segment_count, SEGMENT_SIZE);
+
+    std::vector<Segment> segments;
+    Segment best{0, 0, 0, 0};
+    uint64_t epoch_used = 0;
+    auto commit = [&]() {
+        if (best.score > 0) {
+            // Its k-mers are covered now, they shouldn't make other segments win again
+            const std::string& sample = samples[best.sample];
+            for (size_t p = best.offset; p + KMER_SIZE <= best.offset + best.size; p++) {
+                counts[hash_kmer(sample.data() + p)] = 0;
+            }
+            segments.push_back(best);
+        }
+        best = Segment{0, 0, 0, 0};
+        epoch_used = 0;
+    };
+
+    for (size_t s = 0; s < samples.size(); s++) {
+        const std::string& sample = samples[s];
+        if (sample.size() < KMER_SIZE) continue;
+
+        build_prefix(sample);
+        size_t kmers = prefix.size() - 1;
+        for (size_t p = 0; p < kmers; p++) {
+            size_t end = std::min(p + SEGMENT_SIZE - KMER_SIZE + 1, kmers);
+            uint64_t score = prefix[end] - prefix[p];
+            if (score > best.score) {
+                best = Segment{s, p, std::min(SEGMENT_SIZE, sample.size() - p), score};
+            }
+
+            if (++epoch_used >= epoch_size) {
+                bool same_sample = best.score > 0 && best.sample == s;
+                commit();
+                if (same_sample) build_prefix(sample);
+            }
+        }
+    }
+    commit();
+
+    // Best segments go last, where the data that follows reaches them with the shortest distances
+    std::stable_sort(segments.begin(), segments.end(), [](const Segment& a, const Segment& b) {
+        return a.score < b.score;
+    });
+    std::string dictionary;
+    for (const Segment& segment : segments) {
+        dictionary.append(samples[segment.sample], segment.offset, segment.size);
+    }
+    if (dictionary.size() > dict_size) {
+        dictionary.erase(0, dictionary.size() - dict_size);
+    }
+    return dictionary;
+}
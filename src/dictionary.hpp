@@ -0,0 +1,12 @@
+#ifndef DICTIONARY_HPP
+    #define DICTIONARY_HPP
+    #include <cstdint>
+    #include <cstddef>
+    #include <string>
+    #include <vector>
+
+    // Build a preset dictionary of up to dict_size bytes from sample data.
+    // Picks the segments made of the substrings found in the most samples (license headers,
+    // boilerplate, common tokens), the most valuable ones last so they stay closest to the data.
+    std::string train_dictionary(const std::vector<std::string>& samples, size_t dict_size);
+#endif
@@ -0,0 +1,207 @@
+#include "hash.hpp"
+#include <cstring>
+
+// XXH64 primes
+static const uint64_t PRIME_1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME_3 = 0x165667B19E3779F9ULL;
+static const uint64_t PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * PRIME_2;
+    acc = rotl(acc, 31);
+    return acc * PRIME_1;
+}
+
+static inline uint64_t merge_round(uint64_t acc, uint64_t val) {
+    acc ^= hash_round(0, val);
+    return acc * PRIME_1 + PRIME_4;
+}
+
+uint64_t hash_data(const void* data, size_t size, uint64_t seed) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    uint64_t h;
+
+    if (size >= 32) {
+        // Four independent lanes, so the loop keeps the CPU's pipelines full
+        uint64_t v1 = seed + PRIME_1 + PRIME_2;
+        uint64_t v2 = seed + PRIME_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME_1;
+
+        const unsigned char* limit = end - 32;
+        do {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = merge_round(h, v1);
+        h = merge_round(h, v2);
+        h = merge_round(h, v3);
+        h = merge_round(h, v4);
+    }
+    else {
+        h = seed + PRIME_5;
+    }
+
+    h += static_cast<uint64_t>(size);
+
+    // Tail
+    while (p + 8 <= end) {
+        h ^= hash_round(0, read64(p));
+        h = rotl(h, 27) * PRIME_1 + PRIME_4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= static_cast<uint64_t>(read32(p)) * PRIME_1;
+        h = rotl(h, 23) * PRIME_2 + PRIME_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * PRIME_5;
+        h = rotl(h, 11) * PRIME_1;
+        p++;
+    }
+
+    // Avalanche
+    h ^= h >> 33;
+    h *= PRIME_2;
+    h ^= h >> 29;
+    h *= PRIME_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Stripes of 64 bytes are accumulated into 8 lanes, 16 stripes make a block
+#define STRIPE_SIZE 64
+#define STRIPES_PER_BLOCK 16
+#define SECRET_WORDS (8 + STRIPES_PER_BLOCK)
+static const uint64_t PRIME32_1 = 0x9E3779B1ULL;
+
+// Per-lane keys, every stripe of a block uses them shifted by one word
+static const uint64_t* get_secret() {
+    static uint64_t secret[SECRET_WORDS];
+    static bool ready = [] {
+        // splitmix64
+        uint64_t state = PRIME_5;
+        for (int i = 0; i < SECRET_WORDS; i++) {
+            uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            secret[i] = z ^ (z >> 31);
+        }
+        return true;
+    }();
+    (void)ready;
+    return secret;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+// Same as the scalar version below, two lanes per register
+static void accumulate_block(uint64_t* acc, const unsigned char* p, size_t stripes,
+                             const uint64_t* secret) {
+    __m128i lanes[4];
+    for (int i = 0; i < 4; i++) {
+        lanes[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + 2 * i));
+    }
+
+    for (size_t s = 0; s < stripes; s++) {
+        const unsigned char* stripe = p + s * STRIPE_SIZE;
+        for (int i = 0; i < 4; i++) {
+            __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(stripe + 16 * i));
+            __m128i key = _mm_loadu_si128(reinterpret_cast<const __m128i*>(secret + s + 2 * i));
+            __m128i data_key = _mm_xor_si128(data, key);
+            __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+            __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+            __m128i data_swap = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+            lanes[i] = _mm_add_epi64(lanes[i], _mm_add_epi64(product, data_swap));
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + 2 * i), lanes[i]);
+    }
+}
+#else
+static void accumulate_block(uint64_t* acc, const unsigned char* p, size_t stripes,
+                             const uint64_t* secret) {
+    for (size_t s = 0; s < stripes; s++) {
+        const unsigned char* stripe = p + s * STRIPE_SIZE;
+        for (int i = 0; i < 8; i++) {
+            uint64_t data = read64(stripe + 8 * i);
+            uint64_t data_key = data ^ secret[s + i];
+            acc[i ^ 1] += data;
+            acc[i] += (data_key & 0xFFFFFFFFULL) * (data_key >> 32);
+        }
+    }
+}
+#endif
+
+// Stir the lanes between blocks, so the order of blocks matters
+static void scramble(uint64_t* acc, const uint64_t* secret) {
+    for (int i = 0; i < 8; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= secret[STRIPES_PER_BLOCK + i];
+        acc[i] = a * PRIME32_1;
+    }
+}
+
+static inline uint64_t mix(uint64_t a, uint64_t b) {
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+uint64_t checksum_data(const void* data, size_t size) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    if (size < STRIPE_SIZE) {
+        return hash_data(p, size, PRIME_4);
+    }
+
+    const uint64_t* secret = get_secret();
+    uint64_t acc[8] = { PRIME32_1, PRIME_1, PRIME_2, PRIME_3, PRIME_4, PRIME32_1, PRIME_5, PRIME_1 };
+
+    // Whole blocks, then whatever stripes are left
+    size_t stripes = size / STRIPE_SIZE;
+    size_t block_size = STRIPE_SIZE * STRIPES_PER_BLOCK;
+    size_t blocks = stripes / STRIPES_PER_BLOCK;
+    for (size_t b = 0; b < blocks; b++) {
+        accumulate_block(acc, p + b * block_size, STRIPES_PER_BLOCK, secret);
+        scramble(acc, secret);
+    }
+    accumulate_block(acc, p + blocks * block_size, stripes % STRIPES_PER_BLOCK, secret);
+
+    // Merge the lanes
+    uint64_t h = static_cast<uint64_t>(size) * PRIME_1;
+    for (int i = 0; i < 4; i++) {
+        h += mix(acc[2 * i] ^ secret[2 * i], acc[2 * i + 1] ^ secret[2 * i + 1]);
+    }
+
+    // The tail that doesn't fill a stripe goes through XXH64, seeded with the rest
+    size_t done = stripes * STRIPE_SIZE;
+    return hash_data(p + done, size - done, h);
+}
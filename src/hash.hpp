@@ -0,0 +1,11 @@
+#ifndef HASH_HPP
+    #define HASH_HPP
+    #include <cstdint>
+    #include <cstddef>
+
+    // 64-bit non-cryptographic hash (XXH64), used to spot changed data
+    uint64_t hash_data(const void* data, size_t size, uint64_t seed = 0);
+
+    // Faster checksum over 64-byte stripes (SSE2 where available), used to verify stored data
+    uint64_t checksum_data(const void* data, size_t size);
+#endif
@@ -0,0 +1,214 @@
+#include "output_tree.hpp"
+#include "trace.hpp"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <filesystem>
+#include <algorithm>
+#include <stdexcept>
+
+OutputTree::DirectoryFd::~DirectoryFd() {
+    if (fd >= 0) close(fd);
+}
+
+OutputTree::OutputTree(const std::string& out_path, bool restore_metadata, size_t max_open)
+    : root(out_path), restore_metadata(restore_metadata), max_open(std::max<size_t>(max_open, 1)) {
+    std::filesystem::create_directories(root);
+    root_fd = std::make_shared<DirectoryFd>();
+    root_fd->fd = open(root.c_str(), O_RDONLY | O_DIRECTORY);
+    if (root_fd->fd < 0) {
+        throw std::runtime_error("PackrFile error: failed to open directory: " + root);
+    }
+    directories.push_back(Directory{ "", 0, "" });
+    directory_ids[""] = 0;
+}
+
+// Get a directory's fd, opening it relative to the root unless the cache still holds it
+std::shared_ptr<OutputTree::DirectoryFd> OutputTree::open_directory(size_t id) {
+    if (id == 0) {
+        return root_fd;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = open_directories.find(id);
+    if (found != open_directories.end()) {
+        order.splice(order.begin(), order, found->second.order);
+        return found->second.fd;
+    }
+
+    auto directory = std::make_shared<DirectoryFd>();
+    directory->fd = openat(root_fd->fd, directories[id].path.c_str(), O_RDONLY | O_DIRECTORY);
+    if (directory->fd < 0) {
+        throw std::runtime_error("PackrFile error: failed to open directory: " + root + "/" + directories[id].path);
+    }
+
+    // Writers still using an evicted directory keep its fd open until they are done
+    if (open_directories.size() >= max_open) {
+        open_directories.erase(order.back());
+        order.pop_back();
+    }
+    order.push_front(id);
+    open_directories[id] = CacheSlot{ directory, order.begin() };
+    return directory;
+}
+
+// Create a directory below the root, and its parents before it
+size_t OutputTree::add_directory(const std::string& path) {
+    auto found = directory_ids.find(path);
+    if (found != directory_ids.end()) {
+        return found->second;
+    }
+
+    size_t slash = path.rfind('/');
+    size_t parent = add_directory(slash == std::string::npos ? std::string() : path.substr(0, slash));
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    {
+        PACKR_SCOPE(STAGE_WRITE, 0, path);
+        std::shared_ptr<DirectoryFd> parent_fd = open_directory(parent);
+        if (mkdirat(parent_fd->fd, name.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error("PackrFile error: failed to create directory: " + root + "/" + path);
+        }
+    }
+
+    size_t id;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        id = directories.size();
+        directories.push_back(Directory{ path, parent, name });
+    }
+    directory_ids.emplace(path, id);
+    return id;
+}
+
+// Reserve a split file's space in one go, so blocks written out of order don't fragment it
+static bool preallocate(int fd, uint64_t size) {
+#ifdef __linux__
+    if (fallocate(fd, 0, 0, static_cast<off_t>(size)) == 0) return true;
+#endif
+    // Where that isn't supported the file at least gets its full size
+    return ftruncate(fd, static_cast<off_t>(size)) == 0;
+}
+
+bool OutputTree::add_file(const DataHeader& header, const OutputFile*& added) {
+    // Absolute aliases go below the root too, and no alias may climb out of it
+    std::string directory;
+    std::string name;
+    size_t start = 0;
+    while (start <= header.alias.size()) {
+        size_t end = header.alias.find('/', start);
+        if (end == std::string::npos) end = header.alias.size();
+        std::string part = header.alias.substr(start, end - start);
+        start = end + 1;
+        if (part.empty() || part == ".") continue;
+        if (part == "..") {
+            throw std::runtime_error("PackrFile error: path leaves the output directory: " + header.alias);
+        }
+
+        if (!name.empty()) {
+            if (!directory.empty()) directory += '/';
+            directory += name;
+        }
+        name = std::move(part);
+    }
+    if (name.empty()) {
+        throw std::runtime_error("PackrFile error: empty path in archive");
+    }
+
+    OutputFile file;
+    file.directory = add_directory(directory);
+    file.path = (std::filesystem::path(root) / directory / name).string();
+    file.name = std::move(name);
+    file.mtime = header.mtime;
+    file.mode = header.mode;
+
+    // Blocks of a split file all go into the file created here, in any order
+    if (header.block_count > 1) {
+        PACKR_SCOPE(STAGE_WRITE, 0, file.path);
+        std::shared_ptr<DirectoryFd> parent = open_directory(file.directory);
+        int fd = openat(parent->fd, file.name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        file.created = fd >= 0 && preallocate(fd, header.file_size);
+        if (fd >= 0) close(fd);
+    }
+    files.push_back(std::move(file));
+    added = &files.back();
+    return added->created;
+}
+
+std::vector<const OutputFile*> OutputTree::add_files(const std::vector<IndexEntry>& entries,
+                                                     const std::vector<size_t>& indices,
+                                                     std::vector<const OutputFile*>& targets) {
+    targets.assign(entries.size(), nullptr);
+
+    // Every block of a file shares its alias, the file is added once for all of them
+    std::vector<const OutputFile*> failed;
+    std::unordered_map<std::string, const OutputFile*> by_alias;
+    for (size_t index : indices) {
+        const DataHeader& header = entries[index].header;
+        auto inserted = by_alias.emplace(header.alias, nullptr);
+        if (inserted.second && !add_file(header, inserted.first->second)) {
+            failed.push_back(inserted.first->second);
+        }
+        targets[index] = inserted.first->second;
+    }
+    return failed;
+}
+
+bool OutputTree::write(const OutputFile& file, const DataHeader& header, const char* data, size_t size) {
+    if (!file.created) {
+        return false;
+    }
+    PACKR_NAMED_SCOPE(scope, STAGE_WRITE, size, header.alias);
+    std::shared_ptr<DirectoryFd> parent = open_directory(file.directory);
+
+    // Blocks of a split file go into the file created up front, keeping the blocks other chunks already wrote
+    bool split = header.block_count > 1;
+    int fd = openat(parent->fd, file.name.c_str(), split ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+
+    off_t offset = split ? static_cast<off_t>(header.file_offset) : 0;
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = pwrite(fd, data + done, size - done, offset + static_cast<off_t>(done));
+        if (count <= 0) break;
+        done += static_cast<size_t>(count);
+    }
+    close(fd);
+    PACKR_SCOPE_OUT(scope, done);
+    return done == size;
+}
+
+void OutputTree::finish() {
+    if (!restore_metadata) return;
+
+    // Files were added directory by directory, so this mostly hits the cache
+    for (const OutputFile& file : files) {
+        PACKR_SCOPE(STAGE_WRITE, 0, file.path);
+        std::shared_ptr<DirectoryFd> parent = open_directory(file.directory);
+        bool restored = true;
+        if (file.mode != 0) {
+            restored &= fchmodat(parent->fd, file.name.c_str(), file.mode & 07777, 0) == 0;
+        }
+
+        // Only the modification time was recorded, the access time is left alone
+        int64_t seconds = file.mtime / 1000000000;
+        int64_t nanoseconds = file.mtime % 1000000000;
+        if (nanoseconds < 0) {
+            seconds--;
+            nanoseconds += 1000000000;
+        }
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
+        times[1].tv_sec = static_cast<time_t>(seconds);
+        times[1].tv_nsec = static_cast<long>(nanoseconds);
+        restored &= utimensat(parent->fd, file.name.c_str(), times, 0) == 0;
+        if (!restored) {
+            std::cerr << "Failed to restore metadata of: " << file.path << std::endl;
+        }
+    }
+}
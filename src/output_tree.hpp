@@ -0,0 +1,80 @@
+#ifndef OUTPUT_TREE_HPP
+    #define OUTPUT_TREE_HPP
+    #include <string>
+    #include <vector>
+    #include <deque>
+    #include <list>
+    #include <memory>
+    #include <mutex>
+    #include <unordered_map>
+    #include "packr.hpp"
+
+    // Struct for a file an extraction writes, found by its directory and its name in it
+    struct OutputFile {
+        size_t directory;
+        std::string name;
+        std::string path; // Full path, for batched I/O and messages
+        int64_t mtime;
+        uint32_t mode;
+        bool created = true; // False if the file was split and couldn't be created or preallocated
+    };
+
+    // Implements the output side of an extraction. Every directory the files need is created
+    // once, parents first, with a mkdirat relative to its parent, and files are opened relative
+    // to a cached fd of their directory, so no path is walked twice. Files split into blocks are
+    // created and preallocated to their full size before any block is written, and finish() can
+    // give every file the mtime and permission bits it was packed with in one last pass
+    class OutputTree {
+        private:
+            // Directory below the root, the root itself being the first one with an empty path
+            struct Directory {
+                std::string path;
+                size_t parent;
+                std::string name;
+            };
+
+            // Closes its fd once neither the cache nor a writer uses it any more
+            struct DirectoryFd {
+                int fd;
+                ~DirectoryFd();
+            };
+
+            std::string root;
+            std::shared_ptr<DirectoryFd> root_fd;
+            bool restore_metadata;
+            std::deque<Directory> directories;
+            std::unordered_map<std::string, size_t> directory_ids; // Only touched by whoever adds files
+            std::deque<OutputFile> files; // Only appended to, writers keep pointers to them
+
+            // Open directories below the root, the least recently used one is closed past max_open
+            struct CacheSlot {
+                std::shared_ptr<DirectoryFd> fd;
+                std::list<size_t>::iterator order;
+            };
+            std::mutex mutex;
+            std::unordered_map<size_t, CacheSlot> open_directories;
+            std::list<size_t> order;
+            size_t max_open;
+
+            size_t add_directory(const std::string& path);
+            std::shared_ptr<DirectoryFd> open_directory(size_t id);
+        public:
+            OutputTree(const std::string& out_path, bool restore_metadata = false, size_t max_open = 256);
+
+            // Add the file a chunk belongs to, creating its directories, and the file itself if it was split.
+            // The first block's chunk has to be added before any block of the file is written.
+            // False if the split file couldn't be created, file is then still set but can't be written
+            bool add_file(const DataHeader& header, const OutputFile*& file);
+
+            // Add the files of the given entries, targets[i] is then the file of entry i.
+            // Returns the files that couldn't be created
+            std::vector<const OutputFile*> add_files(const std::vector<IndexEntry>& entries, const std::vector<size_t>& indices,
+                                                     std::vector<const OutputFile*>& targets);
+
+            // Write a chunk to its place in its file, false if the file can't be written
+            bool write(const OutputFile& file, const DataHeader& header, const char* data, size_t size);
+
+            // Restore the mtime and permission bits of every file, if asked to, once all of them are written
+            void finish();
+    };
+#endif
@@ -1,22 +1,47 @@
 #include "packr.hpp"
+#include "thread_pool.hpp"
+#include "bounded_queue.hpp"
+#include "hash.hpp"
+#include "trace.hpp"
+#include "dictionary.hpp"
+#include "codec.hpp"
+#include "output_tree.hpp"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sched.h>
+#include <cerrno>
 #include <iostream>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <string_view>
 
 #include <thread>
 #include <mutex>
 #include <queue>
 #include <condition_variable>
 #include <atomic>
+#include <chrono>
 
-#define SINFL_IMPLEMENTATION
-#define SDEFL_IMPLEMENTATION
-#include "sinfl.h"
 #include "sdefl.h"
 
-#define COMP_QUALITY 8
+#define COMP_QUALITY PACKR_MAX_LEVEL
+#define SAMPLE_SIZE (64 * 1024) // Prefix of a block that adaptive mode trial-compresses
+#define ENTROPY_LIMIT 7.5 // Bits per byte above which a sample is treated as incompressible
+#define INPUT_SLACK 16 // Bytes the inflaters may read past the end of their input
+#define TUNE_INTERVAL 0.25 // Seconds of progress auto mode measures before each adjustment
+#define TUNE_HEADROOM 1.25 // Auto mode raises the level when it runs this much faster than it needs to
 
 // For path types
 enum PathType {
@@ -36,52 +61,586 @@ PathType get_path_type(std::string& path) {
     return UNKNOWN_PATH;
 }
 
+// Struct for a file found by a directory scan
+struct ScannedFile {
+    std::string path;
+    uint64_t size = 0;
+    int64_t mtime = 0; // Nanoseconds since the Unix epoch
+    uint32_t mode = 0; // Permission bits
+};
 
-// Load all filepaths from a given directory
-void load_files_from_dir(std::string& path, std::vector<std::string>& files) {
-    if (get_path_type(path) == DIR_PATH) {
-        // Now loop through the entries in the folder
-        for (const auto& entry : std::filesystem::directory_iterator(path)) {
-            std::string entry_path = entry.path();
-            // If this is a file path, store it
-            if (get_path_type(entry_path) == FILE_PATH) {
-                files.push_back(entry_path);
-            }
-            // Else explore this directory
-            else if (get_path_type(entry_path) == DIR_PATH) {
-                load_files_from_dir(entry_path, files);
+// Fill in a file's size and modification time with a single stat
+bool stat_file(ScannedFile& file) {
+    struct stat buffer;
+    if (stat(file.path.c_str(), &buffer) != 0 || !S_ISREG(buffer.st_mode))
+        return false;
+
+    file.size = static_cast<uint64_t>(buffer.st_size);
+    file.mode = static_cast<uint32_t>(buffer.st_mode & 07777);
+#ifdef __APPLE__
+    file.mtime = static_cast<int64_t>(buffer.st_mtimespec.tv_sec) * 1000000000 + buffer.st_mtimespec.tv_nsec;
+#else
+    file.mtime = static_cast<int64_t>(buffer.st_mtim.tv_sec) * 1000000000 + buffer.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+// List one directory. The entry types readdir reported are cached, so
+// only files (and links, whose target has to be looked up) cost a stat
+void scan_entries(const std::string& path, std::vector<ScannedFile>& files,
+                  std::vector<std::string>& directories) {
+    PACKR_SCOPE(STAGE_SCAN, 0, path.c_str());
+    for (const auto& entry : std::filesystem::directory_iterator(path)) {
+        std::error_code ec;
+        if (entry.is_directory(ec)) {
+            directories.push_back(entry.path());
+        }
+        else if (entry.is_regular_file(ec)) {
+            ScannedFile file;
+            file.path = entry.path();
+            if (stat_file(file)) {
+                files.push_back(std::move(file));
             }
         }
     }
+}
+
+// Load all files from a given directory
+void load_files_from_dir(std::string& path, std::vector<ScannedFile>& files) {
+    if (get_path_type(path) == DIR_PATH) {
+        std::vector<std::string> directories;
+        scan_entries(path, files, directories);
+
+        // Then explore every subdirectory
+        for (std::string& directory : directories) {
+            load_files_from_dir(directory, files);
+        }
+    }
     else {
         std::runtime_error("error: Given invalid path! Path must be an existing directory");
     }
 }
 
-// Compression function
-std::vector<char> compress_data(const char* data, uint32_t size, uint32_t& comp_size) {
-    thread_local sdefl ctx{};
-    int bound = sdefl_bound(size);
+// Implements a walk over a directory tree on the shared pool, one task per directory.
+// Every directory's files are handed to on_files (from any worker) as soon as it is
+// listed, so work on them can start while the rest of the tree is still being walked
+class DirectoryScan {
+    private:
+        ThreadPool& pool;
+        TaskGroup& group;
+        std::function<void(std::vector<ScannedFile>&)> on_files;
+
+        void submit(std::vector<std::string>& directories) {
+            std::vector<PoolTask> tasks;
+            for (std::string& directory : directories) {
+                PoolTask task;
+                task.fn = [this, directory = std::move(directory)]() { scan(directory); };
+                task.size = UINT64_MAX; // Listing a directory goes before any block, it feeds the pool
+                tasks.push_back(std::move(task));
+            }
+            pool.submit(group, tasks);
+        }
+
+        void scan(const std::string& directory) {
+            std::vector<ScannedFile> files;
+            std::vector<std::string> directories;
+            scan_entries(directory, files, directories);
+            submit(directories);
+            if (!files.empty()) {
+                on_files(files);
+            }
+        }
+    public:
+        DirectoryScan(ThreadPool& pool, TaskGroup& group, std::function<void(std::vector<ScannedFile>&)> on_files)
+            : pool(pool), group(group), on_files(std::move(on_files)) {}
+
+        // Start the walk, group is done once every directory was listed
+        void start(std::string& path) {
+            if (get_path_type(path) != DIR_PATH) {
+                throw std::runtime_error("error: Given invalid path! Path must be an existing directory");
+            }
+            std::vector<std::string> directories{ path };
+            submit(directories);
+        }
+};
+
+// Compression function, out is only ever grown so it can be reused
+uint32_t compress_data(const char* data, uint32_t size, Buffer& out, int level = COMP_QUALITY,
+                       const DictView& dict = DictView(), CodecId codec_id = CODEC_DEFLATE) {
+    const Codec* codec = Codec::get(codec_id);
+    if (!codec) {
+        throw std::runtime_error("Unknown codec: " + std::to_string(codec_id));
+    }
+    out.prepare(codec->bound(size));
+
+    if (dict.size == 0) {
+        uint32_t comp_size = codec->compress(data, size, 0, out.data(), level);
+        out.shrink(comp_size);
+        return comp_size;
+    }
+
+    // The match finder reads the dictionary and the data as one window
+    thread_local Buffer primed;
+    primed.prepare(static_cast<size_t>(dict.size) + size);
+    std::memcpy(primed.data(), dict.data, dict.size);
+    std::memcpy(primed.data() + dict.size, data, size);
+    uint32_t comp_size = codec->compress(primed.data() + dict.size, size, dict.size, out.data(), level);
+    out.shrink(comp_size);
+    return comp_size;
+}
+
+// Compress a chunk's data in place, keeping it raw (and flagged as
+// stored) when compression wouldn't make it any smaller
+void compress_chunk(DataChunk& chunk, int level, const DictView& dict = DictView(),
+                    CodecId codec = CODEC_DEFLATE) {
+    PACKR_NAMED_SCOPE(scope, STAGE_COMPRESS, chunk.header.base_size, chunk.header.alias);
+    chunk.header.codec = codec;
+    if (level >= 0) {
+        // The chunk takes the compressed buffer and leaves its input one for the next chunk
+        thread_local Buffer compressed;
+        uint32_t comp_size = compress_data(chunk.data.data(), chunk.header.base_size, compressed, level, dict, codec);
+        if (comp_size < chunk.header.base_size) {
+            chunk.data.swap(compressed);
+            chunk.header.comp_size = comp_size;
+            chunk.header.flags &= ~(PACKR_FLAG_STORED | PACKR_FLAG_DICT);
+            if (dict.size > 0) chunk.header.flags |= PACKR_FLAG_DICT;
+            PACKR_SCOPE_OUT(scope, comp_size);
+            return;
+        }
+    }
+
+    chunk.header.comp_size = chunk.header.base_size;
+    chunk.header.codec = CODEC_DEFLATE;
+    chunk.header.flags = (chunk.header.flags & ~PACKR_FLAG_DICT) | PACKR_FLAG_STORED;
+    PACKR_SCOPE_OUT(scope, chunk.header.base_size);
+}
+
+// Estimate the Shannon entropy of some data in bits per byte
+double estimate_entropy(const char* data, size_t size) {
+    if (size == 0) return 0;
+
+    size_t counts[256] = {};
+    for (size_t i = 0; i < size; i++) {
+        counts[static_cast<unsigned char>(data[i])]++;
+    }
+
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count == 0) continue;
+        double p = static_cast<double>(count) / size;
+        entropy -= p * std::log2(p);
+    }
+    return entropy;
+}
+
+// Pick a compression level for a block from a sample of its start:
+// -1 (store raw) for data that won't shrink, PACKR_FAST_LEVEL when it is
+// good enough or the max level is too slow, PACKR_MAX_LEVEL otherwise
+int choose_level(const char* data, uint32_t size, const PackrOptions& options) {
+    uint32_t sample_size = std::min<uint32_t>(size, SAMPLE_SIZE);
+    if (sample_size == 0) return -1;
+
+    // Already compressed media looks like noise, don't even try
+    if (estimate_entropy(data, sample_size) > ENTROPY_LIMIT) {
+        return -1;
+    }
+
+    // Trial compress the sample at the fast level
+    thread_local Buffer trial;
+    uint32_t fast_size = compress_data(data, sample_size, trial, PACKR_FAST_LEVEL);
+    double fast_ratio = static_cast<double>(fast_size) / sample_size;
+    if (1.0 - fast_ratio < options.min_saving) {
+        return -1;
+    }
+    if (options.target_ratio > 0 && fast_ratio <= options.target_ratio) {
+        return PACKR_FAST_LEVEL;
+    }
+
+    // Then at the max level, if a speed is asked for it has to keep up
+    if (options.min_throughput > 0) {
+        auto start = std::chrono::steady_clock::now();
+        compress_data(data, sample_size, trial, PACKR_MAX_LEVEL);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double throughput = sample_size / (1024.0 * 1024.0) / std::max(seconds, 1e-9);
+        if (throughput < options.min_throughput) {
+            return PACKR_FAST_LEVEL;
+        }
+    }
+    return PACKR_MAX_LEVEL;
+}
 
-    std::vector<char> out(bound);
-    comp_size = sdeflate(&ctx, out.data(), data, size, COMP_QUALITY);
+// Pick a codec for a block from a sample of its start: LZ decodes much faster,
+// so it is used unless it leaves the sample more than codec_max_growth bigger
+CodecId choose_codec(const char* data, uint32_t size, int level, const PackrOptions& options) {
+    uint32_t sample_size = std::min<uint32_t>(size, SAMPLE_SIZE);
+    if (sample_size == 0) return CODEC_LZ;
 
-    out.resize(comp_size);
-    return out;
+    thread_local Buffer trial;
+    uint32_t lz_size = compress_data(data, sample_size, trial, level, DictView(), CODEC_LZ);
+    uint32_t deflate_size = compress_data(data, sample_size, trial, PACKR_FAST_LEVEL, DictView(), CODEC_DEFLATE);
+    return lz_size <= deflate_size * (1.0 + options.codec_max_growth) ? CODEC_LZ : CODEC_DEFLATE;
 }
 
-// Decompression function
-std::vector<char> decompress_data(const char* comp_data, uint32_t comp_size, uint32_t expected_size)
+// Decompression function, out is only ever grown so it can be reused.
+// Returns where the data starts in out, behind the dictionary if one primed it
+const char* decompress_data(const char* comp_data, uint32_t comp_size, uint32_t expected_size, Buffer& out,
+                            const DictView& dict = DictView(), uint32_t codec_id = CODEC_DEFLATE)
 {
-    std::vector<char> out(expected_size);
+    PACKR_NAMED_SCOPE(scope, STAGE_DECOMPRESS, comp_size);
+    const Codec* codec = Codec::get(codec_id);
+    if (!codec) {
+        throw std::runtime_error("Unknown codec: " + std::to_string(codec_id));
+    }
+    out.prepare(static_cast<size_t>(dict.size) + expected_size);
 
-    int result = sinflate(out.data(), expected_size, comp_data, comp_size);
-    if (result < 0) {
+    if (dict.size > 0) std::memcpy(out.data(), dict.data, dict.size);
+    long result = codec->decompress(comp_data, comp_size, out.data(), dict.size, expected_size);
+    if (result < 0 || static_cast<uint32_t>(result) != expected_size) {
         throw std::runtime_error("Decompression failed");
     }
 
-    out.resize(result);
-    return out;
+    PACKR_SCOPE_OUT(scope, result);
+    return out.data() + dict.size;
+}
+
+// Read size bytes of a file from offset on, straight into out
+bool read_file_range(const char* path, uint64_t offset, size_t size, char* out) {
+    PACKR_SCOPE(STAGE_READ, size, path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        ssize_t count = pread(fd, out + done, size - done, static_cast<off_t>(offset + done));
+        if (count <= 0) break;
+        done += static_cast<size_t>(count);
+    }
+    close(fd);
+    return done == size;
+}
+
+// Check a chunk's data against the checksum taken when it was written
+bool chunk_intact(const ChunkView& view) {
+    PACKR_SCOPE(STAGE_HASH, view.size, view.header->alias);
+    return checksum_data(view.data, view.size) == view.header->checksum;
+}
+
+// Check the data a chunk inflated to against its content hash
+bool content_intact(const DataHeader& header, const char* data, size_t size) {
+    PACKR_SCOPE(STAGE_HASH, size, header.alias);
+    return size == header.base_size && hash_data(data, size) == header.content_hash;
+}
+
+// Table of contents entry of the fixed-size format, whose paths were cut at 255 characters
+struct FixedIndexEntry {
+    char alias[256];
+    uint64_t base_size;
+    uint64_t comp_size;
+    uint64_t file_offset;
+    uint64_t file_size;
+    uint32_t block_index;
+    uint32_t block_count;
+    uint32_t flags;
+    uint32_t codec;
+    uint32_t solid_offset;
+    uint32_t solid_size;
+    int64_t mtime;
+    uint64_t content_hash;
+    uint64_t checksum;
+    uint64_t offset;
+};
+
+// The fixed-size format's FileHeader ended before the table of contents fields
+static const size_t FIXED_FILE_HEADER_SIZE = offsetof(FileHeader, index_codec);
+
+// Inline header of the original format, every chunk's data followed its header directly
+struct LegacyDataHeader {
+    char alias[256];
+    uint32_t base_size;
+    uint32_t comp_size;
+};
+
+// The original format's FileHeader only had the version and the chunk count
+static const size_t LEGACY_FILE_HEADER_SIZE = offsetof(FileHeader, block_size);
+
+// Append an unsigned LEB128 varint
+void put_varint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+void put_fixed64(std::string& out, uint64_t value) {
+    char bytes[sizeof(value)];
+    std::memcpy(bytes, &value, sizeof(value));
+    out.append(bytes, sizeof(bytes));
+}
+
+// Map signed differences to small unsigned numbers, -1 to 1, 1 to 2 and so on
+uint64_t zigzag(uint64_t difference) {
+    return (difference << 1) ^ (0 - (difference >> 63));
+}
+
+uint64_t unzigzag(uint64_t value) {
+    return (value >> 1) ^ (0 - (value & 1));
+}
+
+// Reads varints and raw bytes, any read past the end clears ok and returns zeros
+struct VarintReader {
+    const char* pos;
+    const char* end;
+    bool ok = true;
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64 && pos < end; shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(*pos++);
+            value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    uint32_t varint32() {
+        uint64_t value = varint();
+        if (value > UINT32_MAX) ok = false;
+        return static_cast<uint32_t>(value);
+    }
+
+    uint64_t fixed64() {
+        uint64_t value = 0;
+        const char* data = bytes(sizeof(value));
+        if (data) std::memcpy(&value, data, sizeof(value));
+        return value;
+    }
+
+    const char* bytes(size_t size) {
+        if (static_cast<size_t>(end - pos) < size) {
+            ok = false;
+            return nullptr;
+        }
+        const char* data = pos;
+        pos += size;
+        return data;
+    }
+};
+
+// Append every field of a header but its path, with mtime relative to base_mtime.
+// Most fields are small numbers, the hashes are the only ones kept at full width
+void encode_header(const DataHeader& header, int64_t base_mtime, std::string& out) {
+    put_varint(out, header.base_size);
+    put_varint(out, header.comp_size);
+    put_varint(out, header.file_offset);
+    put_varint(out, header.file_size);
+    put_varint(out, header.block_index);
+    put_varint(out, header.block_count);
+    put_varint(out, header.flags);
+    put_varint(out, header.codec);
+    put_varint(out, header.solid_offset);
+    put_varint(out, header.solid_size);
+    put_varint(out, zigzag(static_cast<uint64_t>(header.mtime) - static_cast<uint64_t>(base_mtime)));
+    put_varint(out, header.mode);
+    put_fixed64(out, header.content_hash);
+    put_fixed64(out, header.checksum);
+}
+
+bool decode_header(VarintReader& in, int64_t base_mtime, DataHeader& header, bool has_mode = true) {
+    header.base_size = in.varint();
+    header.comp_size = in.varint();
+    header.file_offset = in.varint();
+    header.file_size = in.varint();
+    header.block_index = in.varint32();
+    header.block_count = in.varint32();
+    header.flags = in.varint32();
+    header.codec = in.varint32();
+    header.solid_offset = in.varint32();
+    header.solid_size = in.varint32();
+    header.mtime = static_cast<int64_t>(unzigzag(in.varint()) + static_cast<uint64_t>(base_mtime));
+    header.mode = has_mode ? in.varint32() : 0;
+    header.content_hash = in.fixed64();
+    header.checksum = in.fixed64();
+    return in.ok;
+}
+
+// Encode the table of contents: every distinct path once, sorted and sharing the prefix
+// of the one before it, then the entries, which refer to their path by its place in the table
+void encode_index(const std::vector<IndexEntry>& entries, std::string& out) {
+    std::vector<std::string_view> paths;
+    paths.reserve(entries.size());
+    for (const IndexEntry& entry : entries) {
+        paths.push_back(entry.header.alias);
+    }
+    std::sort(paths.begin(), paths.end());
+    paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+    std::unordered_map<std::string_view, uint64_t> path_ids;
+    path_ids.reserve(paths.size());
+    put_varint(out, paths.size());
+    std::string_view previous;
+    for (std::string_view path : paths) {
+        size_t shared = 0;
+        size_t limit = std::min(previous.size(), path.size());
+        while (shared < limit && previous[shared] == path[shared]) shared++;
+        put_varint(out, shared);
+        put_varint(out, path.size() - shared);
+        out.append(path.data() + shared, path.size() - shared);
+        path_ids.emplace(path, path_ids.size());
+        previous = path;
+    }
+
+    // Offsets and mtimes mostly grow slowly from one entry to the next
+    uint64_t previous_offset = 0;
+    int64_t previous_mtime = 0;
+    for (const IndexEntry& entry : entries) {
+        put_varint(out, path_ids[entry.header.alias]);
+        put_varint(out, zigzag(entry.offset - previous_offset));
+        encode_header(entry.header, previous_mtime, out);
+        previous_offset = entry.offset;
+        previous_mtime = entry.header.mtime;
+    }
+}
+
+bool decode_index(const char* data, size_t size, uint32_t count, std::vector<IndexEntry>& entries,
+                  bool has_mode) {
+    // Every entry takes at least a byte per varint and its two hashes
+    if (static_cast<uint64_t>(count) * (13 + 2 * sizeof(uint64_t)) > size) return false;
+    VarintReader in{ data, data + size };
+    uint64_t path_count = in.varint();
+    if (path_count > size) return false; // Every path takes at least one byte
+    std::vector<std::string> paths(path_count);
+    for (uint64_t i = 0; i < path_count && in.ok; i++) {
+        uint64_t shared = in.varint();
+        uint64_t suffix = in.varint();
+        if (i == 0 ? shared > 0 : shared > paths[i - 1].size()) return false;
+        const char* bytes = in.bytes(suffix);
+        if (!bytes) return false;
+        paths[i].reserve(shared + suffix);
+        if (i > 0) paths[i].assign(paths[i - 1], 0, shared);
+        paths[i].append(bytes, suffix);
+    }
+
+    entries.clear();
+    entries.resize(count);
+    std::vector<uint32_t> path_ids(count);
+    std::vector<uint32_t> uses(paths.size());
+    uint64_t previous_offset = 0;
+    int64_t previous_mtime = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        IndexEntry& entry = entries[i];
+        uint64_t path_id = in.varint();
+        if (!in.ok || path_id >= paths.size()) return false;
+        path_ids[i] = static_cast<uint32_t>(path_id);
+        uses[path_id]++;
+        entry.offset = previous_offset + unzigzag(in.varint());
+        if (!decode_header(in, previous_mtime, entry.header, has_mode)) return false;
+        previous_offset = entry.offset;
+        previous_mtime = entry.header.mtime;
+    }
+
+    // Most paths belong to a single entry, which takes the decoded string over
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t path_id = path_ids[i];
+        if (--uses[path_id] == 0) {
+            entries[i].header.alias = std::move(paths[path_id]);
+        }
+        else {
+            entries[i].header.alias = paths[path_id];
+        }
+    }
+    return in.ok && in.pos == in.end;
+}
+
+// Append the header written in front of a payload: its length, then its path in full and its fields
+void encode_inline_header(const DataHeader& header, std::string& out) {
+    thread_local std::string fields;
+    fields.clear();
+    put_varint(fields, header.alias.size());
+    fields += header.alias;
+    encode_header(header, 0, fields);
+    put_varint(out, fields.size());
+    out += fields;
+}
+
+// Read the table of contents of the fixed-size format, one 264-byte header per entry
+bool decode_fixed_index(const char* data, size_t size, uint32_t count, std::vector<IndexEntry>& entries) {
+    if (static_cast<uint64_t>(count) * sizeof(FixedIndexEntry) > size) return false;
+    entries.clear();
+    entries.resize(count);
+    for (uint32_t i = 0; i < count; i++) {
+        FixedIndexEntry fixed;
+        std::memcpy(&fixed, data + static_cast<size_t>(i) * sizeof(FixedIndexEntry), sizeof(fixed));
+        DataHeader& header = entries[i].header;
+        header.alias.assign(fixed.alias, strnlen(fixed.alias, sizeof(fixed.alias)));
+        header.base_size = fixed.base_size;
+        header.comp_size = fixed.comp_size;
+        header.file_offset = fixed.file_offset;
+        header.file_size = fixed.file_size;
+        header.block_index = fixed.block_index;
+        header.block_count = fixed.block_count;
+        header.flags = fixed.flags;
+        header.codec = fixed.codec;
+        header.solid_offset = fixed.solid_offset;
+        header.solid_size = fixed.solid_size;
+        header.mtime = fixed.mtime;
+        header.content_hash = fixed.content_hash;
+        header.checksum = fixed.checksum;
+        entries[i].offset = fixed.offset;
+    }
+    return true;
+}
+
+// Build the table of contents of an original format file by walking its inline headers.
+// That format never recorded whether a chunk was compressed: archive() kept files as they
+// were, so a chunk as big as its file is taken as stored, which Deflate output only ever
+// matches by chance. Nothing was hashed either, so checksums and content hashes are computed
+// here, inflating compressed chunks once
+bool decode_legacy_chunks(const char* data, size_t size, uint32_t count, std::vector<IndexEntry>& entries) {
+    if (static_cast<uint64_t>(count) * sizeof(LegacyDataHeader) > size) return false;
+    entries.clear();
+    entries.reserve(count);
+
+    Buffer inflated;
+    size_t offset = LEGACY_FILE_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++) {
+        LegacyDataHeader legacy;
+        if (size - offset < sizeof(legacy)) return false;
+        std::memcpy(&legacy, data + offset, sizeof(legacy));
+        offset += sizeof(legacy);
+        if (size - offset < legacy.comp_size) return false;
+
+        IndexEntry entry{};
+        DataHeader& header = entry.header;
+        header.alias.assign(legacy.alias, strnlen(legacy.alias, sizeof(legacy.alias)));
+        header.base_size = legacy.base_size;
+        header.comp_size = legacy.comp_size;
+        header.file_size = legacy.base_size;
+        header.block_count = 1;
+        header.codec = CODEC_DEFLATE;
+        header.checksum = checksum_data(data + offset, legacy.comp_size);
+        if (legacy.comp_size == legacy.base_size) {
+            header.flags = PACKR_FLAG_STORED;
+            header.content_hash = hash_data(data + offset, legacy.base_size);
+        }
+        else {
+            // A chunk that doesn't inflate keeps no content hash, and is reported once it is read
+            try {
+                const char* raw = decompress_data(data + offset, legacy.comp_size, legacy.base_size, inflated);
+                header.content_hash = hash_data(raw, legacy.base_size);
+            }
+            catch (const std::exception&) {
+                header.content_hash = 0;
+            }
+        }
+        entry.offset = offset;
+        entries.push_back(std::move(entry));
+        offset += legacy.comp_size;
+    }
+    return offset == size;
 }
 
 
@@ -120,7 +679,7 @@ PackrFile::PackrFile(const std::string& path, bool new_file) {
         strcpy(header.version, PACKR_VERSION);
         header.chunk_count = 0;
 
-        // Write the header
+        // Write the header, chunks are appended after it as they are added
         file.seekp(0, std::ios::beg);
         file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
         file.flush();
@@ -128,439 +687,2413 @@ PackrFile::PackrFile(const std::string& path, bool new_file) {
         std::cout << "Created .packr file!" << std::endl;
     }
     else {
-        // Read existing file
-        file.open(path, std::ios::in | std::ios::out | std::ios::binary);
-        if (!file.is_open()) {
+        // Map the existing file, chunk data is handed out as views into the mapping
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
             throw std::runtime_error(
                 "PackrFile error: failed to open existing file: " + path);
         }
 
-        // Read header
-        file.seekg(0, std::ios::beg);
-        file.read(reinterpret_cast<char*>(&header), sizeof(FileHeader));
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < LEGACY_FILE_HEADER_SIZE) {
+            close(fd);
+            throw std::runtime_error(
+                "PackrFile error: unsupported or corrupt .packr file: " + path);
+        }
 
-        // Now read every chunk
-        chunks.resize(header.chunk_count);
-        std::cout << "Found " << header.chunk_count << " chunks. Loading them..." << std::endl;
+        // The inflaters may read a few bytes past a chunk, the last one in the file included,
+        // so the file is mapped over an area with a zeroed page after it
+        size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t area_size = (static_cast<size_t>(info.st_size) + page_size - 1) / page_size * page_size + page_size;
+        void* area = mmap(nullptr, area_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        void* mapping = area == MAP_FAILED ? MAP_FAILED :
+            mmap(area, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+
+        // The mapping stays valid after the descriptor is closed
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            if (area != MAP_FAILED) munmap(area, area_size);
+            throw std::runtime_error(
+                "PackrFile error: failed to map file: " + path);
+        }
+        map_data = static_cast<const char*>(mapping);
+        map_size = static_cast<size_t>(info.st_size);
+        map_area_size = area_size;
 
-        for(int x = 0; x < header.chunk_count; x++) {
-            // First read the header
-            file.read(reinterpret_cast<char*>(&chunks[x].header), sizeof(chunks[x].header));
-            // Then the data
-            chunks[x].data.resize(chunks[x].header.comp_size);
-            file.read(chunks[x].data.data(), chunks[x].header.comp_size);
+        // Read header, its version picks the format of the table of contents
+        std::memset(&header, 0, sizeof(FileHeader));
+        std::memcpy(&header, map_data, FIXED_FILE_HEADER_SIZE);
+        bool has_mode = std::strncmp(header.version, PACKR_VERSION, sizeof(header.version)) == 0;
+        bool compact = (has_mode || std::strncmp(header.version, PACKR_COMPACT_VERSION, sizeof(header.version)) == 0) &&
+            map_size >= sizeof(FileHeader);
+        bool fixed = std::strncmp(header.version, PACKR_FIXED_VERSION, sizeof(header.version)) == 0 &&
+            map_size >= FIXED_FILE_HEADER_SIZE;
+        bool legacy = std::strncmp(header.version, PACKR_LEGACY_VERSION, sizeof(header.version)) == 0;
+        if (compact) {
+            std::memcpy(&header, map_data, sizeof(FileHeader));
+        }
+        else if (fixed) {
+            header.index_size = static_cast<uint64_t>(header.chunk_count) * sizeof(FixedIndexEntry);
+            header.index_raw_size = header.index_size;
+        }
+        else if (legacy) {
+            // Only the version and the chunk count are there, the rest of the header stays empty
+            std::memset(&header, 0, sizeof(FileHeader));
+            std::memcpy(&header, map_data, LEGACY_FILE_HEADER_SIZE);
+        }
+        if ((!compact && !fixed && !legacy) ||
+            header.index_offset > map_size || header.index_size > map_size - header.index_offset ||
+            header.dict_offset > map_size || header.dict_size > map_size - header.dict_offset) {
+            unmap();
+            throw std::runtime_error(
+                "PackrFile error: unsupported or corrupt .packr file: " + path);
         }
 
-        std::cout << "Loaded all chunks!" << std::endl;
-    }
+        // Then decode the table of contents in one go, chunk data is never copied
+        const char* index = map_data + header.index_offset;
+        bool decoded = false;
+        if (legacy) {
+            decoded = decode_legacy_chunks(map_data, map_size, header.chunk_count, entries);
+        }
+        else if (fixed) {
+            decoded = decode_fixed_index(index, header.index_size, header.chunk_count, entries);
+        }
+        else if (checksum_data(index, header.index_size) == header.index_checksum) {
+            if (header.index_size == header.index_raw_size) {
+                decoded = decode_index(index, header.index_size, header.chunk_count, entries, has_mode);
+            }
+            else if (header.index_size <= UINT32_MAX && header.index_raw_size <= UINT32_MAX) {
+                try {
+                    Buffer inflated;
+                    const char* raw = decompress_data(index, static_cast<uint32_t>(header.index_size),
+                                                      static_cast<uint32_t>(header.index_raw_size), inflated,
+                                                      DictView(), header.index_codec);
+                    decoded = decode_index(raw, header.index_raw_size, header.chunk_count, entries, has_mode);
+                }
+                catch (const std::exception&) {
+                    decoded = false;
+                }
+            }
+        }
+        if (!decoded) {
+            unmap();
+            throw std::runtime_error(
+                "PackrFile error: corrupt table of contents in .packr file: " + path);
+        }
 
-    file.close();
+        std::cout << "Found " << header.chunk_count << " chunks." << std::endl;
+    }
 }
 
 
 PackrFile::~PackrFile() {
     file.close();
+    unmap();
 }
 
+void PackrFile::unmap() {
+    if (map_data) {
+        munmap(const_cast<char*>(map_data), map_area_size);
+        map_data = nullptr;
+        map_size = 0;
+        map_area_size = 0;
+    }
+}
 
-void PackrFile::add_chunk(DataChunk& chunk) {
-    chunk.data = compress_data(
-        chunk.data.data(),
-        chunk.header.base_size,
-        chunk.header.comp_size
-    );
 
+void PackrFile::set_dictionary(const DictView& dict) {
+    if (!file.is_open()) {
+        throw std::runtime_error("PackrFile error: file is not open for writing: " + file_path);
+    }
+    if (dict.size == 0) return;
+
+    // Chunks compressed with it must be able to find it, it goes in before any of them
+    std::lock_guard<std::mutex> lock(write_mutex);
+    dictionary.assign(dict.data, dict.size);
+    file.seekp(0, std::ios::end);
+    header.dict_offset = static_cast<uint64_t>(file.tellp());
+    header.dict_size = dict.size;
+    file.write(dictionary.data(), dictionary.size());
+}
+
+DictView PackrFile::get_dictionary() const {
+    DictView dict;
+    if (header.dict_size == 0) return dict;
+    dict.data = map_data ? map_data + header.dict_offset : dictionary.data();
+    dict.size = header.dict_size;
+    return dict;
+}
+
+void PackrFile::add_chunk(DataChunk& chunk) {
+    compress_chunk(chunk, COMP_QUALITY);
     add_compressed_chunk(chunk);
 }
 void PackrFile::add_compressed_chunk(DataChunk& chunk) {
-    chunks.push_back(chunk);
+    add_compressed_data(chunk.header, chunk.data.data());
 }
 
-void PackrFile::flush() {
-    file.open(file_path, std::ios::out | std::ios::binary | std::ios::trunc);
-    if (!file.is_open()) {
-        throw std::runtime_error("PackrFile error: failed to open file for writing: " + file_path);
+void PackrFile::add_compressed_data(const DataHeader& chunk_header, const char* data) {
+    write_payload(chunk_header, data, &chunk_header, 1);
+}
+
+void PackrFile::add_solid_block(const DataHeader& block_header, const char* data,
+                                const std::vector<DataHeader>& members) {
+    write_payload(block_header, data, members.data(), members.size());
+}
+
+void PackrFile::write_payload(const DataHeader& payload_header, const char* data,
+                              const DataHeader* members, size_t member_count) {
+    DataHeader inline_header = payload_header;
+    {
+        PACKR_SCOPE(STAGE_HASH, payload_header.comp_size, payload_header.alias);
+        inline_header.checksum = checksum_data(data, payload_header.comp_size);
+    }
+    thread_local std::string inline_record;
+    inline_record.clear();
+    encode_inline_header(inline_header, inline_record);
+
+    // Every file the payload holds shares its size, checksum and storage
+    thread_local std::vector<IndexEntry> added;
+    added.clear();
+    for (size_t i = 0; i < member_count; i++) {
+        IndexEntry entry{};
+        entry.header = members[i];
+        entry.header.comp_size = inline_header.comp_size;
+        entry.header.checksum = inline_header.checksum;
+        entry.header.flags |= inline_header.flags & (PACKR_FLAG_STORED | PACKR_FLAG_SOLID | PACKR_FLAG_DICT);
+        entry.header.codec = inline_header.codec;
+        if (inline_header.flags & PACKR_FLAG_SOLID) {
+            entry.header.solid_size = inline_header.base_size;
+        }
+        added.push_back(entry);
     }
-    header.chunk_count = static_cast<uint32_t>(chunks.size());
 
-    file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+    // (CRITICAL) Append the payload to the end of the file right away
+    {
+        std::unique_lock<std::mutex> lock(write_mutex, std::defer_lock);
+        lock_timed(lock);
+        if (!file.is_open()) {
+            throw std::runtime_error("PackrFile error: file is not open for writing: " + file_path);
+        }
+
+        PACKR_NAMED_SCOPE(scope, STAGE_WRITE, payload_header.comp_size, payload_header.alias);
+        file.write(inline_record.data(), inline_record.size());
+        uint64_t offset = static_cast<uint64_t>(file.tellp());
+        file.write(data, payload_header.comp_size);
+        if (!file) {
+            throw std::runtime_error("PackrFile error: failed to write chunk to: " + file_path);
+        }
+        PACKR_SCOPE_OUT(scope, inline_record.size() + payload_header.comp_size);
+
+        // Only the headers are kept around, for the table of contents
+        for (IndexEntry& entry : added) {
+            entry.offset = offset;
+            entries.push_back(entry);
+        }
+        header.chunk_count += static_cast<uint32_t>(added.size());
+    }
 
-    for (const auto& chunk : chunks) {
-        file.write(reinterpret_cast<const char*>(&chunk.header), sizeof(DataHeader));
-        file.write(chunk.data.data(), chunk.header.comp_size);
+    // Let later copies of this content point at the data just written
+    if (dedup) {
+        std::unique_lock<std::mutex> lock(dedup_mutex, std::defer_lock);
+        lock_timed(lock);
+        for (const IndexEntry& entry : added) {
+            auto found = dedup_slots.find(entry.header.content_hash);
+            if (found != dedup_slots.end() && !found->second.written &&
+                found->second.header.alias == entry.header.alias &&
+                found->second.header.block_index == entry.header.block_index) {
+                found->second.written = true;
+                found->second.entry = entry;
+            }
+        }
     }
+}
 
-    file.flush();
-    file.close();
+bool PackrFile::add_if_duplicate(const DataHeader& chunk_header, const char* data) {
+    if (!dedup) return false;
+    uint64_t check;
+    {
+        PACKR_SCOPE(STAGE_HASH, chunk_header.base_size, chunk_header.alias);
+        check = checksum_data(data, chunk_header.base_size);
+    }
+    return refer_to_claimed(chunk_header, nullptr, check, true);
+}
 
-    std::cout << "Wrote " << chunks.size() << " chunks to " << file_path << std::endl;
+bool PackrFile::add_copy_if_duplicate(const DataHeader& chunk_header, const char* payload) {
+    if (!dedup) return false;
+    return refer_to_claimed(chunk_header, payload, 0, false);
 }
 
+// Defined with the extraction code below
+const char* open_payload(const ChunkView& view, const DictView& dict, Buffer& out);
 
-void Packr::archive(std::string& in_path, std::string& out_path) {
-    // load directories recursively
-    std::vector<std::string> files;
-    load_files_from_dir(in_path, files);
+uint64_t PackrFile::stored_check(const DataHeader& chunk_header, const char* payload) const {
+    // Copies are primed with the dictionary they were copied along with
+    thread_local Buffer inflated;
+    ChunkView view{ &chunk_header, payload, static_cast<size_t>(chunk_header.comp_size) };
+    const char* data = open_payload(view, get_dictionary(), inflated);
+    PACKR_SCOPE(STAGE_HASH, chunk_header.base_size, chunk_header.alias);
+    return checksum_data(data, chunk_header.base_size);
+}
 
-    //debug
-    // for (int i = 0; i < files.size(); i++) {
-    //     std::cout << files[i] << std::endl;
-    // }
+bool PackrFile::refer_to_claimed(const DataHeader& chunk_header, const char* payload, uint64_t check, bool checked) {
+    // (CRITICAL) The first chunk with some content claims it, later ones refer to it
+    std::unique_lock<std::mutex> lock(dedup_mutex, std::defer_lock);
+    lock_timed(lock);
+    auto found = dedup_slots.find(chunk_header.content_hash);
+    if (found == dedup_slots.end()) {
+        DedupSlot& slot = dedup_slots[chunk_header.content_hash];
+        slot.header = chunk_header;
+        slot.payload = payload;
+        slot.check = check;
+        slot.checked = checked;
+        return false;
+    }
 
-    // Create a new .packr file
-    PackrFile file(out_path, true);
+    // Same hash with a different size is a collision, not a copy
+    DedupSlot& slot = found->second;
+    if (slot.header.base_size != chunk_header.base_size) {
+        return false;
+    }
 
-    // Now create each chunk
-    for (const std::string& file_path : files) {
-        // Open file in binary mode
-        std::ifstream in(file_path, std::ios::binary | std::ios::ate);
-        if (!in.is_open()) {
-            std::cerr << "Failed to open: " << file_path << std::endl;
-            continue;
+    // Nor is the same hash over different bytes, which the same stored data or the second hash tells apart.
+    // What a claim holds never changes, so its data is looked at without the lock
+    bool slot_checked = slot.checked;
+    uint64_t slot_check = slot.check;
+    lock.unlock();
+    bool same = false;
+    bool slot_computed = false;
+    try {
+        if (!checked && !slot_checked && slot.header.comp_size == chunk_header.comp_size &&
+            std::memcmp(slot.payload, payload, chunk_header.comp_size) == 0) {
+            same = true;
+        }
+        else {
+            if (!slot_checked) {
+                slot_check = stored_check(slot.header, slot.payload);
+                slot_computed = true;
+            }
+            if (!checked) {
+                check = stored_check(chunk_header, payload);
+            }
+            same = slot_check == check;
         }
+    }
+    catch (const std::exception&) {
+        same = false; // Data that doesn't inflate is stored as it is
+    }
+    lock_timed(lock);
+    if (slot_computed) {
+        slot.check = slot_check;
+        slot.checked = true;
+    }
+    if (!same) {
+        return false;
+    }
 
-        // Get file size
-        std::streamsize size = in.tellg();
-        in.seekg(0, std::ios::beg);
+    // Its data may not be written yet, so the offset is filled in by flush()
+    IndexEntry entry;
+    entry.header = chunk_header;
+    entry.header.flags |= PACKR_FLAG_DEDUP;
+    entry.offset = 0;
+    dedup_entries.push_back(entry);
 
-        // Create header
-        DataHeader header{};
-        std::memset(header.alias, 0, sizeof(header.alias));
+    dedup_stats.chunks++;
+    dedup_stats.bytes += chunk_header.base_size;
+    return true;
+}
+
+ChunkView PackrFile::get_chunk_view(size_t index) const {
+    const IndexEntry& entry = entries.at(index);
+    if (entry.offset > map_size || entry.header.comp_size > map_size - entry.offset) {
+        throw std::runtime_error("PackrFile error: chunk lies outside of file: " + file_path);
+    }
 
-        // Store relative path or filename as alias
-        std::strncpy(header.alias, file_path.c_str(), sizeof(header.alias) - 1);
+    ChunkView view;
+    view.header = &entry.header;
+    view.data = map_data + entry.offset;
+    view.size = entry.header.comp_size;
+    return view;
+}
 
-        header.base_size = static_cast<uint32_t>(size);
-        header.comp_size = static_cast<uint32_t>(size); // same as base for archive (no compression)
+size_t PackrFile::prefetch_chunk(size_t index) const {
+    ChunkView view = get_chunk_view(index);
+    if (view.size == 0) return 0;
+    PACKR_SCOPE(STAGE_READ, view.size, view.header->alias);
+
+    // Ask for the whole range up front, then touch every page so the
+    // disk reads happen here instead of in whoever uses the chunk next
+    size_t page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    uintptr_t start = reinterpret_cast<uintptr_t>(view.data) & ~(page_size - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(view.data) + view.size;
+    madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+
+    volatile char sink = 0;
+    for (uintptr_t page = start; page < end; page += page_size) {
+        sink = *reinterpret_cast<const char*>(std::max(page, reinterpret_cast<uintptr_t>(view.data)));
+    }
+    (void)sink;
+    return view.size;
+}
 
-        // Create chunk and read data directly into it
-        DataChunk chunk;
-        chunk.header = header;
-        chunk.data.resize(size);
-        
-        if (!in.read(chunk.data.data(), size)) {
-            std::cerr << "Failed to read: " << file_path << std::endl;
-            continue;
-        }
+void PackrFile::reserve(size_t bytes) {
+    std::unique_lock<std::mutex> lock(flight_mutex);
+    // Always let one chunk through, even if it is bigger than the limit
+    auto fits = [&] {
+        return max_in_flight == 0 || in_flight == 0 || in_flight + bytes <= max_in_flight;
+    };
+    if (!fits()) {
+        PACKR_SCOPE(STAGE_LOCK_WAIT);
+        flight_cv.wait(lock, fits);
+    }
+    in_flight += bytes;
+}
 
-        // Push chunk into PackrFile (uncompressed)
-        file.add_compressed_chunk(chunk);
+bool PackrFile::try_reserve(size_t bytes) {
+    std::lock_guard<std::mutex> lock(flight_mutex);
+    if (max_in_flight != 0 && in_flight != 0 && in_flight + bytes > max_in_flight) {
+        return false;
     }
+    in_flight += bytes;
+    return true;
+}
 
-    // Write all chunks to disk
-    file.flush();
+void PackrFile::release(size_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(flight_mutex);
+        in_flight -= bytes;
+    }
+    flight_cv.notify_all();
 }
 
-void Packr::compress(std::string& in_path, std::string& out_path) {
-    // load directories recursively
-    std::vector<std::string> files;
-    load_files_from_dir(in_path, files);
+void PackrFile::flush() {
+    PACKR_SCOPE(STAGE_FLUSH);
+    std::lock_guard<std::mutex> lock(write_mutex);
+    if (!file.is_open()) {
+        throw std::runtime_error("PackrFile error: file is not open for writing: " + file_path);
+    }
 
-    // Create a new .packr file
-    PackrFile file(out_path, true);
+    // Point every duplicate at the data of the chunk it copies
+    {
+        std::lock_guard<std::mutex> dedup_lock(dedup_mutex);
+        for (IndexEntry& entry : dedup_entries) {
+            const DedupSlot& slot = dedup_slots[entry.header.content_hash];
+            if (!slot.written) {
+                std::cerr << "Failed to store: " << entry.header.alias << std::endl;
+                continue;
+            }
 
-    // Now create each chunk
-    for (const std::string& file_path : files) {
-        // Open file in binary mode
-        std::ifstream in(file_path, std::ios::binary | std::ios::ate);
-        if (!in.is_open()) {
-            std::cerr << "Failed to open: " << file_path << std::endl;
-            continue;
+            // Share the first copy's data, down to its place in a solid block
+            const DataHeader& first = slot.entry.header;
+            entry.offset = slot.entry.offset;
+            entry.header.comp_size = first.comp_size;
+            entry.header.checksum = first.checksum;
+            entry.header.flags |= first.flags & (PACKR_FLAG_STORED | PACKR_FLAG_SOLID | PACKR_FLAG_DICT);
+            entry.header.codec = first.codec;
+            entry.header.solid_offset = first.solid_offset;
+            entry.header.solid_size = first.solid_size;
+
+            // A copy of a solid block's file only saves its share of the block
+            if (first.flags & PACKR_FLAG_SOLID) {
+                dedup_stats.stored_bytes += first.solid_size > 0
+                    ? static_cast<uint64_t>(first.comp_size) * first.base_size / first.solid_size : 0;
+            }
+            else {
+                dedup_stats.stored_bytes += first.comp_size;
+            }
+            entries.push_back(entry);
         }
+        dedup_entries.clear();
+        header.chunk_count = static_cast<uint32_t>(entries.size());
+    }
 
-        // Get file size
-        std::streamsize size = in.tellg();
-        in.seekg(0, std::ios::beg);
+    // Every chunk is already on disk, append the table of contents after them as one block.
+    // It is compressed with LZ unless that doesn't make it smaller, which keeps opening fast
+    std::string index;
+    encode_index(entries, index);
+    const char* stored = index.data();
+    header.index_raw_size = index.size();
+    header.index_size = index.size();
+    Buffer compressed;
+    if (index.size() <= (size_t(1) << 30)) {
+        uint32_t comp_size = compress_data(index.data(), static_cast<uint32_t>(index.size()), compressed,
+                                           PACKR_FAST_LEVEL, DictView(), CODEC_LZ);
+        if (comp_size < index.size()) {
+            stored = compressed.data();
+            header.index_codec = CODEC_LZ;
+            header.index_size = comp_size;
+        }
+    }
+    header.index_checksum = checksum_data(stored, header.index_size);
+    file.seekp(0, std::ios::end);
+    header.index_offset = static_cast<uint64_t>(file.tellp());
+    file.write(stored, header.index_size);
 
-        // Create header
-        DataHeader header{};
-        std::memset(header.alias, 0, sizeof(header.alias));
+    // Then point the header at it
+    file.seekp(0, std::ios::beg);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(FileHeader));
+    file.seekp(0, std::ios::end);
+    file.flush();
+    if (!file) {
+        throw std::runtime_error("PackrFile error: failed to write header to: " + file_path);
+    }
 
-        // Store relative path or filename as alias
-        std::strncpy(header.alias, file_path.c_str(), sizeof(header.alias) - 1);
+    std::cout << "Wrote " << header.chunk_count << " chunks to " << file_path;
+    if (dedup_stats.chunks > 0) {
+        std::cout << " (" << dedup_stats.chunks << " deduplicated)";
+    }
+    std::cout << std::endl;
+}
 
-        header.base_size = static_cast<uint32_t>(size);
-        header.comp_size = static_cast<uint32_t>(size); // will be updated by add_chunk()
 
-        // Create chunk and read data directly into it
-        DataChunk chunk;
-        chunk.header = header;
-        chunk.data.resize(size);
-        
-        if (!in.read(chunk.data.data(), size)) {
-            std::cerr << "Failed to read: " << file_path << std::endl;
-            continue;
-        }
+// A block of a file, compressed on its own by whichever thread picks it up
+struct BlockTask {
+    const char* file_path; // Points into the list of files, which outlives the tasks
+    int64_t mtime;
+    uint32_t mode;
+    uint64_t offset;
+    uint64_t file_size;
+    uint32_t size;
+    uint32_t block_index;
+    uint32_t block_count;
+};
 
-        // Push chunk into PackrFile (will be compressed)
-        file.add_chunk(chunk);
+// Split a file into blocks of block_size, using the size found by the scan. Without blocks
+// (block_size 0) a file is a single block unless it is bigger than window, which keeps
+// every chunk, and the memory it takes to pack or extract it, bounded whatever the file size
+template <typename Blocks>
+void split_into_blocks(const ScannedFile& file, uint32_t block_size, Blocks& blocks,
+                       uint32_t window = PACKR_STREAM_WINDOW) {
+    uint64_t size = file.size;
+    uint64_t step = block_size > 0 ? block_size : std::max<uint32_t>(window, 1);
+    uint64_t block_count = size > step ? (size + step - 1) / step : 1;
+    if (block_count > UINT32_MAX) {
+        throw std::runtime_error("PackrFile error: too many blocks in file: " + file.path);
     }
 
-    // Write all chunks to disk
-    file.flush();
+    for (uint64_t b = 0; b < block_count; b++) {
+        BlockTask task;
+        task.file_path = file.path.c_str();
+        task.mtime = file.mtime;
+        task.mode = file.mode;
+        task.offset = b * step;
+        task.file_size = size;
+        task.size = static_cast<uint32_t>(std::min<uint64_t>(step, size - task.offset));
+        task.block_index = static_cast<uint32_t>(b);
+        task.block_count = static_cast<uint32_t>(block_count);
+        blocks.push_back(task);
+    }
 }
 
-void Packr::compress_parallel(std::string& in_path,
-                              std::string& out_path,
-                              int num_threads) {
-    // First load directories recursively
-    std::vector<std::string> files;
-    load_files_from_dir(in_path, files);
-
-    // Create a new .packr file
-    PackrFile file(out_path, true);
+// What compress_block() did with a block
+enum BlockResult {
+    BLOCK_FAILED = 0,
+    BLOCK_COPIED,
+    BLOCK_DEDUPED,
+    BLOCK_COMPRESSED,
+};
 
-    // Push all files into queue
-    std::queue<std::string> work_queue;
-    for (auto& f : files) work_queue.push(f);
+class AutoTuner;
 
-    // Mutexes for locking critical section
-    std::mutex queue_mutex;
-    std::mutex packr_mutex;
-    std::atomic<bool> done{false};
+// Totals shared by the workers of one packing operation
+struct CompressTotals {
+    AutoTuner* tuner = nullptr; // Set in auto mode
+    std::atomic<uint64_t> compressed_bytes{0};
+    std::atomic<uint64_t> compress_ns{0};
 
-    // Worker function
-    auto worker = [&]() {
-        while (true) {
-            std::string file_path;
-            // (CRITICAL) Remove file name from queue
-            {
-                std::lock_guard<std::mutex> lock(queue_mutex);
-                if (work_queue.empty())
-                    return;
-                file_path = work_queue.front();
-                work_queue.pop();
-            }
+    // Levels adaptive mode picked
+    std::atomic<uint64_t> stored_chunks{0};
+    std::atomic<uint64_t> fast_chunks{0};
+    std::atomic<uint64_t> max_chunks{0};
 
-            // Load file data
-            std::ifstream in(file_path, std::ios::binary | std::ios::ate);
-            if (!in.is_open()) continue;
+    // Codecs the compressed chunks used
+    std::atomic<uint64_t> codec_chunks[CODEC_COUNT] = {};
+};
 
-            std::streamsize size = in.tellg();
-            in.seekg(0, std::ios::beg);
+// Fill a PackrStats with what deduplication saved, pricing skipped
+// compression at the average speed of the blocks that were compressed
+void add_dedup_stats(const PackrFile& file, const CompressTotals& totals, PackrStats& stats) {
+    const DedupStats& dedup = file.get_dedup_stats();
+    stats.dedup_chunks = dedup.chunks;
+    stats.dedup_bytes = dedup.bytes;
+    stats.dedup_stored_bytes = dedup.stored_bytes;
+    if (totals.compressed_bytes > 0) {
+        stats.dedup_seconds = dedup.bytes * (totals.compress_ns / 1e9) / totals.compressed_bytes;
+    }
+}
 
-            // Directly compress chunk inside memory
-            DataChunk chunk;
-            std::memset(chunk.header.alias, 0, sizeof(chunk.header.alias));
-            std::strncpy(chunk.header.alias, file_path.c_str(),
-                        sizeof(chunk.header.alias) - 1);
+// Fill a PackrStats with what every thread's instrumentation recorded since before
+void add_stage_stats(const TraceTotals& before, PackrStats& stats) {
+    TraceTotals after = Tracer::snapshot();
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        stats.stages[s].ns = after.stages[s].ns - before.stages[s].ns;
+        stats.stages[s].calls = after.stages[s].calls - before.stages[s].calls;
+        stats.stages[s].bytes_in = after.stages[s].bytes_in - before.stages[s].bytes_in;
+        stats.stages[s].bytes_out = after.stages[s].bytes_out - before.stages[s].bytes_out;
+    }
+}
 
-            chunk.header.base_size = static_cast<uint32_t>(size);
-            chunk.header.comp_size = static_cast<uint32_t>(size);
-            chunk.data.resize(size);
+// Train a preset dictionary on a sample spread over the input files. It matters most
+// for small files, so only the start of bigger files is sampled
+std::string sample_dictionary(const std::deque<ScannedFile>& files, uint32_t dict_size) {
+    const size_t max_samples = 4096;
+    const size_t max_sample_size = 16 * 1024;
+    size_t budget = 100 * static_cast<size_t>(dict_size); // Enough to tell boilerplate from chance matches
+    size_t stride = std::max<size_t>(files.size() / max_samples, 1);
+
+    std::vector<std::string> samples;
+    for (size_t i = 0; i < files.size() && budget > 0; i += stride) {
+        if (files[i].size == 0) continue;
+
+        std::string sample(std::min<uint64_t>({ files[i].size, max_sample_size, budget }), '\0');
+        if (read_file_range(files[i].path.c_str(), 0, sample.size(), &sample[0])) {
+            budget -= sample.size();
+            samples.push_back(std::move(sample));
+        }
+    }
 
-            if (!in.read(chunk.data.data(), size)) continue;
+    std::string dictionary = train_dictionary(samples, std::min<uint32_t>(dict_size, SDEFL_MAX_OFF));
+    std::cout << "Trained a " << dictionary.size() << " byte dictionary on " << samples.size() << " samples" << std::endl;
+    return dictionary;
+}
 
-            chunk.data = compress_data(
-                chunk.data.data(),
-                chunk.header.base_size,
-                chunk.header.comp_size
-            );
+// Get how many threads to use, every core this process may run on for PACKR_AUTO_THREADS
+int resolve_threads(int num_threads) {
+    if (num_threads != PACKR_AUTO_THREADS) {
+        return std::max(num_threads, 1);
+    }
+#ifdef __linux__
+    cpu_set_t cores;
+    if (sched_getaffinity(0, sizeof(cores), &cores) == 0) {
+        return std::max(CPU_COUNT(&cores), 1);
+    }
+#endif
+    return std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
 
-            // Add compressed chunk back to files
+// Implements auto mode for a packing job: a gate that lets up to threads blocks compress at once,
+// and the level every block starts with. Both are adjusted from the input MB/s achieved over each
+// interval. Half the cores are tried against all of them first, and more threads only stay if they
+// pay off. Then, given a budget, the level goes down while the job falls behind the speed it needs
+// and back up while it is well ahead of it
+class AutoTuner {
+    private:
+        using clock = std::chrono::steady_clock;
+        const PackrOptions& options;
+        int max_threads;
+        clock::time_point start;
+
+        std::mutex gate_mutex;
+        std::condition_variable gate_cv;
+        int threads;
+        int active = 0;
+        std::atomic<int> level;
+
+        std::atomic<uint64_t> found_bytes{0};
+        std::atomic<uint64_t> done_bytes{0};
+
+        // Measurements, only touched by whoever holds tune_mutex
+        std::mutex tune_mutex;
+        clock::time_point interval_start;
+        uint64_t interval_bytes = 0;
+        int probes_left;
+        double half_speed = 0;
+
+        void set_threads(int count) {
             {
-                std::lock_guard<std::mutex> lock(packr_mutex);
-                file.add_compressed_chunk(chunk);
+                std::lock_guard<std::mutex> lock(gate_mutex);
+                threads = count;
             }
+            gate_cv.notify_all();
         }
-    };
 
+        void tune() {
+            clock::time_point now = clock::now();
+            double seconds = std::chrono::duration<double>(now - interval_start).count();
+            if (seconds < TUNE_INTERVAL) return;
+            uint64_t done = done_bytes;
+            double speed = (done - interval_bytes) / (1024.0 * 1024.0) / seconds;
+            interval_start = now;
+            interval_bytes = done;
+
+            if (probes_left == 2) {
+                half_speed = speed;
+                set_threads(max_threads);
+                probes_left--;
+                return;
+            }
+            if (probes_left == 1) {
+                if (speed < half_speed * 1.1) set_threads(std::max(max_threads / 2, 1));
+                probes_left--;
+                return;
+            }
 
-    // Spawn all threads
-    std::vector<std::thread> threads;
-    for (int i = 0; i < num_threads; i++) {
-        threads.emplace_back(worker);
-    }
+            // The speed a time budget needs is whatever input is left over the time left
+            double required = options.target_speed;
+            if (options.target_seconds > 0) {
+                double left = options.target_seconds - std::chrono::duration<double>(now - start).count();
+                uint64_t found = found_bytes;
+                double remaining = (found > done ? found - done : 0) / (1024.0 * 1024.0);
+                required = std::max(required, left > 0 ? remaining / left : HUGE_VAL);
+            }
+            if (required <= 0) return;
 
-    // Reap all threads
-    for (auto& t : threads) {
-        t.join();
-    }
+            int current = level;
+            if (speed < required && current > 0) {
+                level = current - 1;
+            }
+            else if (speed > required * TUNE_HEADROOM && current < PACKR_MAX_LEVEL) {
+                level = current + 1;
+            }
+        }
+    public:
+        AutoTuner(const PackrOptions& options, int max_threads)
+            : options(options), max_threads(max_threads), start(clock::now()),
+              threads(max_threads > 1 ? max_threads / 2 : 1), level(std::clamp(options.level, 0, PACKR_MAX_LEVEL)),
+              interval_start(start), probes_left(max_threads > 1 ? 2 : 0) {}
+
+        void add_input(uint64_t bytes) { found_bytes += bytes; }
+
+        // Wait for a free slot, then get the level to compress at
+        int acquire() {
+            std::unique_lock<std::mutex> lock(gate_mutex);
+            gate_cv.wait(lock, [&] { return active < threads; });
+            active++;
+            return level;
+        }
+
+        void release(uint64_t bytes) {
+            {
+                std::lock_guard<std::mutex> lock(gate_mutex);
+                active--;
+            }
+            gate_cv.notify_one();
+            done_bytes += bytes;
+
+            // Whoever finishes a block once the interval is over adjusts, the others carry on
+            std::unique_lock<std::mutex> lock(tune_mutex, std::try_to_lock);
+            if (lock.owns_lock()) tune();
+        }
+
+        int get_threads() {
+            std::lock_guard<std::mutex> lock(gate_mutex);
+            return threads;
+        }
+        int get_level() const { return level; }
+};
+
+// Compress a chunk at the level and with the codec the options ask for,
+// picked from a sample in adaptive and auto codec modes
+void compress_with_options(DataChunk& chunk, const PackrOptions& options, const DictView& dict,
+                           CompressTotals& totals) {
+    // In auto mode the tuner decides how many blocks compress at once, and at which level
+    struct TunerSlot {
+        AutoTuner* tuner;
+        uint64_t bytes;
+        ~TunerSlot() { if (tuner) tuner->release(bytes); }
+    };
+    int level = totals.tuner ? totals.tuner->acquire() : options.level;
+    TunerSlot slot{ totals.tuner, chunk.header.base_size };
+
+    auto compress_start = std::chrono::steady_clock::now();
+    if (options.adaptive) {
+        level = choose_level(chunk.data.data(), chunk.header.base_size, options);
+        if (level < 0) totals.stored_chunks++;
+        else if (level == PACKR_FAST_LEVEL) totals.fast_chunks++;
+        else totals.max_chunks++;
+    }
+    CodecId codec = options.codec;
+    if (codec == CODEC_AUTO) {
+        codec = level < 0 ? CODEC_DEFLATE : choose_codec(chunk.data.data(), chunk.header.base_size, level, options);
+    }
+    compress_chunk(chunk, level, dict, codec);
+    if (!(chunk.header.flags & PACKR_FLAG_STORED)) {
+        totals.codec_chunks[chunk.header.codec]++;
+    }
+    totals.compressed_bytes += chunk.header.base_size;
+    totals.compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - compress_start).count();
+}
+
+// Fill in the header of a block's chunk
+void set_block_header(DataHeader& header, const BlockTask& task) {
+    header.alias = task.file_path;
+    header.base_size = task.size;
+    header.comp_size = task.size;
+    header.file_offset = task.offset;
+    header.file_size = task.file_size;
+    header.block_index = task.block_index;
+    header.block_count = task.block_count;
+    header.mtime = task.mtime;
+    header.mode = task.mode;
+}
+
+// Hash, deduplicate and compress a block whose data is already in chunk.data
+BlockResult pack_loaded_block(PackrFile& file, const BlockTask& task, const ChunkView* previous,
+                              DataChunk& chunk, const PackrOptions& options, CompressTotals& totals) {
+    {
+        PACKR_SCOPE(STAGE_HASH, task.size, chunk.header.alias);
+        chunk.header.content_hash = hash_data(chunk.data.data(), task.size);
+    }
+
+    // Same content as a block already in the file, store a reference only
+    if (file.add_if_duplicate(chunk.header, chunk.data.data())) {
+        return BLOCK_DEDUPED;
+    }
+
+    // Unchanged content, reuse the old compressed data as is unless it got damaged
+    if (previous && previous->header->base_size == task.size &&
+        previous->header->content_hash == chunk.header.content_hash && chunk_intact(*previous)) {
+        DataHeader header = *previous->header;
+        header.mtime = task.mtime;
+        header.mode = task.mode;
+        header.flags &= ~PACKR_FLAG_DEDUP;
+        file.add_compressed_data(header, previous->data);
+        return BLOCK_COPIED;
+    }
+
+    // Directly compress chunk inside memory
+    compress_with_options(chunk, options, file.get_dictionary(), totals);
+
+    // Stream compressed chunk straight to disk
+    file.add_compressed_chunk(chunk);
+    return BLOCK_COMPRESSED;
+}
+
+// Holds a block's reserved memory and its buffer, and gives both back however the block ends,
+// so a block that fails to write can't leave the other workers waiting for its memory
+struct BlockReservation {
+    PackrFile& file;
+    size_t size;
+    BufferPool* buffers = nullptr; // Where the buffer goes back to, if the block has one
+    Buffer* data = nullptr;
+    ~BlockReservation() {
+        if (buffers) buffers->release(std::move(*data));
+        file.release(size);
+    }
+};
+
+// Read and compress a single block (PackrFile locks its own writes).
+// If the block's previous version still has the same content, its
+// compressed data is copied over instead, and a block identical to one
+// already in the file only gets a reference to it.
+BlockResult compress_block(PackrFile& file, const BlockTask& task, const ChunkView* previous,
+                           const PackrOptions& options, CompressTotals& totals) {
+    // Wait until the writer has caught up with the other workers
+    file.reserve(task.size);
+
+    // The block's buffer comes from this worker's pool and goes back to it however the block ends
+    DataChunk chunk{};
+    chunk.data = BufferPool::local().acquire(task.size);
+    BlockReservation reservation{ file, task.size, &BufferPool::local(), &chunk.data };
+    set_block_header(chunk.header, task);
+
+    // Load block data
+    if (!read_file_range(task.file_path, task.offset, task.size, chunk.data.data())) {
+        return BLOCK_FAILED;
+    }
+    return pack_loaded_block(file, task, previous, chunk, options, totals);
+}
+
+// Struct for a group of small files that get compressed together
+struct SolidTask {
+    std::vector<const BlockTask*> members;
+    uint64_t size = 0;
+};
+
+// Get a path's extension and directory, the keys small files are grouped by
+std::string_view get_extension(std::string_view path) {
+    size_t name = path.find_last_of('/');
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string_view::npos || (name != std::string_view::npos && dot < name)) return {};
+    return path.substr(dot);
+}
+std::string_view get_directory(std::string_view path) {
+    size_t name = path.find_last_of('/');
+    return name == std::string_view::npos ? std::string_view() : path.substr(0, name);
+}
+
+// Pack small files into solid blocks of about block_size, similar files next to
+// each other so the compressor finds matches across them
+void group_solid_files(std::vector<const BlockTask*>& files, uint32_t block_size,
+                       std::vector<SolidTask>& solid_blocks) {
+    std::sort(files.begin(), files.end(), [](const BlockTask* a, const BlockTask* b) {
+        std::string_view path_a(a->file_path), path_b(b->file_path);
+        int order = get_extension(path_a).compare(get_extension(path_b));
+        if (order == 0) order = get_directory(path_a).compare(get_directory(path_b));
+        if (order == 0) order = path_a.compare(path_b);
+        return order < 0;
+    });
+
+    SolidTask current;
+    for (const BlockTask* file : files) {
+        if (!current.members.empty() && current.size + file->size > block_size) {
+            solid_blocks.push_back(std::move(current));
+            current = SolidTask();
+        }
+        current.members.push_back(file);
+        current.size += file->size;
+    }
+    if (!current.members.empty()) {
+        solid_blocks.push_back(std::move(current));
+    }
+}
+
+// Read a group of small files into one buffer and compress them as a single
+// payload. Files already in the archive only get a reference, as with blocks.
+// With reserved, the caller already holds the block's memory
+BlockResult compress_solid_block(PackrFile& file, const SolidTask& task,
+                                 const PackrOptions& options, CompressTotals& totals, bool reserved = false) {
+    if (!reserved) file.reserve(task.size);
+
+    DataChunk chunk{};
+    chunk.data = BufferPool::local().acquire(task.size);
+    BlockReservation reservation{ file, task.size, &BufferPool::local(), &chunk.data };
+
+    // Read every file in one batch, each one right behind the previous
+    thread_local std::vector<IoRequest> reads;
+    reads.clear();
+    uint32_t planned = 0;
+    for (const BlockTask* member : task.members) {
+        IoRequest read;
+        read.path = member->file_path;
+        read.open_flags = O_RDONLY;
+        read.data = chunk.data.data() + planned;
+        read.size = member->size;
+        reads.push_back(read);
+        planned += member->size;
+    }
+    {
+        PACKR_SCOPE(STAGE_READ, planned);
+        AsyncIo::local(options.io_backend, options.io_depth).run(reads);
+    }
+
+    // Keep the files that aren't already in the archive, closing the gaps the others leave
+    thread_local std::vector<DataHeader> members;
+    members.clear();
+    uint32_t used = 0;
+    for (size_t m = 0; m < task.members.size(); m++) {
+        const BlockTask* member = task.members[m];
+        if (!reads[m].done()) {
+            std::cerr << "Failed to read: " << member->file_path << std::endl;
+            continue;
+        }
+
+        DataHeader header{};
+        header.alias = member->file_path;
+        header.base_size = member->size;
+        header.file_size = member->size;
+        header.block_count = 1;
+        header.mtime = member->mtime;
+        header.mode = member->mode;
+        {
+            PACKR_SCOPE(STAGE_HASH, member->size, header.alias);
+            header.content_hash = hash_data(reads[m].data, member->size);
+        }
+        if (file.add_if_duplicate(header, reads[m].data)) {
+            continue;
+        }
+
+        char* data = chunk.data.data() + used;
+        if (reads[m].data != data) {
+            std::memmove(data, reads[m].data, member->size);
+        }
+        header.flags = PACKR_FLAG_SOLID;
+        header.solid_offset = used;
+        used += member->size;
+        members.push_back(header);
+    }
+    if (members.empty()) {
+        return BLOCK_DEDUPED;
+    }
+
+    // The block's own header only describes the payload, its files are listed in the table of contents
+    chunk.data.shrink(used);
+    chunk.header.base_size = used;
+    chunk.header.comp_size = used;
+    chunk.header.block_count = 1;
+    chunk.header.flags = PACKR_FLAG_SOLID;
+    compress_with_options(chunk, options, file.get_dictionary(), totals);
+
+    file.add_solid_block(chunk.header, chunk.data.data(), members);
+    return BLOCK_COMPRESSED;
+}
+
+// Implements the read stage of packing for the io_uring backend. One thread keeps up to
+// io_depth block reads in flight and hands every filled buffer to a compression task,
+// so workers never wait on the disk
+class BlockReader {
+    private:
+        PackrFile& file;
+        const PackrOptions& options;
+        CompressTotals& totals;
+        ThreadPool& pool;
+        TaskGroup& group;
+        BufferPool buffers; // Shared, buffers are filled here and emptied on the workers
+
+        std::mutex mutex;
+        std::condition_variable more_cv;
+        std::vector<const BlockTask*> pending; // Every block added so far
+        bool finished = false;
+
+        // Blocks that were read, each one's buffer stays here until its task takes it
+        struct LoadedBlock {
+            const BlockTask* task;
+            Buffer data;
+        };
+        std::deque<LoadedBlock> loaded;
+
+        std::thread thread;
+        std::exception_ptr error;
+
+        void compress(LoadedBlock& item) {
+            DataChunk chunk{};
+            set_block_header(chunk.header, *item.task);
+            chunk.data = std::move(item.data);
+            BlockReservation reservation{ file, item.task->size, &buffers, &chunk.data };
+            pack_loaded_block(file, *item.task, nullptr, chunk, options, totals);
+        }
+
+        void run() {
+            AsyncIo io(options.io_backend, options.io_depth);
+            std::vector<const BlockTask*> batch;
+            std::vector<IoRequest> reads;
+            size_t next = 0;
+            while (true) {
+                // Take up to a batch of the blocks added so far
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    more_cv.wait(lock, [&] { return next < pending.size() || finished; });
+                    if (next == pending.size()) break;
+                    size_t end = std::min(pending.size(), next + std::max(options.io_depth, 1u));
+                    batch.assign(pending.begin() + next, pending.begin() + end);
+                }
+
+                // Hold the memory of as many as fit, at least one. Only waiting with nothing
+                // reserved means the wait is always on tasks already handed to the pool
+                size_t reserved = 0;
+                uint64_t bytes = 0;
+                for (const BlockTask* block : batch) {
+                    if (reserved == 0) file.reserve(block->size);
+                    else if (!file.try_reserve(block->size)) break;
+                    reserved++;
+                    bytes += block->size;
+                }
+                batch.resize(reserved);
+                next += reserved;
+
+                size_t first = loaded.size();
+                reads.clear();
+                for (const BlockTask* block : batch) {
+                    loaded.push_back({ block, buffers.acquire(block->size) });
+                    IoRequest read;
+                    read.path = block->file_path;
+                    read.open_flags = O_RDONLY;
+                    read.offset = block->offset;
+                    read.data = loaded.back().data.data();
+                    read.size = block->size;
+                    reads.push_back(read);
+                }
+                {
+                    PACKR_SCOPE(STAGE_READ, bytes);
+                    io.run(reads);
+                }
+
+                std::vector<PoolTask> tasks;
+                for (size_t i = 0; i < batch.size(); i++) {
+                    LoadedBlock* item = &loaded[first + i];
+                    if (!reads[i].done()) {
+                        std::cerr << "Failed to read: " << item->task->file_path << std::endl;
+                        buffers.release(std::move(item->data));
+                        file.release(item->task->size);
+                        continue;
+                    }
+                    PoolTask task;
+                    task.fn = [this, item]() { compress(*item); };
+                    task.size = item->task->size;
+                    tasks.push_back(std::move(task));
+                }
+                pool.submit(group, tasks);
+            }
+        }
+    public:
+        BlockReader(PackrFile& file, const PackrOptions& options, CompressTotals& totals,
+                    ThreadPool& pool, TaskGroup& group)
+            : file(file), options(options), totals(totals), pool(pool), group(group),
+              buffers(options.io_depth + pool.size()) {
+            thread = std::thread([this]() {
+                try {
+                    run();
+                }
+                catch (...) {
+                    error = std::current_exception();
+                }
+            });
+        }
+
+        void add(const BlockTask* block) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending.push_back(block);
+            }
+            more_cv.notify_one();
+        }
+
+        // No more blocks are coming, returns once every one was handed to the pool
+        std::exception_ptr finish() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                finished = true;
+            }
+            more_cv.notify_one();
+            if (thread.joinable()) thread.join();
+            return error;
+        }
+        ~BlockReader() { finish(); }
+};
+
+PackrStats Packr::archive(std::string& in_path, std::string& out_path) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+
+    // load directories recursively
+    std::vector<ScannedFile> files;
+    load_files_from_dir(in_path, files);
+
+    //debug
+    // for (int i = 0; i < files.size(); i++) {
+    //     std::cout << files[i] << std::endl;
+    // }
+
+    // Create a new .packr file
+    PackrFile file(out_path, true);
+
+    // Now create each chunk, reusing one chunk whose buffer only grows. Files bigger
+    // than the stream window are read one window at a time, so memory stays constant
+    DataChunk chunk;
+    std::vector<BlockTask> windows;
+    for (const ScannedFile& scanned : files) {
+        windows.clear();
+        split_into_blocks(scanned, 0, windows);
+        for (const BlockTask& window : windows) {
+            // Read the window directly into the chunk
+            chunk.data.prepare(window.size);
+            if (!read_file_range(window.file_path, window.offset, window.size, chunk.data.data())) {
+                std::cerr << "Failed to read: " << scanned.path << std::endl;
+                break;
+            }
+
+            // Create header, with the relative path or filename as alias
+            chunk.header = DataHeader{};
+            set_block_header(chunk.header, window); // same size as base for archive (no compression)
+            chunk.header.flags = PACKR_FLAG_STORED;
+            {
+                PACKR_SCOPE(STAGE_HASH, window.size, chunk.header.alias);
+                chunk.header.content_hash = hash_data(chunk.data.data(), window.size);
+            }
 
-    // Write to disk
+            // Push chunk into PackrFile (uncompressed)
+            file.add_compressed_chunk(chunk);
+        }
+    }
+
+    // Finish the file header
     file.flush();
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
 }
 
-void Packr::decompress(std::string& in_path, std::string& out_path) {
-    PackrFile packr_file(in_path, false);
+PackrStats Packr::compress(std::string& in_path, std::string& out_path) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+
+    // load directories recursively
+    std::vector<ScannedFile> files;
+    load_files_from_dir(in_path, files);
+
+    // Create a new .packr file, identical files are only stored once
+    PackrFile file(out_path, true);
+    file.set_dedup(true);
+    CompressTotals totals;
+
+    // Now create each chunk, reusing one chunk whose buffer only grows. Files bigger
+    // than the stream window are read and compressed one window at a time
+    DataChunk chunk;
+    std::vector<BlockTask> windows;
+    for (const ScannedFile& scanned : files) {
+        windows.clear();
+        split_into_blocks(scanned, 0, windows);
+        for (const BlockTask& window : windows) {
+            // Read the window directly into the chunk
+            chunk.data.prepare(window.size);
+            if (!read_file_range(window.file_path, window.offset, window.size, chunk.data.data())) {
+                std::cerr << "Failed to read: " << scanned.path << std::endl;
+                break;
+            }
 
-    std::filesystem::create_directories(out_path);
+            // Create header, with the relative path or filename as alias
+            chunk.header = DataHeader{};
+            set_block_header(chunk.header, window); // comp_size will be updated by add_chunk()
+            {
+                PACKR_SCOPE(STAGE_HASH, window.size, chunk.header.alias);
+                chunk.header.content_hash = hash_data(chunk.data.data(), window.size);
+            }
+            if (file.add_if_duplicate(chunk.header, chunk.data.data())) {
+                continue;
+            }
 
-    const auto& chunks = packr_file.get_chunks();
+            // Push chunk into PackrFile (will be compressed)
+            auto compress_start = std::chrono::steady_clock::now();
+            file.add_chunk(chunk);
+            totals.compressed_bytes += chunk.header.base_size;
+            totals.compress_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - compress_start).count();
+        }
+    }
+
+    // Finish the file header
+    file.flush();
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    add_dedup_stats(file, totals, stats);
+    return stats;
+}
+
+PackrStats Packr::compress_parallel(std::string& in_path,
+                                    std::string& out_path,
+                                    int num_threads,
+                                    const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+
+    // Create a new .packr file
+    PackrFile file(out_path, true);
+    file.set_block_size(options.block_size);
+    file.set_dedup(options.dedup);
+    CompressTotals totals;
+
+    // Auto mode sizes the pool to the cores and lets the tuner gate how many of them compress
+    bool auto_mode = num_threads == PACKR_AUTO_THREADS || options.target_seconds > 0 || options.target_speed > 0;
+    num_threads = resolve_threads(num_threads);
+    std::unique_ptr<AutoTuner> tuner;
+    if (auto_mode) {
+        tuner = std::make_unique<AutoTuner>(options, num_threads);
+        totals.tuner = tuner.get();
+    }
+
+    // Bound the bytes held by workers so memory depends on threads x block or window size
+    size_t max_in_flight = options.max_in_flight;
+    if (max_in_flight == 0) {
+        max_in_flight = 2 * static_cast<size_t>(num_threads) *
+            (options.block_size > 0 ? options.block_size : options.stream_window);
+    }
+    file.set_max_in_flight(max_in_flight);
+
+    // Files and blocks are only ever appended, so tasks can keep pointing at them
+    std::deque<ScannedFile> files;
+    std::deque<BlockTask> blocks;
+    std::vector<const BlockTask*> small_files;
+    std::mutex found_mutex;
+
+    // Hand blocks to the shared pool, biggest first. Tasks only capture
+    // two pointers, which std::function stores without allocating
+    struct BlockJob {
+        PackrFile& file;
+        const PackrOptions& options;
+        CompressTotals& totals;
+    } job{ file, options, totals };
+    std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+    TaskGroup group;
+    std::unique_ptr<BlockReader> reader;
+    auto queue_blocks = [&](size_t first, std::vector<PoolTask>& tasks) {
+        for (size_t b = first; b < blocks.size(); b++) {
+            const BlockTask& block = blocks[b];
+
+            // Small files are packed into solid blocks instead, once all of them are known
+            if (options.solid && block.block_count == 1 && block.size <= options.solid_file_size) {
+                small_files.push_back(&block);
+                continue;
+            }
+            if (reader) {
+                reader->add(&block);
+                continue;
+            }
+            PoolTask task;
+            task.fn = [&job, &block]() { compress_block(job.file, block, nullptr, job.options, job.totals); };
+            task.size = block.size;
+            tasks.push_back(std::move(task));
+        }
+    };
 
-    std::cout << "Decompressing " << chunks.size() << " files..." << std::endl;
+    // The io_uring backend reads blocks on a stage of its own, which hands them to the pool
+    if (options.io_backend == IO_BACKEND_URING) {
+        reader = std::make_unique<BlockReader>(file, options, totals, *pool, group);
+    }
 
-    for (const auto& chunk : chunks) {
-        std::string alias(chunk.header.alias);
+    // Scan the tree on the pool. Blocks of every directory go to the pool as soon as it is
+    // listed, unless a dictionary has to be trained on the whole input first
+    bool stream = !options.dictionary;
+    std::exception_ptr error;
+    {
+        TaskGroup scan_group;
+        DirectoryScan scan(*pool, scan_group, [&](std::vector<ScannedFile>& found) {
+            std::vector<PoolTask> tasks;
+            {
+                std::lock_guard<std::mutex> lock(found_mutex);
+                size_t first = blocks.size();
+                for (ScannedFile& f : found) {
+                    if (tuner) tuner->add_input(f.size);
+                    files.push_back(std::move(f));
+                    split_into_blocks(files.back(), options.block_size, blocks, options.stream_window);
+                }
+                if (stream) queue_blocks(first, tasks);
+            }
+            pool->submit(group, tasks);
+        });
+        try {
+            scan.start(in_path);
+            scan_group.wait();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+    }
+    if (error) {
+        // Blocks already queued still point at this function's state
+        if (reader) reader->finish();
+        try { group.wait(); } catch (...) {}
+        std::rethrow_exception(error);
+    }
 
-        std::filesystem::path relative_path(alias);
+    std::vector<PoolTask> tasks;
+    if (!stream) {
+        std::string dictionary = sample_dictionary(files, options.dictionary_size);
+        file.set_dictionary(DictView{ dictionary.data(), static_cast<uint32_t>(dictionary.size()) });
+        queue_blocks(0, tasks);
+    }
 
-        // If alias is absolute, strip root to avoid writing outside out_path
-        if (relative_path.is_absolute()) {
-            relative_path = relative_path.lexically_relative(
-                relative_path.root_path());
+    std::vector<SolidTask> solid_blocks;
+    group_solid_files(small_files, options.solid_block_size, solid_blocks);
+    if (!reader) {
+        for (const SolidTask& solid : solid_blocks) {
+            PoolTask task;
+            task.fn = [&job, &solid]() { compress_solid_block(job.file, solid, job.options, job.totals); };
+            task.size = solid.size;
+            tasks.push_back(std::move(task));
         }
+        pool->submit(group, tasks);
+    }
+    else {
+        // Queued blocks hold memory the reader reserved for them, so a worker waiting for memory could
+        // be waiting on tasks queued behind it. Solid blocks are reserved here instead, once the reader
+        // is done, and only ever wait on tasks already handed to the pool
+        error = reader->finish();
+        for (size_t s = 0; s < solid_blocks.size() && !error; s++) {
+            const SolidTask* solid = &solid_blocks[s];
+            file.reserve(solid->size);
+            std::vector<PoolTask> solid_task(1);
+            solid_task[0].fn = [&job, solid]() { compress_solid_block(job.file, *solid, job.options, job.totals, true); };
+            solid_task[0].size = solid->size;
+            pool->submit(group, solid_task);
+        }
+    }
+    group.wait();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // Finish the file header
+    file.flush();
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    add_dedup_stats(file, totals, stats);
+    if (stats.dedup_chunks > 0) {
+        std::cout << "Deduplication saved " << stats.dedup_bytes << " bytes of input, "
+                  << stats.dedup_stored_bytes << " bytes of output and about "
+                  << stats.dedup_seconds << " s of compression" << std::endl;
+    }
+
+    stats.stored_chunks = totals.stored_chunks;
+    stats.fast_chunks = totals.fast_chunks;
+    stats.max_chunks = totals.max_chunks;
+    if (options.adaptive) {
+        std::cout << "Adaptive mode stored " << stats.stored_chunks << " chunks, used the fast level for "
+                  << stats.fast_chunks << " and the max level for " << stats.max_chunks << std::endl;
+    }
+    for (int codec = 0; codec < CODEC_COUNT; codec++) {
+        stats.codec_chunks[codec] = totals.codec_chunks[codec];
+    }
+    if (options.codec == CODEC_AUTO) {
+        std::cout << "Auto codec used Deflate for " << stats.codec_chunks[CODEC_DEFLATE] << " chunks and LZ for "
+                  << stats.codec_chunks[CODEC_LZ] << std::endl;
+    }
+    stats.threads = tuner ? tuner->get_threads() : num_threads;
+    stats.level = tuner ? tuner->get_level() : options.level;
+    if (tuner) {
+        std::cout << "Auto mode settled on level " << stats.level << " with " << stats.threads << " of "
+                  << num_threads << " threads" << std::endl;
+    }
+    return stats;
+}
 
-        std::filesystem::path output_file =
-            std::filesystem::path(out_path) / relative_path;
+PackrStats Packr::update(std::string& archive_path, std::string& in_path, int num_threads,
+                         const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    num_threads = resolve_threads(num_threads);
+    TraceTotals trace_start = Tracer::snapshot();
 
+    // Load directories recursively
+    std::vector<ScannedFile> files;
+    load_files_from_dir(in_path, files);
 
-        // Create parent directories if needed
-        std::filesystem::create_directories(output_file.parent_path());
+    // The new archive is built next to the old one and then replaces it, or is removed if that fails
+    std::string tmp_path = archive_path + ".tmp";
+    std::filesystem::remove(tmp_path);
+    struct TmpFileGuard {
+        const std::string& path;
+        bool kept = false;
+        ~TmpFileGuard() {
+            std::error_code ignored;
+            if (!kept) std::filesystem::remove(path, ignored);
+        }
+    } tmp_guard{ tmp_path };
+
+    std::atomic<size_t> copied{0};
+    std::atomic<size_t> recompressed{0};
+    size_t dropped = 0;
+    {
+        PackrFile old_file(archive_path, false);
+        const auto& entries = old_file.get_entries();
+
+        // Copied data keeps the codec and storage of the payload it is, which for a
+        // reference is what the payload's own entry says rather than the reference
+        std::unordered_map<uint64_t, const DataHeader*> payloads;
+        for (const IndexEntry& entry : entries) {
+            if (!(entry.header.flags & (PACKR_FLAG_DEDUP | PACKR_FLAG_SOLID))) payloads[entry.offset] = &entry.header;
+        }
+        std::vector<DataHeader> copy_headers;
+        copy_headers.reserve(entries.size());
+        for (const IndexEntry& entry : entries) {
+            DataHeader header = entry.header;
+            auto owner = payloads.find(entry.offset);
+            if ((header.flags & PACKR_FLAG_DEDUP) && owner != payloads.end()) {
+                uint32_t storage = PACKR_FLAG_STORED | PACKR_FLAG_DICT;
+                header.flags = (header.flags & ~storage) | (owner->second->flags & storage);
+                header.codec = owner->second->codec;
+            }
+            copy_headers.push_back(header);
+        }
+        auto copy_view = [&](const IndexEntry* entry) {
+            size_t index = entry - entries.data();
+            ChunkView view = old_file.get_chunk_view(index);
+            view.header = &copy_headers[index];
+            return view;
+        };
+
+        // Group the old chunks by file, in block order
+        std::unordered_map<std::string, std::vector<size_t>> old_chunks;
+        for (size_t i = 0; i < entries.size(); i++) {
+            old_chunks[entries[i].header.alias].push_back(i);
+        }
+        for (auto& item : old_chunks) {
+            std::sort(item.second.begin(), item.second.end(), [&](size_t a, size_t b) {
+                return entries[a].header.block_index < entries[b].header.block_index;
+            });
+        }
+
+        // Keep the old block size so unchanged blocks still line up
+        PackrFile new_file(tmp_path, true);
+        new_file.set_block_size(old_file.get_block_size());
+        new_file.set_dedup(options.dedup);
+
+        // Copied chunks may have been primed with the old dictionary, changed ones are compressed with it too
+        new_file.set_dictionary(old_file.get_dictionary());
+        CompressTotals totals;
+
+        std::vector<BlockTask> blocks;
+        std::vector<const IndexEntry*> previous; // Old version of each block, if any
+        std::vector<bool> same_file; // Size and mtime match, copy without reading
+        size_t kept = 0;
+        for (const ScannedFile& f : files) {
+            size_t first = blocks.size();
+            split_into_blocks(f, old_file.get_block_size(), blocks, options.stream_window);
+
+            auto found = old_chunks.find(f.path);
+            const std::vector<size_t>* old = found == old_chunks.end() ? nullptr : &found->second;
+            if (old) kept++;
+
+            // Blocks only line up with the old ones if the file kept its size
+            uint64_t old_size = 0;
+            if (old) {
+                for (size_t index : *old) old_size += entries[index].header.base_size;
+            }
+            uint64_t new_size = 0;
+            for (size_t b = first; b < blocks.size(); b++) new_size += blocks[b].size;
+
+            // Files of a solid block have no data of their own to copy, they are compressed again
+            bool solid = false;
+            if (old) {
+                for (size_t index : *old) solid |= (entries[index].header.flags & PACKR_FLAG_SOLID) != 0;
+            }
 
-        // Decompress the data
-        std::vector<char> decompressed;
-        if (chunk.header.base_size != chunk.header.comp_size) {
-            // Data is compressed, decompress it
-            decompressed = decompress_data(
-                chunk.data.data(),
-                chunk.header.comp_size,
-                chunk.header.base_size
-            );
-        } else {
-            // Data is not compressed
-            decompressed = chunk.data;
+            bool same_layout = old && !solid && old_size == new_size && old->size() == blocks.size() - first;
+            bool same_mtime = same_layout && entries[old->front()].header.mtime == f.mtime;
+            for (size_t b = first; b < blocks.size(); b++) {
+                previous.push_back(same_layout ? &entries[(*old)[b - first]] : nullptr);
+                same_file.push_back(same_mtime);
+            }
+        }
+        dropped = old_chunks.size() - kept;
+
+        // Copy or recompress every block on the shared pool
+        std::vector<PoolTask> tasks;
+        for (size_t b = 0; b < blocks.size(); b++) {
+            PoolTask task;
+            task.size = blocks[b].size;
+            task.fn = [&, b]() {
+                ChunkView old_view{};
+                if (same_file[b]) {
+                    old_view = copy_view(previous[b]);
+                }
+                if (same_file[b] && chunk_intact(old_view)) {
+                    // Untouched file, copy the compressed data verbatim (once, if it was deduplicated).
+                    // A chmod leaves the mtime alone, so the permission bits are always the current ones
+                    const ChunkView& view = old_view;
+                    DataHeader header = *view.header;
+                    header.mode = blocks[b].mode;
+                    if (new_file.add_copy_if_duplicate(header, view.data)) {
+                        copied++;
+                        return;
+                    }
+
+                    header.flags &= ~PACKR_FLAG_DEDUP;
+                    new_file.reserve(view.size);
+                    BlockReservation reservation{ new_file, view.size };
+                    new_file.add_compressed_data(header, view.data);
+                    copied++;
+                    return;
+                }
+
+                // Otherwise compare content hashes, only changed blocks get recompressed
+                ChunkView view{};
+                if (previous[b]) {
+                    view = copy_view(previous[b]);
+                }
+                if (compress_block(new_file, blocks[b], previous[b] ? &view : nullptr, options, totals) == BLOCK_COMPRESSED) {
+                    recompressed++;
+                }
+                else {
+                    copied++;
+                }
+            };
+            tasks.push_back(std::move(task));
         }
 
-        // Write to file
-        std::ofstream out(output_file, std::ios::binary);
-        if (!out.is_open()) {
-            std::cerr << "Failed to create: " << output_file << std::endl;
-            continue;
+        std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+        TaskGroup group;
+        pool->submit(group, tasks);
+        group.wait();
+
+        new_file.flush();
+    }
+
+    std::filesystem::rename(tmp_path, archive_path);
+    tmp_guard.kept = true;
+
+    std::cout << "Updated " << archive_path << ": copied " << copied << " chunks, recompressed "
+              << recompressed << " chunks, dropped " << dropped << " deleted files" << std::endl;
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
+}
+
+// Get the uncompressed size of the payload a chunk's data is stored in
+uint64_t payload_size(const DataHeader& header) {
+    return (header.flags & PACKR_FLAG_SOLID) ? header.solid_size : header.base_size;
+}
+
+// Group entries by the payload they are stored in, in file order. References and
+// the files of a solid block share one payload, which is only inflated once for all of them
+std::vector<std::vector<size_t>> group_by_payload(const std::vector<IndexEntry>& entries,
+                                                  const std::vector<size_t>& indices) {
+    std::vector<std::vector<size_t>> groups;
+    std::unordered_map<uint64_t, size_t> group_of_offset;
+    for (size_t index : indices) {
+        auto inserted = group_of_offset.emplace(entries[index].offset, groups.size());
+        if (inserted.second) {
+            groups.emplace_back();
         }
+        groups[inserted.first->second].push_back(index);
+    }
+
+    std::sort(groups.begin(), groups.end(), [&](const std::vector<size_t>& a, const std::vector<size_t>& b) {
+        return entries[a.front()].offset < entries[b.front()].offset;
+    });
+    return groups;
+}
+
+// Check a payload and get its uncompressed data, inflated into out unless it was stored
+const char* open_payload(const ChunkView& view, const DictView& dict, Buffer& out) {
+    const DataHeader& header = *view.header;
+    if (!chunk_intact(view)) {
+        throw std::runtime_error("PackrFile error: checksum mismatch in chunk: " + header.alias);
+    }
+    if (header.flags & PACKR_FLAG_STORED) {
+        return view.data;
+    }
+
+    bool primed = (header.flags & PACKR_FLAG_DICT) != 0;
+    if (primed && dict.size == 0) {
+        throw std::runtime_error("PackrFile error: missing dictionary for chunk: " + header.alias);
+    }
+    if (!Codec::get(header.codec)) {
+        throw std::runtime_error("PackrFile error: unknown codec in chunk: " + header.alias);
+    }
+
+    // Chunks are never bigger than a block or stream window, whatever the size of their file
+    if (payload_size(header) > UINT32_MAX || view.size > UINT32_MAX) {
+        throw std::runtime_error("PackrFile error: chunk too large: " + header.alias);
+    }
+    return decompress_data(view.data, static_cast<uint32_t>(view.size), static_cast<uint32_t>(payload_size(header)),
+                           out, primed ? dict : DictView(), header.codec);
+}
+
+// Get a chunk's data inside its opened payload, checking it if it was inflated
+const char* get_entry_data(const DataHeader& header, const char* payload) {
+    uint64_t offset = (header.flags & PACKR_FLAG_SOLID) ? header.solid_offset : 0;
+    if (offset + header.base_size > payload_size(header)) {
+        throw std::runtime_error("PackrFile error: chunk lies outside of its block: " + header.alias);
+    }
 
-        out.write(decompressed.data(), decompressed.size());
-        out.close();
+    const char* data = payload + offset;
+    if (!(header.flags & PACKR_FLAG_STORED) && !content_intact(header, data, header.base_size)) {
+        throw std::runtime_error("PackrFile error: content hash mismatch in chunk: " + header.alias);
     }
+    return data;
+}
+
+const char* PackrFile::read_entry(size_t index, Buffer& out) const {
+    const char* payload = open_payload(get_chunk_view(index), get_dictionary(), out);
+    return get_entry_data(entries[index].header, payload);
+}
+
+// Extract the given entries of an open .packr file into out_path
+void extract_entries(PackrFile& packr_file, const std::vector<size_t>& indices,
+                     const std::string& out_path, const PackrOptions& options) {
+    const auto& entries = packr_file.get_entries();
+
+    // Directories and split files are all created before the first write
+    OutputTree tree(out_path, options.restore_metadata);
+    std::vector<const OutputFile*> targets;
+    for (const OutputFile* failed : tree.add_files(entries, indices, targets)) {
+        std::cerr << "Failed to create: " << failed->path << std::endl;
+    }
+
+    // Only the pages of the payloads in use are read from the file, stored ones are written without a copy
+    thread_local Buffer decompressed;
+    for (const auto& group : group_by_payload(entries, indices)) {
+        ChunkView view = packr_file.get_chunk_view(group.front());
+        const char* payload = open_payload(view, packr_file.get_dictionary(), decompressed);
+
+        for (size_t index : group) {
+            const DataHeader& header = entries[index].header;
+            const char* data = get_entry_data(header, payload);
+            if (targets[index]->created && !tree.write(*targets[index], header, data, header.base_size)) {
+                std::cerr << "Failed to create: " << targets[index]->path << std::endl;
+            }
+        }
+    }
+    tree.finish();
+}
+
+PackrStats Packr::decompress(std::string& in_path, std::string& out_path, const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+    PackrFile packr_file(in_path, false);
+
+    const auto& entries = packr_file.get_entries();
+
+    std::cout << "Decompressing " << entries.size() << " chunks..." << std::endl;
+
+    std::vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < indices.size(); i++) indices[i] = i;
+    extract_entries(packr_file, indices, out_path, options);
 
     std::cout << "Decompression complete!" << std::endl;
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
 }
 
-void Packr::unarchive(std::string& in_path, std::string& out_path) {
+PackrStats Packr::unarchive(std::string& in_path, std::string& out_path, const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
     PackrFile packr_file(in_path, false);
 
-    std::filesystem::create_directories(out_path);
+    const auto& entries = packr_file.get_entries();
+
+    std::cout << "Unarchiving " << entries.size() << " chunks..." << std::endl;
 
-    const auto& chunks = packr_file.get_chunks();
+    // Stored chunks (all of them for archived files) are written directly from the mapping
+    std::vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < indices.size(); i++) indices[i] = i;
+    extract_entries(packr_file, indices, out_path, options);
+
+    std::cout << "Unarchive complete!" << std::endl;
 
-    std::cout << "Unarchiving " << chunks.size() << " files..." << std::endl;
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
+}
 
-    for (const auto& chunk : chunks) {
-        std::string alias(chunk.header.alias);
+std::vector<IndexEntry> Packr::list(std::string& in_path) {
+    // Only the header and the table of contents are read
+    PackrFile packr_file(in_path, false);
+    return packr_file.get_entries();
+}
 
-        std::filesystem::path relative_path(alias);
+PackrStats Packr::extract(std::string& in_path, std::string& out_path, const std::string& pattern,
+                          const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+    PackrFile packr_file(in_path, false);
 
-        // If alias is absolute, strip root to avoid writing outside out_path
-        if (relative_path.is_absolute()) {
-            relative_path = relative_path.lexically_relative(
-                relative_path.root_path());
+    // Pick every chunk whose alias matches, blocks of a file all share its alias
+    const auto& entries = packr_file.get_entries();
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (fnmatch(pattern.c_str(), entries[i].header.alias.c_str(), 0) == 0) {
+            indices.push_back(i);
         }
+    }
 
-        std::filesystem::path output_file =
-            std::filesystem::path(out_path) / relative_path;
+    std::cout << "Extracting " << indices.size() << " chunks matching " << pattern << "..." << std::endl;
 
+    extract_entries(packr_file, indices, out_path, options);
 
-        std::filesystem::create_directories(output_file.parent_path());
+    std::cout << "Extraction complete!" << std::endl;
 
-        // Write data directly (no decompression needed for archived files)
-        std::ofstream out(output_file, std::ios::binary);
-        if (!out.is_open()) {
-            std::cerr << "Failed to create: " << output_file << std::endl;
-            continue;
-        }
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
+}
 
-        out.write(chunk.data.data(), chunk.header.base_size);
-        out.close();
+bool Packr::verify(std::string& in_path, int num_threads, bool full) {
+    num_threads = resolve_threads(num_threads);
+    PackrFile packr_file(in_path, false);
+    const auto& entries = packr_file.get_entries();
+
+    std::cout << "Verifying " << entries.size() << " chunks with " << num_threads << " threads..." << std::endl;
+    auto start = std::chrono::steady_clock::now();
+
+    // References and solid blocks share one payload, only check each payload once
+    std::vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < indices.size(); i++) indices[i] = i;
+    std::vector<std::vector<size_t>> groups = group_by_payload(entries, indices);
+
+    std::atomic<uint64_t> checked_bytes{0};
+    std::atomic<size_t> corrupt{0};
+    std::mutex report_mutex;
+    std::vector<PoolTask> tasks;
+    for (const auto& group : groups) {
+        const DataHeader& header = entries[group.front()].header;
+
+        PoolTask task;
+        task.size = full ? payload_size(header) : header.comp_size;
+        task.fn = [&]() {
+            bool intact = false;
+            try {
+                ChunkView view = packr_file.get_chunk_view(group.front());
+                intact = chunk_intact(view);
+                if (intact && full) {
+                    thread_local Buffer data;
+                    const char* payload = open_payload(view, packr_file.get_dictionary(), data);
+                    for (size_t index : group) {
+                        get_entry_data(entries[index].header, payload);
+                    }
+                }
+                checked_bytes += view.size;
+            }
+            catch (const std::exception&) {
+                intact = false;
+            }
+
+            if (!intact) {
+                corrupt++;
+                std::lock_guard<std::mutex> lock(report_mutex);
+                std::cerr << "Corrupt chunk: " << header.alias << " (block " << header.block_index << ")" << std::endl;
+            }
+        };
+        tasks.push_back(std::move(task));
     }
 
-    std::cout << "Unarchive complete!" << std::endl;
+    std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+    TaskGroup group;
+    pool->submit(group, tasks);
+    group.wait();
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Verification complete! " << corrupt << " corrupt chunks, checked "
+              << checked_bytes / 1e6 << " MB in " << seconds << " s" << std::endl;
+    return corrupt == 0;
 }
 
 
-void Packr::decompress_parallel(std::string& in_path,
-                                std::string& out_path,
-                                int num_threads) {
+PackrStats Packr::decompress_parallel(std::string& in_path,
+                                      std::string& out_path,
+                                      int num_threads,
+                                      const PackrOptions& options) {
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+
     // Open existing .packr file
     PackrFile packr_file(in_path, false);
 
-    // Create output directory if it doesn't exist
-    std::filesystem::create_directories(out_path);
+    // Get the table of contents from the packr file
+    const auto& entries = packr_file.get_entries();
 
-    // Get all chunks from the packr file
-    const auto& chunks = packr_file.get_chunks();
+    int reader_threads = std::max(options.reader_threads, 1);
+    int writer_threads = std::max(options.writer_threads, 1);
+    num_threads = resolve_threads(num_threads);
 
-    std::cout << "Decompressing " << chunks.size() << " files with " 
-              << num_threads << " threads..." << std::endl;
+    std::cout << "Decompressing " << entries.size() << " chunks with " << reader_threads
+              << " readers, " << num_threads << " inflaters and " << writer_threads
+              << " writers..." << std::endl;
 
-    // Create a queue of chunk indices to process
-    std::queue<size_t> work_queue;
-    for (size_t i = 0; i < chunks.size(); i++) {
-        work_queue.push(i);
+    // Create the directories and the split files up front, so no two stage threads ever create the same thing
+    std::vector<size_t> indices(entries.size());
+    for (size_t i = 0; i < entries.size(); i++) indices[i] = i;
+    OutputTree tree(out_path, options.restore_metadata);
+    std::vector<const OutputFile*> output_files;
+    for (const OutputFile* failed : tree.add_files(entries, indices, output_files)) {
+        std::cerr << "Failed to create: " << failed->path << std::endl;
     }
 
-    // Mutex for queue access
-    std::mutex queue_mutex;
+    // Read payloads in file order so the disk sees one sequential pass,
+    // chunks sharing a payload are inflated once and then all written
+    std::vector<std::vector<size_t>> groups = group_by_payload(entries, indices);
 
-    // Worker function
-    auto worker = [&]() {
-        while (true) {
-            size_t chunk_idx;
+    // Item passed from the inflate stage to the write stage
+    struct InflatedChunk {
+        size_t group = 0;
+        Buffer data; // Empty for stored payloads, written from the mapping
+        const char* payload = nullptr; // Inside data, or inside the mapping
+    };
+    DictView dict = packr_file.get_dictionary();
+
+    // Writers hand inflated buffers back to the inflaters through a shared pool,
+    // which holds enough of them for every chunk that can be in flight at once
+    size_t queue_depth = options.queue_depth > 0 ? options.queue_depth : 2 * static_cast<size_t>(num_threads);
+    BufferPool buffers(queue_depth + num_threads + writer_threads);
+    BoundedQueue<size_t> read_queue(queue_depth);
+    BoundedQueue<InflatedChunk> write_queue(queue_depth);
+
+    // Time each stage's threads spend working rather than waiting on a queue
+    std::atomic<uint64_t> read_busy{0};
+    std::atomic<uint64_t> inflate_busy{0};
+    std::atomic<uint64_t> write_busy{0};
+    auto elapsed_ns = [](clock::time_point since) {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - since).count());
+    };
 
-            //Get next chunk index from queue
-            {
-                std::lock_guard<std::mutex> lock(queue_mutex);
-                if (work_queue.empty())
-                    return;
-                chunk_idx = work_queue.front();
-                work_queue.pop();
-            }
-
-            const auto& chunk = chunks[chunk_idx];
-
-            std::string alias(chunk.header.alias);
-            
-            std::filesystem::path original_path(alias);
-            std::string filename = original_path.filename().string();
-
-            // Build output path
-            std::filesystem::path output_file = std::filesystem::path(out_path) / filename;
-
-            // Decompress the data
-            std::vector<char> decompressed;
-            if (chunk.header.base_size != chunk.header.comp_size) {
-                // Data is compressed, decompress it
-                decompressed = decompress_data(
-                    chunk.data.data(),
-                    chunk.header.comp_size,
-                    chunk.header.base_size
-                );
-            } else {
-                // Data is not compressed (from archive())
-                decompressed = chunk.data;
-            }
-
-            // Write to file (file I/O is thread-safe for different files)
-            std::ofstream out(output_file, std::ios::binary);
-            if (!out.is_open()) {
-                std::cerr << "Failed to create: " << output_file << std::endl;
-                continue;
+    // Stage 1: fault chunk data in from disk, the last reader to finish closes the queue
+    std::atomic<int> readers_left{reader_threads};
+    auto reader = [&](int id) {
+        for (size_t g = id; g < groups.size(); g += reader_threads) {
+            auto busy_start = clock::now();
+            packr_file.prefetch_chunk(groups[g].front());
+            read_busy += elapsed_ns(busy_start);
+
+            if (!read_queue.push(g)) break;
+        }
+        if (--readers_left == 0) {
+            read_queue.close();
+        }
+    };
+
+    // Stage 2: inflate straight from the mapping on the shared pool
+    auto inflater = [&]() {
+        try {
+            size_t g;
+            while (read_queue.pop(g)) {
+                auto busy_start = clock::now();
+                ChunkView view = packr_file.get_chunk_view(groups[g].front());
+
+                InflatedChunk item;
+                item.group = g;
+                if (!(view.header->flags & PACKR_FLAG_STORED)) {
+                    item.data = buffers.acquire(static_cast<size_t>(dict.size) + payload_size(*view.header));
+                }
+                item.payload = open_payload(view, dict, item.data);
+                for (size_t index : groups[g]) {
+                    get_entry_data(entries[index].header, item.payload);
+                }
+                inflate_busy += elapsed_ns(busy_start);
+
+                if (!write_queue.push(std::move(item))) break;
             }
+        }
+        catch (...) {
+            // Stop the other stages instead of leaving them blocked on a queue
+            read_queue.close();
+            write_queue.close();
+            throw;
+        }
+    };
 
-            out.write(decompressed.data(), decompressed.size());
-            out.close();
+    // Stage 3: write every chunk to its place in its output file
+    auto writer = [&]() {
+        InflatedChunk item;
+        if (options.io_backend == IO_BACKEND_URING) {
+            AsyncIo& io = AsyncIo::local(options.io_backend, options.io_depth);
+            std::vector<InflatedChunk> batch;
+            std::vector<IoRequest> writes;
+            std::vector<size_t> targets;
+            while (write_queue.pop(item)) {
+                auto busy_start = clock::now();
+
+                // Take whatever else is already waiting, then write all of it in one go
+                batch.clear();
+                batch.push_back(std::move(item));
+                while (batch.size() < options.io_depth && write_queue.try_pop(item)) {
+                    batch.push_back(std::move(item));
+                }
+                writes.clear();
+                targets.clear();
+                uint64_t bytes = 0;
+                for (const InflatedChunk& chunk : batch) {
+                    for (size_t index : groups[chunk.group]) {
+                        const DataHeader& header = entries[index].header;
+                        if (!output_files[index]->created) continue;
+                        bool split = header.block_count > 1;
+                        IoRequest write;
+                        write.path = output_files[index]->path.c_str();
+                        write.open_flags = split ? O_WRONLY : O_WRONLY | O_CREAT | O_TRUNC;
+                        write.write = true;
+                        write.offset = split ? header.file_offset : 0;
+                        write.data = const_cast<char*>(chunk.payload) +
+                            ((header.flags & PACKR_FLAG_SOLID) ? header.solid_offset : 0);
+                        write.size = header.base_size;
+                        writes.push_back(write);
+                        targets.push_back(index);
+                        bytes += header.base_size;
+                    }
+                }
+                {
+                    PACKR_SCOPE(STAGE_WRITE, bytes);
+                    io.run(writes);
+                }
+                for (size_t i = 0; i < writes.size(); i++) {
+                    if (!writes[i].done()) {
+                        std::cerr << "Failed to create: " << output_files[targets[i]]->path << std::endl;
+                    }
+                }
+                for (InflatedChunk& chunk : batch) {
+                    buffers.release(std::move(chunk.data));
+                }
+                write_busy += elapsed_ns(busy_start);
+            }
+            return;
+        }
+        while (write_queue.pop(item)) {
+            auto busy_start = clock::now();
+            const char* payload = item.payload;
+
+            // The inflater already checked every chunk's data
+            for (size_t index : groups[item.group]) {
+                const DataHeader& header = entries[index].header;
+                uint64_t offset = (header.flags & PACKR_FLAG_SOLID) ? header.solid_offset : 0;
+                if (output_files[index]->created && !tree.write(*output_files[index], header, payload + offset, header.base_size)) {
+                    std::cerr << "Failed to create: " << output_files[index]->path << std::endl;
+                }
+            }
+            buffers.release(std::move(item.data));
+            write_busy += elapsed_ns(busy_start);
         }
     };
 
-    // Spawn all threads
-    std::vector<std::thread> threads;
-    for (int i = 0; i < num_threads; i++) {
-        threads.emplace_back(worker);
+    // Start every stage
+    std::vector<std::thread> readers;
+    for (int i = 0; i < reader_threads; i++) {
+        readers.emplace_back(reader, i);
+    }
+    std::vector<std::thread> writers;
+    for (int i = 0; i < writer_threads; i++) {
+        writers.emplace_back(writer);
+    }
+
+    std::vector<PoolTask> tasks(num_threads);
+    for (auto& task : tasks) {
+        task.fn = inflater;
+    }
+    std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+    TaskGroup group;
+    pool->submit(group, tasks);
+
+    // Once every inflater is done the writers only have to drain their queue
+    std::exception_ptr error;
+    try {
+        group.wait();
     }
+    catch (...) {
+        error = std::current_exception();
+    }
+    write_queue.close();
 
-    // Join all threads
-    for (auto& t : threads) {
+    for (auto& t : readers) {
+        t.join();
+    }
+    for (auto& t : writers) {
         t.join();
     }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    tree.finish();
+
+    // Report how busy each stage was, the one closest to 100% is the bottleneck
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    double wall_ns = std::max(stats.seconds * 1e9, 1.0);
+    stats.read_utilization = read_busy / (wall_ns * reader_threads);
+    stats.inflate_utilization = inflate_busy / (wall_ns * num_threads);
+    stats.threads = num_threads;
+    stats.write_utilization = write_busy / (wall_ns * writer_threads);
+    add_stage_stats(trace_start, stats);
+
+    std::cout << "Parallel decompression complete! Stage utilization: read "
+              << static_cast<int>(stats.read_utilization * 100) << "%, inflate "
+              << static_cast<int>(stats.inflate_utilization * 100) << "%, write "
+              << static_cast<int>(stats.write_utilization * 100) << "%" << std::endl;
+
+    return stats;
+}
+
+// Frame types of the streamable format
+enum StreamFrame {
+    STREAM_FRAME_END = 0, // Followed by the number of chunk frames before it
+    STREAM_FRAME_CHUNK, // Followed by an inline header and the chunk's payload
+};
+
+// Write all of size bytes to a file descriptor, which may be a pipe taking them a piece at a time
+void write_all(int fd, const char* data, size_t size) {
+    PACKR_SCOPE(STAGE_WRITE, size);
+    while (size > 0) {
+        ssize_t count = write(fd, data, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) {
+            throw std::runtime_error("PackrFile error: failed to write stream: " + std::string(std::strerror(errno)));
+        }
+        data += count;
+        size -= static_cast<size_t>(count);
+    }
+}
+
+// Implements buffered reads from a file descriptor, such as a pipe handing data over a piece at a time
+class StreamReader {
+    private:
+        int fd;
+        Buffer buffer;
+        size_t pos = 0;
+        size_t end = 0;
+
+        bool fill() {
+            pos = 0;
+            end = 0;
+            while (true) {
+                ssize_t count = ::read(fd, buffer.data(), buffer.size());
+                if (count < 0 && errno == EINTR) continue;
+                if (count < 0) {
+                    throw std::runtime_error("PackrFile error: failed to read stream: " + std::string(std::strerror(errno)));
+                }
+                end = static_cast<size_t>(count);
+                return end > 0;
+            }
+        }
+    public:
+        StreamReader(int fd) : fd(fd) { buffer.prepare(1 << 20); }
+
+        // Read exactly size bytes, false if the stream ended first
+        bool read(char* out, size_t size) {
+            PACKR_SCOPE(STAGE_READ, size);
+            while (size > 0) {
+                if (pos == end && !fill()) return false;
+                size_t count = std::min(size, end - pos);
+                std::memcpy(out, buffer.data() + pos, count);
+                pos += count;
+                out += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        bool read_varint(uint64_t& value) {
+            value = 0;
+            for (int shift = 0; shift < 64; shift += 7) {
+                char byte;
+                if (!read(&byte, 1)) return false;
+                value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) return true;
+            }
+            return false;
+        }
+};
+
+// A packed chunk waiting in the reorder buffer for the chunks before it to be written
+struct StreamSlot {
+    std::string record; // Frame type and inline header, empty if the block couldn't be read
+    Buffer data;
+    bool ready = false;
+    std::exception_ptr error;
+};
+
+PackrStats Packr::compress_stream(std::string& in_path, int out_fd, int num_threads,
+                                  const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+
+    // load directories recursively
+    std::vector<ScannedFile> files;
+    load_files_from_dir(in_path, files);
+    std::vector<BlockTask> blocks;
+    for (const ScannedFile& scanned : files) {
+        split_into_blocks(scanned, options.block_size, blocks, options.stream_window);
+    }
+
+    // Only the version goes in front, the chunk count follows the last chunk
+    char version[16] = {};
+    std::strncpy(version, PACKR_STREAM_VERSION, sizeof(version) - 1);
+    write_all(out_fd, version, sizeof(version));
+
+    // Blocks are compressed in any order by the pool, but at most window of them are
+    // ahead of the one the stream needs next, so memory depends on the window only
+    num_threads = resolve_threads(num_threads);
+    size_t window = options.queue_depth > 0 ? options.queue_depth : 2 * static_cast<size_t>(num_threads);
+    std::vector<StreamSlot> slots(window);
+    std::mutex slot_mutex;
+    std::condition_variable slot_cv;
+    BufferPool buffers(window + num_threads);
+    CompressTotals totals;
+
+    auto pack = [&](size_t seq) {
+        const BlockTask& block = blocks[seq];
+        thread_local std::string record;
+        record.clear();
+        std::exception_ptr error;
+
+        DataChunk chunk{};
+        chunk.data = buffers.acquire(block.size);
+        set_block_header(chunk.header, block);
+        try {
+            if (read_file_range(block.file_path, block.offset, block.size, chunk.data.data())) {
+                {
+                    PACKR_SCOPE(STAGE_HASH, block.size, chunk.header.alias);
+                    chunk.header.content_hash = hash_data(chunk.data.data(), block.size);
+                }
+                compress_with_options(chunk, options, DictView(), totals);
+                {
+                    PACKR_SCOPE(STAGE_HASH, chunk.header.comp_size, chunk.header.alias);
+                    chunk.header.checksum = checksum_data(chunk.data.data(), chunk.header.comp_size);
+                }
+                chunk.data.shrink(chunk.header.comp_size);
+                record.push_back(static_cast<char>(STREAM_FRAME_CHUNK));
+                encode_inline_header(chunk.header, record);
+            }
+            else if (block.block_index > 0) {
+                // The file's first frames may be out already, the stream can't be completed without this one
+                throw std::runtime_error("PackrFile error: failed to read block of streamed file: " +
+                                         std::string(block.file_path));
+            }
+            else {
+                std::cerr << "Failed to read: " << block.file_path << std::endl;
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+
+        StreamSlot& slot = slots[seq % window];
+        {
+            std::lock_guard<std::mutex> lock(slot_mutex);
+            slot.record.swap(record);
+            slot.data = std::move(chunk.data);
+            slot.error = error;
+            slot.ready = true;
+        }
+        slot_cv.notify_one();
+    };
+
+    // The caller writes chunks out in order as soon as each one is ready. A file whose
+    // first block couldn't be read is left out whole, before any of its frames go out
+    uint64_t frames = 0;
+    size_t written = 0;
+    size_t skipped_until = 0;
+    auto write_next = [&]() {
+        StreamSlot& slot = slots[written % window];
+        {
+            std::unique_lock<std::mutex> lock(slot_mutex);
+            slot_cv.wait(lock, [&]() { return slot.ready; });
+            slot.ready = false;
+        }
+        size_t seq = written++;
+        if (seq >= skipped_until) {
+            if (slot.error) {
+                std::rethrow_exception(slot.error);
+            }
+            if (!slot.record.empty()) {
+                write_all(out_fd, slot.record.data(), slot.record.size());
+                write_all(out_fd, slot.data.data(), slot.data.size());
+                frames++;
+            }
+            else {
+                skipped_until = seq + blocks[seq].block_count;
+            }
+        }
+        buffers.release(std::move(slot.data));
+    };
+
+    std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+    TaskGroup group;
+    std::exception_ptr error;
+    try {
+        std::vector<PoolTask> tasks(1);
+        for (size_t seq = 0; seq < blocks.size(); seq++) {
+            if (seq - written == window) {
+                write_next();
+            }
+            tasks.resize(1);
+            tasks[0].fn = [&pack, seq]() { pack(seq); };
+            tasks[0].size = blocks[seq].size;
+            pool->submit(group, tasks);
+        }
+        while (written < blocks.size()) {
+            write_next();
+        }
+
+        std::string end(1, static_cast<char>(STREAM_FRAME_END));
+        put_varint(end, frames);
+        write_all(out_fd, end.data(), end.size());
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // Tasks still running point at this function's state
+    try {
+        group.wait();
+    }
+    catch (...) {
+        if (!error) error = std::current_exception();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    // The stream may be on stdout, so progress goes to stderr
+    std::clog << "Streamed " << frames << " chunks of " << files.size() << " files" << std::endl;
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    stats.stored_chunks = totals.stored_chunks;
+    stats.fast_chunks = totals.fast_chunks;
+    stats.max_chunks = totals.max_chunks;
+    for (int codec = 0; codec < CODEC_COUNT; codec++) {
+        stats.codec_chunks[codec] = totals.codec_chunks[codec];
+    }
+    return stats;
+}
+
+PackrStats Packr::decompress_stream(int in_fd, std::string& out_path, int num_threads,
+                                    const PackrOptions& options) {
+    auto start = std::chrono::steady_clock::now();
+    TraceTotals trace_start = Tracer::snapshot();
+    StreamReader in(in_fd);
+
+    char version[16] = {};
+    if (!in.read(version, sizeof(version)) || std::strncmp(version, PACKR_STREAM_VERSION, sizeof(version)) != 0) {
+        throw std::runtime_error("PackrFile error: not a .packr stream");
+    }
+    OutputTree tree(out_path, options.restore_metadata);
+
+    // Chunks are checked, inflated and written on the pool, while this thread reads the next
+    // ones. At most window of them are in flight, so memory doesn't depend on the stream's size
+    num_threads = resolve_threads(num_threads);
+    size_t window = options.queue_depth > 0 ? options.queue_depth : 2 * static_cast<size_t>(num_threads);
+    BufferPool buffers(window + 1);
+    std::mutex flight_mutex;
+    std::condition_variable flight_cv;
+    size_t in_flight = 0;
+    std::atomic<bool> failed{false};
+
+    std::shared_ptr<ThreadPool> pool = ThreadPool::shared(num_threads);
+    TaskGroup group;
+    std::exception_ptr error;
+    uint64_t frames = 0;
+    try {
+        std::string record;
+        const OutputFile* file = nullptr;
+        std::string file_alias;
+        uint32_t file_blocks = 0; // Blocks the current file was split into
+        uint32_t next_block = 0; // The one that has to come next
+        auto check_complete = [&]() {
+            if (next_block != file_blocks) {
+                throw std::runtime_error("PackrFile error: stream is missing blocks of: " + file_alias);
+            }
+        };
+        while (true) {
+            char type;
+            if (!in.read(&type, 1)) {
+                throw std::runtime_error("PackrFile error: stream ended without its end marker");
+            }
+            if (type == STREAM_FRAME_END) {
+                uint64_t count;
+                if (!in.read_varint(count) || count != frames) {
+                    throw std::runtime_error("PackrFile error: stream chunk count mismatch");
+                }
+                check_complete();
+                break;
+            }
+            if (type != STREAM_FRAME_CHUNK) {
+                throw std::runtime_error("PackrFile error: corrupt frame in stream");
+            }
+
+            // Decode the inline header, streams only hold whole chunks of their own
+            uint64_t record_size;
+            if (!in.read_varint(record_size) || record_size > (1 << 20)) {
+                throw std::runtime_error("PackrFile error: corrupt frame in stream");
+            }
+            record.resize(static_cast<size_t>(record_size));
+            if (!in.read(&record[0], record.size())) {
+                throw std::runtime_error("PackrFile error: stream ended inside a frame");
+            }
+            VarintReader fields{ record.data(), record.data() + record.size() };
+            DataHeader header{};
+            uint64_t alias_size = fields.varint();
+            const char* alias = fields.bytes(static_cast<size_t>(alias_size));
+            if (alias) header.alias.assign(alias, static_cast<size_t>(alias_size));
+            if (!decode_header(fields, 0, header) || fields.pos != fields.end ||
+                (header.flags & (PACKR_FLAG_DEDUP | PACKR_FLAG_SOLID | PACKR_FLAG_DICT)) ||
+                header.comp_size > UINT32_MAX || header.base_size > header.file_size ||
+                header.block_index >= header.block_count ||
+                header.file_offset > header.file_size - header.base_size ||
+                ((header.flags & PACKR_FLAG_STORED) && header.comp_size != header.base_size)) {
+                throw std::runtime_error("PackrFile error: corrupt frame in stream: " + header.alias);
+            }
+
+            Buffer data = buffers.acquire(static_cast<size_t>(header.comp_size) + INPUT_SLACK);
+            data.shrink(static_cast<size_t>(header.comp_size));
+            if (!in.read(data.data(), data.size())) {
+                throw std::runtime_error("PackrFile error: stream ended inside a frame: " + header.alias);
+            }
+            frames++;
+
+            // A file's blocks come in order, so the first one adds the file the others go into
+            if (header.block_index == 0) {
+                check_complete();
+                if (!tree.add_file(header, file)) {
+                    std::cerr << "Failed to create: " << file->path << std::endl;
+                }
+                file_alias = header.alias;
+                file_blocks = header.block_count;
+            }
+            else if (!file || header.alias != file_alias || header.block_index != next_block ||
+                     header.block_count != file_blocks) {
+                throw std::runtime_error("PackrFile error: block out of order in stream: " + header.alias);
+            }
+            next_block = header.block_index + 1;
+
+            // Wait for room, or stop reading once a chunk turned out damaged
+            {
+                std::unique_lock<std::mutex> lock(flight_mutex);
+                flight_cv.wait(lock, [&]() { return in_flight < window || failed; });
+                if (failed) break;
+                in_flight++;
+            }
+
+            std::vector<PoolTask> tasks(1);
+            tasks[0].size = header.base_size;
+            tasks[0].fn = [&, file, header = std::move(header), data = std::make_shared<Buffer>(std::move(data))]() {
+                try {
+                    ChunkView view{ &header, data->data(), data->size() };
+                    const char* payload;
+                    if (header.flags & PACKR_FLAG_STORED) {
+                        if (!chunk_intact(view)) {
+                            throw std::runtime_error("PackrFile error: checksum mismatch in chunk: " + header.alias);
+                        }
+                        payload = data->data();
+                    }
+                    else {
+                        thread_local Buffer inflated;
+                        payload = get_entry_data(header, open_payload(view, DictView(), inflated));
+                    }
+                    if (file->created && !tree.write(*file, header, payload, header.base_size)) {
+                        std::cerr << "Failed to create: " << file->path << std::endl;
+                    }
+                }
+                catch (...) {
+                    failed = true;
+                    std::lock_guard<std::mutex> lock(flight_mutex);
+                    in_flight--;
+                    flight_cv.notify_one();
+                    throw;
+                }
+                buffers.release(std::move(*data));
+                std::lock_guard<std::mutex> lock(flight_mutex);
+                in_flight--;
+                flight_cv.notify_one();
+            };
+            pool->submit(group, tasks);
+        }
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // Chunks still in flight point at this function's state
+    try {
+        group.wait();
+    }
+    catch (...) {
+        if (!error) error = std::current_exception();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    tree.finish();
 
-    std::cout << "Parallel decompression complete!" << std::endl;
+    std::cout << "Stream extraction complete! " << frames << " chunks" << std::endl;
+
+    PackrStats stats;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    add_stage_stats(trace_start, stats);
+    return stats;
+}
+
+void Packr::print_stats(const PackrStats& stats) {
+    std::cout << "Took " << stats.seconds << " s" << std::endl;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        const StageStats& stage = stats.stages[s];
+        if (stage.calls == 0) continue;
+
+        // Stage time is summed over threads, so it can exceed the wall time
+        std::cout << "  " << get_stage_name(static_cast<TraceStage>(s)) << ": " << stage.ns / 1e6 << " ms over "
+                  << stage.calls << " calls, " << stage.bytes_in << " bytes in, " << stage.bytes_out
+                  << " bytes out" << std::endl;
+    }
 }
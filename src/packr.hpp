@@ -1,59 +1,305 @@
 #ifndef PACKR_HPP
     #define PACKR_HPP
     #include <string>
+    #include <vector>
     #include <fstream>
+    #include <cstdint>
+    #include <mutex>
+    #include <condition_variable>
+    #include <unordered_map>
+    #include "trace.hpp"
+    #include "buffer_pool.hpp"
+    #include "async_io.hpp"
+    #include "codec.hpp"
 
-    #define PACKR_VERSION "1.0.0"
+    #define PACKR_VERSION "2.1.0"
+    #define PACKR_COMPACT_VERSION "2.0.0" // Last version without permission bits, still read
+    #define PACKR_FIXED_VERSION "1.9.0" // Last version with fixed-size headers, still read
+    #define PACKR_LEGACY_VERSION "1.0.0" // Original format, inline headers and no table of contents, still read
+    #define PACKR_STREAM_VERSION "2.1.0-stream" // Streamable variant, framed chunks and an end marker instead of an index
+    #define PACKR_DEFAULT_BLOCK_SIZE (1 << 20) // 1 MiB
+    #define PACKR_STREAM_WINDOW (16 << 20) // 16 MiB, files bigger than this are packed in windows in whole-file mode
+
+    // Compression levels
+    #define PACKR_FAST_LEVEL 1
+    #define PACKR_MAX_LEVEL 8
+
+    #define PACKR_AUTO_THREADS 0 // Thread count that means every available core, and auto mode for compress_parallel
+
+    // Chunk flags
+    #define PACKR_FLAG_DEDUP 0x1 // Shares the data of an earlier chunk with the same content
+    #define PACKR_FLAG_STORED 0x2 // Data is kept raw, not compressed
+    #define PACKR_FLAG_SOLID 0x4 // Data is a solid block shared by several small files
+    #define PACKR_FLAG_DICT 0x8 // Data was compressed with the archive's preset dictionary
 
     // Struct for the file header
     struct FileHeader {
         char version[16];
         uint32_t chunk_count;
+        uint32_t block_size; // Size of every block but a file's last (0 = whole files, big ones in stream windows)
+        uint64_t index_offset; // Where the table of contents starts
+        uint64_t dict_offset; // Where the preset dictionary starts
+        uint32_t dict_size; // Size of the preset dictionary (0 = none)
+        uint32_t index_codec; // CodecId the table of contents was compressed with, if it was
+        uint64_t index_size; // Bytes the table of contents takes in the file
+        uint64_t index_raw_size; // Its size once inflated (= index_size when stored raw)
+        uint64_t index_checksum; // Checksum of the table of contents as stored in the file
     };
 
-    // Struct for every data header
+    // Struct for every data header, stored with varint fields and a shared path table
     struct DataHeader {
-        char alias[256];
-        uint32_t base_size;
-        uint32_t comp_size;
+        std::string alias; // Path of the file, of any length
+        uint64_t base_size;
+        uint64_t comp_size;
+        uint64_t file_offset; // Where this chunk's data starts in its file
+        uint64_t file_size; // Size of the whole file
+        uint32_t block_index; // Which block of the file this chunk holds
+        uint32_t block_count; // How many blocks the file was split into
+        uint32_t flags; // PACKR_FLAG_* bits
+        uint32_t codec; // CodecId the data was compressed with
+        uint32_t solid_offset; // Where this file starts inside its inflated solid block
+        uint32_t solid_size; // Inflated size of the whole solid block
+        int64_t mtime; // Source file's modification time (ns since the Unix epoch)
+        uint32_t mode; // Source file's permission bits (0 = not recorded)
+        uint64_t content_hash; // Hash of the chunk's uncompressed data
+        uint64_t checksum; // Checksum of the chunk's data as stored in the file
+    };
+
+    // Struct for every entry in the table of contents at the end of the file
+    struct IndexEntry {
+        DataHeader header;
+        uint64_t offset; // Where the chunk's data starts
     };
 
-    // Struct to store chunks of data
+    // Struct to store chunks of data, move-only so its buffer is never copied
     struct DataChunk {
         DataHeader header;
-        std::vector<char> data;
+        Buffer data;
+    };
+
+    // Struct for what deduplication saved while writing a file
+    struct DedupStats {
+        uint64_t chunks = 0; // Chunks stored as references
+        uint64_t bytes = 0; // Uncompressed bytes that weren't compressed again
+        uint64_t stored_bytes = 0; // Compressed bytes that weren't written again
+    };
+
+    // Non-owning view of a chunk's data inside a memory-mapped .packr file
+    struct ChunkView {
+        const DataHeader* header;
+        const char* data;
+        size_t size;
+    };
+
+    // Non-owning view of an archive's preset dictionary
+    struct DictView {
+        const char* data = nullptr;
+        uint32_t size = 0;
     };
 
-    // Implements an in-memory class for .packr files
+    // Implements a class for mapping .packr files and streaming new ones to disk
     class PackrFile {
         private:
             std::fstream file;
             std::string file_path;
             FileHeader header;
-            std::vector<DataChunk> chunks;
+            std::vector<IndexEntry> entries;
+            std::string dictionary; // Preset dictionary of a new file
+
+            // Read-only mapping of an existing file
+            const char* map_data = nullptr;
+            size_t map_size = 0;
+            size_t map_area_size = 0; // The file's pages and a zeroed one after them
+            void unmap();
+
+            // Streaming writer state
+            std::mutex write_mutex;
+            std::mutex flight_mutex;
+            std::condition_variable flight_cv;
+            size_t in_flight = 0;
+            size_t max_in_flight = 0;
+
+            // Deduplication state, keyed by content hash
+            struct DedupSlot {
+                DataHeader header{}; // Chunk that claimed the content, its own write fills the slot
+                const char* payload = nullptr; // Its stored data, if it is copied without inflating it
+                uint64_t check = 0; // Second, independent hash of the uncompressed data
+                bool checked = false; // Only taken for a copy once another chunk has the same hash
+                bool written = false;
+                IndexEntry entry{}; // First copy, once written
+            };
+            bool dedup = false;
+            std::mutex dedup_mutex;
+            std::unordered_map<uint64_t, DedupSlot> dedup_slots;
+            std::vector<IndexEntry> dedup_entries;
+            DedupStats dedup_stats;
+
+            bool refer_to_claimed(const DataHeader& header, const char* payload, uint64_t check, bool checked);
+            uint64_t stored_check(const DataHeader& header, const char* payload) const;
+
+            // Append one payload, listed in the table of contents once per file it holds
+            void write_payload(const DataHeader& payload_header, const char* data,
+                               const DataHeader* members, size_t member_count);
         public:
-            PackrFile(const std::string& path, bool new_file); // Load an existing .packr file or create a new one
+            PackrFile(const std::string& path, bool new_file); // Open an existing .packr file's index or create a new one
             ~PackrFile();
 
             void add_chunk(DataChunk& chunk); // Uncompressed chunk
-            void add_compressed_chunk(DataChunk& chunk); // Pre-compressed chunk
-            void flush(); // Write all chunks to file
+            void add_compressed_chunk(DataChunk& chunk); // Pre-compressed chunk, appended to the file right away
+            void add_compressed_data(const DataHeader& header, const char* data); // Same, without a DataChunk
+            void add_solid_block(const DataHeader& block_header, const char* data,
+                                 const std::vector<DataHeader>& members); // Several small files sharing one payload
+
+            // Preset dictionary shared by every chunk, written once before any chunk is added
+            void set_dictionary(const DictView& dict);
+            DictView get_dictionary() const;
+
+            // Content deduplication
+            void set_dedup(bool enabled) { dedup = enabled; }
+            bool add_if_duplicate(const DataHeader& header, const char* data); // Store a reference instead if the content is already claimed
+            bool add_copy_if_duplicate(const DataHeader& header, const char* payload); // Same for stored data copied as is, which must match byte for byte
+            const DedupStats& get_dedup_stats() const { return dedup_stats; }
+            void flush(); // Write the table of contents and the final chunk count
+
+            // Back-pressure for workers producing chunks
+            void set_max_in_flight(size_t bytes) { max_in_flight = bytes; } // 0 = no limit
+            void reserve(size_t bytes); // Wait until bytes more can be held in memory
+            bool try_reserve(size_t bytes); // Same, without waiting
+            void release(size_t bytes); // Give bytes back once their chunk is written
+
+            void set_block_size(uint32_t block_size) { header.block_size = block_size; }
+            uint32_t get_block_size() const { return header.block_size; }
+            const std::vector<IndexEntry>& get_entries() const { return entries; }
+            ChunkView get_chunk_view(size_t index) const; // Valid for as long as the PackrFile is
+            size_t prefetch_chunk(size_t index) const; // Fault a chunk's pages in ahead of its use
+
+            // Check an entry's payload and inflate it into out, unless it was stored raw.
+            // Returns where the entry's own base_size bytes start, throws if the chunk is damaged
+            const char* read_entry(size_t index, Buffer& out) const;
+    };
+
+    // Options for the parallel functions, and for extraction
+    struct PackrOptions {
+        uint32_t block_size = PACKR_DEFAULT_BLOCK_SIZE; // Split files into blocks of this size (0 = one chunk per file)
+        uint32_t stream_window = PACKR_STREAM_WINDOW; // Without blocks, files bigger than this still go in windows of it
+        size_t max_in_flight = 0; // Limit on bytes read but not yet written (0 = 2 blocks or windows per thread)
+        bool dedup = true; // Store identical blocks only once
+
+        // Solid mode: files up to solid_file_size are packed, sorted by extension and directory,
+        // into shared blocks of about solid_block_size that are compressed together
+        bool solid = false;
+        uint32_t solid_file_size = 64 * 1024;
+        uint32_t solid_block_size = PACKR_DEFAULT_BLOCK_SIZE;
+
+        // Preset dictionary: trained on a sample of the input and used to prime every chunk,
+        // which keeps chunks independent while small files still compress against common content
+        bool dictionary = false;
+        uint32_t dictionary_size = 16 * 1024; // Up to the 32 KiB Deflate window
+
+        // Codec for every chunk, or CODEC_AUTO to pick one per chunk: LZ unless a sample
+        // compresses more than codec_max_growth bigger with it than with Deflate
+        CodecId codec = CODEC_DEFLATE;
+        double codec_max_growth = 0.25;
+
+        // Compression level, or adaptive per-block choice between storing raw, PACKR_FAST_LEVEL and PACKR_MAX_LEVEL
+        int level = PACKR_MAX_LEVEL;
+        bool adaptive = false;
+        double min_saving = 0.05; // Store blocks raw when a trial saves less than this fraction
+        double target_ratio = 0; // Use the fast level when it reaches this compressed/original ratio (0 = off)
+        double min_throughput = 0; // Use the fast level when the max level compresses slower, in MB/s (0 = off)
+
+        // Auto mode for compress_parallel, on with PACKR_AUTO_THREADS or a budget: threads and level are tuned
+        // while the job runs, starting from level, to finish within target_seconds or to keep at least
+        // target_speed of input MB/s, whichever needs more. Without a budget only the threads are tuned
+        double target_seconds = 0; // (0 = off)
+        double target_speed = 0; // (0 = off)
+
+        // File I/O for packing and extraction. The io_uring backend batches the open, read or write
+        // and close of many files into a few syscalls, and falls back to pread where it isn't available
+        IoBackend io_backend = IO_BACKEND_PREAD;
+        unsigned io_depth = 64; // I/O operations the io_uring backend keeps in flight
+
+        // Extraction: give every file the mtime and permission bits it was packed with
+        bool restore_metadata = false;
+
+        // Pipelined extraction
+        int reader_threads = 1;
+        int writer_threads = 1;
+        size_t queue_depth = 0; // Chunks each queue between stages can hold (0 = 2 per thread)
+    };
 
-            const std::vector<DataChunk>& get_chunks() const { return chunks; }
+    // Struct for what an operation measured
+    struct PackrStats {
+        double seconds = 0;
+
+        // Deduplication
+        uint64_t dedup_chunks = 0;
+        uint64_t dedup_bytes = 0; // Input bytes that weren't compressed again
+        uint64_t dedup_stored_bytes = 0; // Output bytes that weren't written again
+        double dedup_seconds = 0; // Estimated compression time avoided
+
+        // Adaptive compression, how many chunks got each treatment
+        uint64_t stored_chunks = 0;
+        uint64_t fast_chunks = 0;
+        uint64_t max_chunks = 0;
+
+        // Threads and level the operation ended with, as auto mode left them
+        int threads = 0;
+        int level = 0;
+
+        // Chunks compressed with each codec
+        uint64_t codec_chunks[CODEC_COUNT] = {};
+
+        // Pipelined extraction: fraction of the run each stage's threads were busy
+        double read_utilization = 0;
+        double inflate_utilization = 0;
+        double write_utilization = 0;
+
+        // Time, calls and bytes of every instrumented stage, summed over threads (zero unless built with PACKR_TRACE)
+        StageStats stages[STAGE_COUNT];
     };
 
     // Implements Packr's functions
     class Packr {
         public:
             // Single thread
-            static void archive(std::string& in_path, std::string& out_path); // Simply bundle files, don't decompress
-            static void unarchive(std::string& in_path, std::string& out_path);
+            static PackrStats archive(std::string& in_path, std::string& out_path); // Simply bundle files, don't decompress
+            static PackrStats unarchive(std::string& in_path, std::string& out_path,
+                                        const PackrOptions& options = PackrOptions());
 
-            static void compress(std::string& in_path, std::string& out_path);
-            static void decompress(std::string& in_path, std::string& out_path);
+            static PackrStats compress(std::string& in_path, std::string& out_path);
+            static PackrStats decompress(std::string& in_path, std::string& out_path,
+                                         const PackrOptions& options = PackrOptions());
+
+            // Bring an existing archive up to date with a directory, only new or changed files are recompressed
+            static PackrStats update(std::string& archive_path, std::string& in_path, int num_threads = 1,
+                                     const PackrOptions& options = PackrOptions());
+
+            // Random access through the table of contents
+            static std::vector<IndexEntry> list(std::string& in_path);
+            static PackrStats extract(std::string& in_path, std::string& out_path, const std::string& pattern, // Glob on aliases
+                                      const PackrOptions& options = PackrOptions());
+
+            // Check every chunk's stored data against its checksum without writing anything,
+            // full also inflates each chunk and checks its content hash
+            static bool verify(std::string& in_path, int num_threads = 1, bool full = false);
 
             // Multiple threads
-            static void compress_parallel(std::string& in_path, std::string& out_path, int num_threads);
-            static void decompress_parallel(std::string& in_path, std::string& out_path, int num_threads);
+            static PackrStats compress_parallel(std::string& in_path, std::string& out_path, int num_threads,
+                                                const PackrOptions& options = PackrOptions());
+            static PackrStats decompress_parallel(std::string& in_path, std::string& out_path, int num_threads,
+                                                  const PackrOptions& options = PackrOptions());
+
+            // Pipe mode: pack to and extract from a file descriptor that can't seek, like stdout/stdin or a socket.
+            // Every chunk goes out in a frame of its own with its inline header, blocks are compressed out of order
+            // on the pool and put back in order through a reorder buffer of queue_depth chunks. Chunks aren't
+            // deduplicated, solid or primed with a dictionary in this mode, the rest of the options apply
+            static PackrStats compress_stream(std::string& in_path, int out_fd, int num_threads,
+                                              const PackrOptions& options = PackrOptions());
+            static PackrStats decompress_stream(int in_fd, std::string& out_path, int num_threads,
+                                                const PackrOptions& options = PackrOptions());
+
+            // Print where an operation's time went, stage by stage
+            static void print_stats(const PackrStats& stats);
     };
 #endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+#include "reader.hpp"
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+
+size_t PackrStream::read(char* out, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        // Move on to the next chunk of the file once this one is used up
+        if (available == 0) {
+            if (cached || next_chunk >= chunks->size()) break;
+            size_t index = (*chunks)[next_chunk++];
+            data = reader->file.read_entry(index, inflated);
+            available = reader->file.get_entries()[index].header.base_size;
+            continue;
+        }
+
+        size_t count = std::min(available, size - done);
+        std::memcpy(out + done, data, count);
+        data += count;
+        available -= count;
+        done += count;
+    }
+    position += done;
+    return done;
+}
+
+PackrReader::PackrReader(const std::string& path, size_t cache_bytes, int prefetch_threads)
+    : file(path, false), cache_capacity(cache_bytes), pool(ThreadPool::shared(std::max(prefetch_threads, 1))) {
+    // Group the entries by file, blocks and stream windows in the order they go in
+    const auto& entries = file.get_entries();
+    for (size_t i = 0; i < entries.size(); i++) {
+        files[entries[i].header.alias].push_back(i);
+    }
+    for (auto& item : files) {
+        std::sort(item.second.begin(), item.second.end(), [&](size_t a, size_t b) {
+            return entries[a].header.block_index < entries[b].header.block_index;
+        });
+    }
+}
+
+PackrReader::~PackrReader() {
+    try {
+        prefetch_group.wait();
+    }
+    catch (const std::exception&) {
+        // Nobody is left to hear about a failed prefetch
+    }
+}
+
+const std::vector<size_t>& PackrReader::find_file(const std::string& path) const {
+    auto found = files.find(path);
+    if (found == files.end()) {
+        throw std::runtime_error("PackrFile error: no such file in archive: " + path);
+    }
+    return found->second;
+}
+
+bool PackrReader::contains(const std::string& path) const {
+    return files.count(path) > 0;
+}
+
+uint64_t PackrReader::file_size(const std::string& path) const {
+    uint64_t size = 0;
+    for (size_t index : find_file(path)) {
+        size += file.get_entries()[index].header.base_size;
+    }
+    return size;
+}
+
+std::vector<std::string> PackrReader::list() const {
+    std::vector<std::string> paths;
+    paths.reserve(files.size());
+    for (const auto& item : files) {
+        paths.push_back(item.first);
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+// Inflate every chunk of a file, one after the other into a single buffer
+AssetData PackrReader::load(const std::vector<size_t>& chunks) const {
+    const auto& entries = file.get_entries();
+    uint64_t size = 0;
+    for (size_t index : chunks) {
+        size += entries[index].header.base_size;
+    }
+
+    auto data = std::make_shared<Buffer>();
+    data->prepare(static_cast<size_t>(size));
+    thread_local Buffer inflated;
+    uint64_t offset = 0;
+    for (size_t index : chunks) {
+        const DataHeader& header = entries[index].header;
+        const char* chunk = file.read_entry(index, inflated);
+        std::memcpy(data->data() + offset, chunk, header.base_size);
+        offset += header.base_size;
+    }
+    return data;
+}
+
+// Cache a loaded file, evicting the least recently used ones to make room for it
+void PackrReader::insert(const std::string& path, const AssetData& data) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    loading.erase(path);
+    if (data->size() > cache_capacity || cache.count(path)) {
+        return;
+    }
+
+    while (!order.empty() && stats.cached_bytes + data->size() > cache_capacity) {
+        auto oldest = cache.find(order.back());
+        stats.cached_bytes -= oldest->second.data->size();
+        stats.evictions++;
+        cache.erase(oldest);
+        order.pop_back();
+    }
+    order.push_front(path);
+    cache[path] = CacheSlot{ data, order.begin() };
+    stats.cached_bytes += data->size();
+}
+
+AssetData PackrReader::read(const std::string& path) {
+    const std::vector<size_t>& chunks = find_file(path);
+
+    // A cached file is handed out as is, one that is still loading is waited for
+    std::promise<AssetData> promise;
+    std::shared_future<AssetData> pending;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto found = cache.find(path);
+        if (found != cache.end()) {
+            stats.hits++;
+            order.splice(order.begin(), order, found->second.order);
+            return found->second.data;
+        }
+
+        auto waiting = loading.find(path);
+        if (waiting != loading.end()) {
+            stats.hits++;
+            pending = waiting->second;
+        }
+        else {
+            stats.misses++;
+            loading.emplace(path, promise.get_future().share());
+        }
+    }
+    if (pending.valid()) {
+        return pending.get();
+    }
+
+    // Otherwise this call loads it, and whoever asked meanwhile gets the same data
+    try {
+        AssetData data = load(chunks);
+        insert(path, data);
+        promise.set_value(data);
+        return data;
+    }
+    catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(cache_mutex);
+            loading.erase(path);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+}
+
+PackrStream PackrReader::open(const std::string& path) {
+    PackrStream stream;
+    stream.reader = this;
+    stream.chunks = &find_file(path);
+    stream.file_size = file_size(path);
+
+    // Stream a cached copy when there is one, without inflating anything
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto found = cache.find(path);
+    if (found != cache.end()) {
+        stats.hits++;
+        order.splice(order.begin(), order, found->second.order);
+        stream.cached = found->second.data;
+        stream.data = stream.cached->data();
+        stream.available = stream.cached->size();
+    }
+    return stream;
+}
+
+void PackrReader::prefetch(const std::vector<std::string>& paths) {
+    std::vector<PoolTask> tasks;
+    for (const std::string& path : paths) {
+        find_file(path);
+
+        PoolTask task;
+        task.size = file_size(path);
+        task.fn = [this, path]() { read(path); };
+        tasks.push_back(std::move(task));
+    }
+    pool->submit(prefetch_group, tasks);
+}
+
+void PackrReader::wait_prefetch() {
+    prefetch_group.wait();
+}
+
+ReaderStats PackrReader::get_stats() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    return stats;
+}
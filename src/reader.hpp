@@ -0,0 +1,96 @@
+#ifndef READER_HPP
+    #define READER_HPP
+    #include <string>
+    #include <vector>
+    #include <list>
+    #include <memory>
+    #include <future>
+    #include <mutex>
+    #include <unordered_map>
+    #include "packr.hpp"
+    #include "thread_pool.hpp"
+
+    // A file's decompressed data, shared with the cache so eviction never frees it under a caller
+    using AssetData = std::shared_ptr<const Buffer>;
+
+    // Struct for what a reader's cache did
+    struct ReaderStats {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        uint64_t cached_bytes = 0;
+    };
+
+    class PackrReader;
+
+    // Implements a sequential stream over one file of an archive. It inflates one chunk at a
+    // time, so even files far bigger than the cache are read in constant memory
+    class PackrStream {
+        private:
+            const PackrReader* reader = nullptr;
+            const std::vector<size_t>* chunks = nullptr; // Entries of the file, in block order
+            AssetData cached; // Whole file, when the cache already held it
+            size_t next_chunk = 0;
+            Buffer inflated;
+            const char* data = nullptr; // Unread part of the current chunk
+            size_t available = 0;
+            uint64_t file_size = 0;
+            uint64_t position = 0;
+
+            friend class PackrReader;
+        public:
+            uint64_t size() const { return file_size; }
+            uint64_t tell() const { return position; }
+            size_t read(char* out, size_t size); // Bytes read, 0 once the file is done
+    };
+
+    // Implements in-process access to the files of a .packr archive: look one up by the path
+    // it was packed with and get its bytes, or a stream over them. Decompressed files are kept
+    // in a thread-safe LRU cache of up to cache_bytes, and prefetch() inflates a list of files
+    // on the shared thread pool so loading them overlaps with whatever the caller does meanwhile
+    class PackrReader {
+        private:
+            PackrFile file;
+            std::unordered_map<std::string, std::vector<size_t>> files; // Entries of every file, in block order
+
+            // LRU cache, most recently used first
+            struct CacheSlot {
+                AssetData data;
+                std::list<std::string>::iterator order;
+            };
+            std::mutex cache_mutex;
+            std::list<std::string> order;
+            std::unordered_map<std::string, CacheSlot> cache;
+            size_t cache_capacity;
+            ReaderStats stats;
+
+            // Files being inflated right now, later requests for one wait for the first
+            std::unordered_map<std::string, std::shared_future<AssetData>> loading;
+
+            // Prefetches still running
+            std::shared_ptr<ThreadPool> pool;
+            TaskGroup prefetch_group;
+
+            const std::vector<size_t>& find_file(const std::string& path) const;
+            AssetData load(const std::vector<size_t>& chunks) const;
+            void insert(const std::string& path, const AssetData& data);
+
+            friend class PackrStream;
+        public:
+            PackrReader(const std::string& path, size_t cache_bytes = 64 << 20, int prefetch_threads = 2);
+            ~PackrReader(); // Waits for prefetches still running
+
+            bool contains(const std::string& path) const;
+            uint64_t file_size(const std::string& path) const;
+            std::vector<std::string> list() const; // Every file's path, as packed
+
+            AssetData read(const std::string& path); // Throws if the file isn't in the archive or is damaged
+            PackrStream open(const std::string& path);
+
+            // Inflate files into the cache in the background, read() of one still loading waits for it
+            void prefetch(const std::vector<std::string>& paths);
+            void wait_prefetch(); // Rethrows the first error a prefetch hit
+
+            ReaderStats get_stats();
+    };
+#endif
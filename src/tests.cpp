@@ -1,64 +1,852 @@
 #include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <functional>
+#include <iterator>
+#include <cstring>
+#include <cstddef>
+#include <thread>
 #include <chrono>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include "packr.hpp"
+#include "hash.hpp"
+#include "reader.hpp"
+#include "output_tree.hpp"
 
-auto time_run = [](auto&& fn, const std::string& label) {
-    auto start = std::chrono::high_resolution_clock::now();
-    fn();
-    auto end = std::chrono::high_resolution_clock::now();
+namespace fs = std::filesystem;
 
-    double seconds =
-        std::chrono::duration<double>(end - start).count();
+// Checks that failed so far, main() returns nonzero if there are any
+int failures = 0;
 
-    std::cout << label << ": " << seconds << " s\n";
-};
+void check(bool passed, const std::string& what) {
+    if (passed) {
+        std::cout << "Passed: " << what << std::endl;
+    }
+    else {
+        std::cerr << "FAILED: " << what << std::endl;
+        failures++;
+    }
+}
 
-int main() {
-    std::string in_path = "test_data";
+std::string read_bytes(const fs::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+// Check that actual holds the same files as expected, byte for byte, and nothing else
+bool same_tree(const std::string& expected, const std::string& actual) {
+    if (!fs::is_directory(expected) || !fs::is_directory(actual)) return false;
+    size_t expected_files = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(expected)) {
+        if (!entry.is_regular_file()) continue;
+        expected_files++;
+        fs::path other = fs::path(actual) / fs::relative(entry.path(), expected);
+        if (!fs::is_regular_file(other) || read_bytes(entry.path()) != read_bytes(other)) return false;
+    }
+    size_t actual_files = 0;
+    for (const auto& entry : fs::recursive_directory_iterator(actual)) {
+        if (entry.is_regular_file()) actual_files++;
+    }
+    return expected_files == actual_files;
+}
 
+// Write count bytes that don't compress
+void write_noise(const std::string& path, uint32_t seed, int count) {
+    std::ofstream noise(path, std::ios::binary);
+    uint32_t state = seed;
+    for (int i = 0; i < count; i++) {
+        state = state * 1664525u + 1013904223u;
+        noise.put(static_cast<char>(state >> 24));
+    }
+}
+
+// Integrity test and space usage test
+void test_integrity(std::string& in_path) {
     std::string out_arc_path = "test/archive.packr";
     std::string out_comp_path = "test/compressed.packr";
     std::string out_unarch_path = "test/unarchived";
     std::string out_decomp_path = "test/decompressed";
-
-    // Integrity test and space usage test
     Packr::archive(in_path, out_arc_path);
     Packr::compress(in_path, out_comp_path);
     Packr::unarchive(out_arc_path, out_unarch_path);
     Packr::decompress(out_comp_path, out_decomp_path);
+    check(same_tree(in_path, out_unarch_path + "/" + in_path), "archive round trip");
+    check(same_tree(in_path, out_decomp_path + "/" + in_path), "compress round trip");
+    check(fs::file_size(out_comp_path) < fs::file_size(out_arc_path), "compressed archive is smaller");
+}
 
-    // Time test
-    std::string seq_path = "test/out_seq.packr";
-    std::string p5_path = "test/out_p5.packr";
-    std::string p10_path = "test/out_p10.packr";
+// Block mode test: split every file into 256 KiB blocks, with at most 2 in memory
+void test_blocks(std::string& in_path, std::string& block_arc_path) {
+    std::string out_unblock_path = "test/unblocked";
+    PackrOptions block_options;
+    block_options.block_size = 256 * 1024;
+    block_options.max_in_flight = 512 * 1024;
+    Tracer::set_recording(true);
+    PackrStats block_stats = Packr::compress_parallel(in_path, block_arc_path, 4, block_options);
+    Tracer::set_recording(false);
+    Packr::print_stats(block_stats);
+    Tracer::write_chrome_trace("test/trace.json");
+    Packr::decompress(block_arc_path, out_unblock_path);
+    check(same_tree(in_path, out_unblock_path + "/" + in_path), "block mode round trip");
+}
+
+// Random access test: list the archive and extract one folder from it
+void test_extract(std::string& in_path, std::string& block_arc_path) {
+    std::string out_comp_path = "test/compressed.packr";
+    std::string out_extract_path = "test/extracted";
+    size_t listed = Packr::list(out_comp_path).size();
+    std::cout << "Listed " << listed << " chunks" << std::endl;
+    check(listed > 0, "list finds the chunks");
+    Packr::extract(block_arc_path, out_extract_path, "test_data/more_files/*");
+    check(same_tree(in_path + "/more_files", out_extract_path + "/" + in_path + "/more_files") &&
+          !fs::exists(out_extract_path + "/" + in_path + "/file_1.txt"), "extract only writes matching files");
+}
+
+// Verify test: an intact archive passes, a damaged copy is caught
+void test_verify(std::string& block_arc_path) {
+    std::string out_comp_path = "test/compressed.packr";
+    std::string corrupt_path = "test/corrupt.packr";
+    bool intact = Packr::verify(block_arc_path, 4, true);
+    fs::copy_file(out_comp_path, corrupt_path);
+    uint64_t first_chunk = Packr::list(out_comp_path).front().offset;
+    {
+        std::fstream corrupt(corrupt_path, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekp(first_chunk + 4);
+        corrupt.put('\x5a');
+    }
+    bool caught = !Packr::verify(corrupt_path, 4);
+    check(intact, "verify passes an intact archive");
+    check(caught, "verify catches a damaged archive");
+}
+
+// Write failure test: once the archive can't grow, packing must fail instead of waiting on memory that failed blocks hold
+void test_write_failure() {
+    std::string full_src_path = "test/full_src";
+    std::string full_arc_path = "test/full.packr";
+    std::string full_update_path = "test/full_update.packr";
+    fs::create_directories(full_src_path);
+    for (int i = 0; i < 20; i++) {
+        write_noise(full_src_path + "/noise_" + std::to_string(i) + ".bin", i + 1, 200 * 1024);
+    }
+    Packr::compress_parallel(full_src_path, full_update_path, 1);
+    std::ofstream(full_src_path + "/noise_0.bin", std::ios::app) << "Changed!";
+    bool write_failed = false;
+    bool update_failed = false;
+    {
+        signal(SIGXFSZ, SIG_IGN);
+        rlimit file_limit;
+        getrlimit(RLIMIT_FSIZE, &file_limit);
+        rlimit small_limit = file_limit;
+        small_limit.rlim_cur = 300 * 1024;
+        setrlimit(RLIMIT_FSIZE, &small_limit);
+        try {
+            Packr::compress_parallel(full_src_path, full_arc_path, 1);
+        }
+        catch (const std::exception& e) {
+            write_failed = true;
+            std::cout << "Caught: " << e.what() << std::endl;
+        }
+
+        // A failed update leaves the archive as it was and no temporary file behind
+        try {
+            Packr::update(full_update_path, full_src_path, 1);
+        }
+        catch (const std::exception& e) {
+            update_failed = !fs::exists(full_update_path + ".tmp");
+            std::cout << "Caught: " << e.what() << std::endl;
+        }
+        setrlimit(RLIMIT_FSIZE, &file_limit);
+        signal(SIGXFSZ, SIG_DFL);
+    }
+    fs::remove_all(full_src_path);
+    check(write_failed, "packing fails when the archive can't be written");
+    check(update_failed && Packr::verify(full_update_path, 1, true), "a failed update keeps the old archive");
+}
+
+// Update test: change, add and delete files, then bring the archive up to date
+void test_update(std::string& in_path) {
+    std::string update_src_path = "test/update_src";
+    std::string update_arc_path = "test/update.packr";
+    std::string update_out_path = "test/updated";
+    PackrOptions block_options;
+    block_options.block_size = 256 * 1024;
+    block_options.max_in_flight = 512 * 1024;
+    fs::copy(in_path, update_src_path, fs::copy_options::recursive);
+    Packr::compress_parallel(update_src_path, update_arc_path, 4, block_options);
+    std::ofstream(update_src_path + "/file_1.txt", std::ios::app) << "Changed!";
+    std::ofstream(update_src_path + "/new_file.txt") << "New!";
+    fs::remove(update_src_path + "/file_2.txt");
+    Packr::update(update_arc_path, update_src_path, 4);
+    Packr::decompress(update_arc_path, update_out_path);
+    check(same_tree(update_src_path, update_out_path + "/" + update_src_path), "update round trip");
+
+    // An archive packed without deduplication stays that way through an update
+    std::string nodedup_src_path = "test/nodedup_src";
+    std::string nodedup_arc_path = "test/nodedup.packr";
+    fs::copy(in_path + "/more_files", nodedup_src_path, fs::copy_options::recursive);
+    std::ofstream(nodedup_src_path + "/note.txt") << "Twice!";
+    PackrOptions nodedup_options;
+    nodedup_options.dedup = false;
+    Packr::compress_parallel(nodedup_src_path, nodedup_arc_path, 4, nodedup_options);
+    std::ofstream(nodedup_src_path + "/copy_of_note.txt") << "Twice!";
+    Packr::update(nodedup_arc_path, nodedup_src_path, 4, nodedup_options);
+    fs::remove_all(nodedup_src_path);
+    size_t nodedup_refs = 0;
+    for (const IndexEntry& entry : Packr::list(nodedup_arc_path)) {
+        if (entry.header.flags & PACKR_FLAG_DEDUP) nodedup_refs++;
+    }
+    check(nodedup_refs == 0, "update keeps deduplication off");
+}
+
+// Adaptive test: incompressible data next to repetitive data
+void test_adaptive(std::string& in_path) {
+    std::string adaptive_src_path = "test/adaptive_src";
+    std::string adaptive_arc_path = "test/adaptive.packr";
+    std::string adaptive_out_path = "test/adaptive_out";
+    fs::copy(in_path + "/more_files", adaptive_src_path, fs::copy_options::recursive);
+    write_noise(adaptive_src_path + "/noise.bin", 377, 512 * 1024);
+    PackrOptions adaptive_options;
+    adaptive_options.adaptive = true;
+    adaptive_options.min_throughput = 50;
+    PackrStats adaptive_stats = Packr::compress_parallel(adaptive_src_path, adaptive_arc_path, 4, adaptive_options);
+    Packr::decompress_parallel(adaptive_arc_path, adaptive_out_path, 4);
+    check(adaptive_stats.stored_chunks > 0, "adaptive mode stores incompressible data");
+    check(same_tree(adaptive_src_path, adaptive_out_path + "/" + adaptive_src_path), "adaptive round trip");
+}
+
+// Solid test: many small files, some of them duplicates, next to bigger ones
+void test_solid(std::string& in_path, std::string& solid_src_path, std::string& solid_arc_path) {
+    std::string solid_out_path = "test/solid_out";
+    std::string solid_seq_path = "test/solid_seq";
+    fs::copy(in_path + "/more_files", solid_src_path, fs::copy_options::recursive);
+    for (int i = 0; i < 300; i++) {
+        std::string dir = solid_src_path + "/small_" + std::to_string(i % 7);
+        fs::create_directories(dir);
+        std::ofstream small(dir + "/note_" + std::to_string(i) + (i % 3 ? ".txt" : ".cfg"));
+        for (int line = 0; line < i % 40; line++) {
+            small << "entry " << line << " of file " << (i % 50) << "\n";
+        }
+    }
+    PackrOptions solid_options;
+    solid_options.solid = true;
+    solid_options.solid_block_size = 16 * 1024;
+    Packr::compress_parallel(solid_src_path, solid_arc_path, 4, solid_options);
+    Packr::decompress_parallel(solid_arc_path, solid_out_path, 4);
+    Packr::decompress(solid_arc_path, solid_seq_path);
+    check(Packr::verify(solid_arc_path, 4, true), "solid archive verifies");
+    check(same_tree(solid_src_path, solid_out_path + "/" + solid_src_path), "solid parallel round trip");
+    check(same_tree(solid_src_path, solid_seq_path + "/" + solid_src_path), "solid sequential round trip");
+}
+
+// Dictionary test: the same small files, each compressed on its own against a trained dictionary
+void test_dictionary(std::string& solid_src_path) {
+    std::string dict_arc_path = "test/dict.packr";
+    std::string plain_arc_path = "test/plain.packr";
+    std::string dict_out_path = "test/dict_out";
+    PackrOptions dict_options;
+    dict_options.dictionary = true;
+    Packr::compress_parallel(solid_src_path, dict_arc_path, 4, dict_options);
+    Packr::compress_parallel(solid_src_path, plain_arc_path, 4);
+    Packr::decompress_parallel(dict_arc_path, dict_out_path, 4);
+    std::cout << "Dictionary archive: " << fs::file_size(dict_arc_path) << " bytes against "
+              << fs::file_size(plain_arc_path) << " without" << std::endl;
+    check(Packr::verify(dict_arc_path, 4, true), "dictionary archive verifies");
+    check(same_tree(solid_src_path, dict_out_path + "/" + solid_src_path), "dictionary round trip");
+}
+
+// io_uring test: read and write the small files in batches, solid blocks and all
+void test_uring(std::string& in_path, std::string& solid_src_path) {
+    std::string uring_arc_path = "test/uring.packr";
+    std::string uring_out_path = "test/uring_out";
+    std::string uring_solid_arc_path = "test/uring_solid.packr";
+    std::string uring_solid_out_path = "test/uring_solid_out";
+    PackrOptions uring_options;
+    uring_options.io_backend = IO_BACKEND_URING;
+    uring_options.io_depth = 16;
+    uring_options.block_size = 256 * 1024;
+    std::cout << "io_uring available: " << AsyncIo(IO_BACKEND_URING).uses_uring() << std::endl;
+    Packr::compress_parallel(solid_src_path, uring_arc_path, 4, uring_options);
+    uring_options.solid = true;
+    uring_options.solid_block_size = 16 * 1024;
+    Packr::compress_parallel(in_path, uring_solid_arc_path, 4, uring_options);
+    Packr::decompress_parallel(uring_arc_path, uring_out_path, 4, uring_options);
+    Packr::decompress_parallel(uring_solid_arc_path, uring_solid_out_path, 4, uring_options);
+    check(same_tree(solid_src_path, uring_out_path + "/" + solid_src_path), "io_uring round trip");
+    check(same_tree(in_path, uring_solid_out_path + "/" + in_path), "io_uring solid round trip");
+
+    // On one thread, solid blocks bigger than the blocks the reader queued ahead of them must not wait on them
+    std::string uring_one_src_path = "test/uring_one_src";
+    std::string uring_one_arc_path = "test/uring_one.packr";
+    std::string uring_one_out_path = "test/uring_one_out";
+    fs::create_directories(uring_one_src_path + "/small");
+    for (int i = 0; i < 40; i++) {
+        std::ofstream(uring_one_src_path + "/big_" + std::to_string(i) + ".bin") << std::string(100 * 1024, 'a' + i % 26);
+    }
+    for (int i = 0; i < 400; i++) {
+        std::ofstream(uring_one_src_path + "/small/note_" + std::to_string(i) + ".txt") << std::string(500, 'a' + i % 26);
+    }
+    uring_options.block_size = PACKR_DEFAULT_BLOCK_SIZE;
+    uring_options.solid_block_size = 256 * 1024;
+    Packr::compress_parallel(uring_one_src_path, uring_one_arc_path, 1, uring_options);
+    Packr::decompress_parallel(uring_one_arc_path, uring_one_out_path, 1);
+    check(same_tree(uring_one_src_path, uring_one_out_path + "/" + uring_one_src_path), "io_uring solid round trip on one thread");
+}
+
+// Codec test: a whole archive in LZ, one with the codec picked per chunk, and
+// one mixing both after an update recompresses a changed file with Deflate
+void test_codecs(std::string& in_path, std::string& solid_src_path) {
+    std::string lz_arc_path = "test/lz.packr";
+    std::string lz_out_path = "test/lz_out";
+    std::string auto_arc_path = "test/auto.packr";
+    std::string auto_out_path = "test/auto_out";
+    std::string mixed_src_path = "test/mixed_src";
+    std::string mixed_arc_path = "test/mixed.packr";
+    std::string mixed_out_path = "test/mixed_out";
+    PackrOptions lz_options;
+    lz_options.codec = CODEC_LZ;
+    lz_options.block_size = 256 * 1024;
+    Packr::compress_parallel(in_path, lz_arc_path, 4, lz_options);
+    Packr::decompress_parallel(lz_arc_path, lz_out_path, 4);
+    check(same_tree(in_path, lz_out_path + "/" + in_path), "LZ round trip");
+
+    std::string lz_solid_arc_path = "test/lz_solid.packr";
+    std::string lz_solid_out_path = "test/lz_solid_out";
+    PackrOptions lz_solid_options = lz_options;
+    lz_solid_options.solid = true;
+    lz_solid_options.dictionary = true;
+    Packr::compress_parallel(solid_src_path, lz_solid_arc_path, 4, lz_solid_options);
+    Packr::decompress_parallel(lz_solid_arc_path, lz_solid_out_path, 4);
+    check(same_tree(solid_src_path, lz_solid_out_path + "/" + solid_src_path), "LZ solid round trip with a dictionary");
+
+    PackrOptions auto_options;
+    auto_options.codec = CODEC_AUTO;
+    Packr::compress_parallel(in_path, auto_arc_path, 4, auto_options);
+    Packr::decompress_parallel(auto_arc_path, auto_out_path, 4);
+    check(same_tree(in_path, auto_out_path + "/" + in_path), "auto codec round trip");
+
+    fs::copy(in_path, mixed_src_path, fs::copy_options::recursive);
+    Packr::compress_parallel(mixed_src_path, mixed_arc_path, 4, lz_options);
+    std::ofstream(mixed_src_path + "/file_1.txt", std::ios::app) << "Changed!";
+    Packr::update(mixed_arc_path, mixed_src_path, 4);
+    Packr::decompress(mixed_arc_path, mixed_out_path);
+    std::cout << "LZ archive: " << fs::file_size(lz_arc_path) << " bytes" << std::endl;
+    check(Packr::verify(mixed_arc_path, 4, true), "mixed codec archive verifies");
+    check(same_tree(mixed_src_path, mixed_out_path + "/" + mixed_src_path), "mixed codec round trip");
+}
+
+// Read one file back by itself, through extract() and the reader, as a copy stored as a reference must
+bool reads_back_alone(std::string& arc_path, const std::string& out_path, const std::string& alias, const std::string& expected) {
+    std::string out = out_path;
+    Packr::extract(arc_path, out, alias);
+    PackrReader reader(arc_path);
+    AssetData data = reader.read(alias);
+    return read_bytes(out_path + "/" + alias) == expected && std::string(data->data(), data->size()) == expected;
+}
+
+// Duplicate test: copies point at the original's data, whatever codec it was compressed with
+void test_duplicates() {
+    std::string dup_src_path = "test/dup_src";
+    std::string lz_dup_arc_path = "test/dup_lz.packr";
+    fs::create_directories(dup_src_path);
+    std::string text;
+    for (int i = 0; i < 2000; i++) {
+        text += "Line " + std::to_string(i) + " of a file that is stored twice\n";
+    }
+    std::ofstream(dup_src_path + "/original.txt") << text;
+    std::ofstream(dup_src_path + "/copy.txt") << text;
+
+    PackrOptions lz_options;
+    lz_options.codec = CODEC_LZ;
+    Packr::compress_parallel(dup_src_path, lz_dup_arc_path, 4, lz_options);
+    check(reads_back_alone(lz_dup_arc_path, "test/dup_lz_original", dup_src_path + "/original.txt", text) &&
+          reads_back_alone(lz_dup_arc_path, "test/dup_lz_copy", dup_src_path + "/copy.txt", text),
+          "LZ duplicates read back on their own");
 
-    time_run([&] {
-        Packr::compress(in_path, seq_path);
-    }, "Sequential");
+    // Copied without inflating, the stored data itself tells whether a copy is the same
+    Packr::update(lz_dup_arc_path, dup_src_path, 4);
+    size_t dup_refs = 0;
+    for (const IndexEntry& entry : Packr::list(lz_dup_arc_path)) {
+        if (entry.header.flags & PACKR_FLAG_DEDUP) dup_refs++;
+    }
+    check(dup_refs == 1 && reads_back_alone(lz_dup_arc_path, "test/dup_lz_updated", dup_src_path + "/copy.txt", text),
+          "an update keeps unchanged duplicates as references");
 
-    time_run([&] {
-        Packr::compress_parallel(in_path, p5_path, 5);
-    }, "Parallel (5 threads)");
+    // A copy of data compressed against the dictionary needs the dictionary too
+    std::string dup_dict_arc_path = "test/dup_dict.packr";
+    PackrOptions dict_options;
+    dict_options.dictionary = true;
+    Packr::compress_parallel(dup_src_path, dup_dict_arc_path, 4, dict_options);
+    check(reads_back_alone(dup_dict_arc_path, "test/dup_dict_original", dup_src_path + "/original.txt", text) &&
+          reads_back_alone(dup_dict_arc_path, "test/dup_dict_copy", dup_src_path + "/copy.txt", text),
+          "dictionary duplicates read back on their own");
 
-    time_run([&] {
-        Packr::compress_parallel(in_path, p10_path, 10);
-    }, "Parallel (10 threads)");
+    // Changing the original leaves the copy to be stored by itself, still as LZ data
+    std::string dup_update_arc_path = "test/dup_update.packr";
+    std::string dup_update_out_path = "test/dup_update_out";
+    Packr::compress_parallel(dup_src_path, dup_update_arc_path, 1, lz_options);
+    for (const IndexEntry& entry : Packr::list(dup_update_arc_path)) {
+        if (!(entry.header.flags & PACKR_FLAG_DEDUP)) std::ofstream(entry.header.alias, std::ios::app) << "Changed!";
+    }
+    Packr::update(dup_update_arc_path, dup_src_path, 4);
+    check(Packr::verify(dup_update_arc_path, 4, true), "updated duplicate verifies");
+    Packr::decompress_parallel(dup_update_arc_path, dup_update_out_path, 4);
+    check(same_tree(dup_src_path, dup_update_out_path + "/" + dup_src_path), "updated duplicate round trip");
+}
 
+// Stream window test: without blocks, a file bigger than the stream window is packed
+// and extracted one window at a time, in the sequential and the parallel paths
+void test_stream_windows(std::string& in_path, std::string& stream_src_path, std::string& stream_arc_path) {
+    std::string stream_unarch_path = "test/stream_unarchived";
+    std::string window_arc_path = "test/window.packr";
+    std::string window_out_path = "test/window_out";
+    std::string window_seq_path = "test/window_seq";
+    fs::create_directories(stream_src_path);
+    {
+        std::ofstream big(stream_src_path + "/big.bin", std::ios::binary);
+        uint32_t state = 991;
+        for (int i = 0; i < PACKR_STREAM_WINDOW / 4 + 300000; i++) {
+            state = state * 1664525u + 1013904223u;
+            big.write(reinterpret_cast<const char*>(&state), sizeof(state));
+        }
+    }
+    Packr::archive(stream_src_path, stream_arc_path);
+    Packr::unarchive(stream_arc_path, stream_unarch_path);
+    size_t stream_windows = Packr::list(stream_arc_path).size();
+    std::cout << "Stream archive holds " << stream_windows << " windows" << std::endl;
+    check(stream_windows > 1, "big files are packed in windows");
+    check(same_tree(stream_src_path, stream_unarch_path + "/" + stream_src_path), "stream window round trip");
+
+    PackrOptions window_options;
+    window_options.block_size = 0;
+    window_options.stream_window = 300 * 1024;
+    Packr::compress_parallel(in_path, window_arc_path, 4, window_options);
+    Packr::decompress_parallel(window_arc_path, window_out_path, 4);
+    Packr::decompress(window_arc_path, window_seq_path);
+    check(same_tree(in_path, window_out_path + "/" + in_path), "small window parallel round trip");
+    check(same_tree(in_path, window_seq_path + "/" + in_path), "small window sequential round trip");
+}
+
+// Pipe test: pack into a pipe on one thread while the other extracts from it, both in parallel,
+// then a windowed stream through a file, and a cut off copy of it that has to be rejected
+void test_pipe(std::string& in_path, std::string& stream_src_path) {
+    std::string pipe_out_path = "test/pipe_out";
+    std::string pipe_arc_path = "test/piped.packr";
+    std::string pipe_window_path = "test/pipe_window";
+    std::string pipe_cut_path = "test/pipe_cut";
+    int fds[2];
+    if (pipe(fds) == 0) {
+        std::thread packer([&]() {
+            Packr::compress_stream(in_path, fds[1], 4);
+            close(fds[1]);
+        });
+        Packr::decompress_stream(fds[0], pipe_out_path, 4);
+        packer.join();
+        close(fds[0]);
+    }
+    check(same_tree(in_path, pipe_out_path + "/" + in_path), "pipe round trip");
+
+    PackrOptions pipe_options;
+    pipe_options.block_size = 0;
+    pipe_options.stream_window = 300 * 1024;
+    pipe_options.codec = CODEC_AUTO;
+    pipe_options.queue_depth = 3;
+    int out_fd = open(pipe_arc_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Packr::compress_stream(stream_src_path, out_fd, 2, pipe_options);
+    close(out_fd);
+    int in_fd = open(pipe_arc_path.c_str(), O_RDONLY);
+    Packr::decompress_stream(in_fd, pipe_window_path, 2, pipe_options);
+    close(in_fd);
+    check(same_tree(stream_src_path, pipe_window_path + "/" + stream_src_path), "windowed stream round trip");
+
+    fs::resize_file(pipe_arc_path, fs::file_size(pipe_arc_path) - 1);
+    bool truncation_caught = false;
+    in_fd = open(pipe_arc_path.c_str(), O_RDONLY);
+    try {
+        Packr::decompress_stream(in_fd, pipe_cut_path, 2);
+    }
+    catch (const std::runtime_error& e) {
+        truncation_caught = true;
+    }
+    close(in_fd);
+    check(truncation_caught, "truncated stream is rejected");
+}
+
+// Stream failure test: a block that can't be read once its file is in the stream fails the
+// stream, and a stream missing the last block of a file is rejected instead of leaving a hole
+void test_stream_failures() {
+    std::string gap_src_path = "test/gap_src";
+    std::string gap_file_path = gap_src_path + "/noise.bin";
+    std::string gap_arc_path = "test/gap.packr";
+    std::string gap_cut_path = "test/gap_cut.packr";
+    std::string gap_out_path = "test/gap_out";
+    uint64_t block_sizes[] = { 256 * 1024, 256 * 1024, 100 * 1024 };
+    fs::create_directories(gap_src_path);
+    write_noise(gap_file_path, 17, 612 * 1024);
+    PackrOptions gap_options;
+    gap_options.block_size = 256 * 1024;
+    gap_options.queue_depth = 1;
+
+    // Once the first block is in the pipe the packer waits on it, before reading the next one
+    int fds[2];
+    check(pipe(fds) == 0, "pipe is created");
+    bool read_failed = false;
+    std::thread packer([&]() {
+        try {
+            Packr::compress_stream(gap_src_path, fds[1], 1, gap_options);
+        }
+        catch (const std::runtime_error& e) {
+            read_failed = true;
+            std::cout << "Caught: " << e.what() << std::endl;
+        }
+        close(fds[1]);
+    });
+    int queued = 0;
+    while (ioctl(fds[0], FIONREAD, &queued) == 0 && queued <= 16) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    fs::resize_file(gap_file_path, block_sizes[0]);
+    std::vector<char> piece(1 << 16);
+    while (read(fds[0], piece.data(), piece.size()) > 0) {}
+    packer.join();
+    close(fds[0]);
+    check(read_failed, "a block that can't be read fails the stream");
+
+    // Incompressible blocks are stored, so the frames can be walked to cut the last one out
+    write_noise(gap_file_path, 17, 612 * 1024);
+    int out_fd = open(gap_arc_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    Packr::compress_stream(gap_src_path, out_fd, 2, gap_options);
+    close(out_fd);
+    std::string stream = read_bytes(gap_arc_path);
+    size_t pos = 16;
+    size_t last_frame = 0;
+    size_t frames = 0;
+    while (pos < stream.size() && stream[pos] == 1 && frames < 3) {
+        last_frame = pos++;
+        uint64_t record_size = 0;
+        for (int shift = 0; pos < stream.size(); shift += 7) {
+            uint8_t byte = static_cast<uint8_t>(stream[pos++]);
+            record_size |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        pos += record_size + block_sizes[frames++];
+    }
+    check(frames == 3 && pos + 2 == stream.size(), "stream holds the file's three blocks");
+    std::ofstream(gap_cut_path, std::ios::binary) << stream.substr(0, last_frame) << '\0' << static_cast<char>(frames - 1);
+    bool missing_caught = false;
+    int in_fd = open(gap_cut_path.c_str(), O_RDONLY);
+    try {
+        Packr::decompress_stream(in_fd, gap_out_path, 2);
+    }
+    catch (const std::runtime_error& e) {
+        missing_caught = true;
+        std::cout << "Caught: " << e.what() << std::endl;
+    }
+    close(in_fd);
+    check(missing_caught, "a stream missing blocks of a file is rejected");
+}
+
+// Reader test: load files in-process through the cache, a background prefetch and a
+// stream, from blocks, solid blocks and stream windows, and compare them with the disk
+void test_reader(std::string& block_arc_path, std::string& solid_arc_path,
+                 std::string& stream_src_path, std::string& stream_arc_path) {
+    bool same = true;
+    PackrReader block_reader(block_arc_path, 3 * 1024 * 1024);
+    std::vector<std::string> level = { "test_data/file_1.txt", "test_data/file_2.txt", "test_data/more_files/file_1.txt" };
+    block_reader.prefetch(level);
+    for (const std::string& path : block_reader.list()) {
+        AssetData data = block_reader.read(path);
+        same &= std::string(data->data(), data->size()) == read_bytes(path);
+    }
+    for (const std::string& path : level) {
+        same &= block_reader.read(path)->size() == block_reader.file_size(path);
+    }
+    ReaderStats stats = block_reader.get_stats();
+
+    PackrReader solid_reader(solid_arc_path);
+    for (const std::string& path : solid_reader.list()) {
+        AssetData data = solid_reader.read(path);
+        same &= std::string(data->data(), data->size()) == read_bytes(path);
+    }
+
+    PackrReader stream_reader(stream_arc_path, 0);
+    std::string big_path = stream_src_path + "/big.bin";
+    PackrStream stream = stream_reader.open(big_path);
+    std::string streamed;
+    std::vector<char> piece(100000);
+    while (size_t count = stream.read(piece.data(), piece.size())) {
+        streamed.append(piece.data(), count);
+    }
+    std::cout << "Reader: " << stats.hits << " hits, " << stats.misses << " misses, "
+              << stats.evictions << " evictions" << std::endl;
+    check(same, "reader files match the disk");
+    check(streamed.size() == stream.size() && streamed == read_bytes(big_path), "reader stream matches the disk");
+}
+
+// Path table test: paths far past the 255 characters fixed-size headers had room for
+void test_long_paths() {
+    std::string long_src_path = "test/long_src";
+    std::string long_arc_path = "test/long.packr";
+    std::string long_out_path = "test/long_out";
+    std::string long_dir = long_src_path;
+    for (int depth = 0; depth < 4; depth++) {
+        long_dir += "/" + std::string(120, static_cast<char>('a' + depth));
+    }
+    fs::create_directories(long_dir);
+    for (int i = 0; i < 20; i++) {
+        std::ofstream(long_dir + "/file_" + std::to_string(i) + ".txt") << "Deep file " << i << "\n";
+    }
+    Packr::compress_parallel(long_src_path, long_arc_path, 4);
+    Packr::decompress_parallel(long_arc_path, long_out_path, 4);
+    check(same_tree(long_src_path, long_out_path + "/" + long_src_path), "long path round trip");
+}
+
+// Metadata test: extraction restores the permission bits and mtimes files were packed with,
+// for files split into blocks too, sequentially and in parallel
+void test_metadata() {
+    std::string meta_src_path = "test/meta_src";
+    std::string meta_arc_path = "test/meta.packr";
+    std::string meta_out_path = "test/meta_out";
+    std::string meta_seq_path = "test/meta_seq";
+    fs::create_directories(meta_src_path + "/bin");
+    std::ofstream(meta_src_path + "/bin/run.sh") << "#!/bin/sh\necho packed\n";
+    std::ofstream(meta_src_path + "/secret.txt") << "Only for the owner\n";
+    {
+        std::ofstream big(meta_src_path + "/bin/big.dat", std::ios::binary);
+        for (int i = 0; i < 100000; i++) big << "block " << i << "\n";
+    }
+    fs::permissions(meta_src_path + "/bin/run.sh", fs::perms::owner_all | fs::perms::group_read | fs::perms::group_exec);
+    fs::permissions(meta_src_path + "/secret.txt", fs::perms::owner_read | fs::perms::owner_write);
+    fs::last_write_time(meta_src_path + "/bin/big.dat", fs::last_write_time(meta_src_path + "/secret.txt") - std::chrono::hours(48));
+    PackrOptions meta_options;
+    meta_options.block_size = 256 * 1024;
+    meta_options.restore_metadata = true;
+    Packr::compress_parallel(meta_src_path, meta_arc_path, 4, meta_options);
+    Packr::decompress_parallel(meta_arc_path, meta_out_path, 4, meta_options);
+    Packr::decompress(meta_arc_path, meta_seq_path, meta_options);
+    bool modes_match = true;
+    bool mtimes_match = true;
+    for (const char* name : { "/bin/run.sh", "/secret.txt", "/bin/big.dat" }) {
+        for (const std::string& out : { meta_out_path, meta_seq_path }) {
+            std::string packed = meta_src_path + name;
+            std::string extracted = out + "/" + packed;
+            modes_match &= fs::status(extracted).permissions() == fs::status(packed).permissions();
+            mtimes_match &= fs::last_write_time(extracted) == fs::last_write_time(packed);
+        }
+    }
+    check(modes_match, "permission bits are restored");
+    check(mtimes_match, "mtimes are restored");
+    check(same_tree(meta_src_path, meta_out_path + "/" + meta_src_path), "metadata parallel round trip");
+    check(same_tree(meta_src_path, meta_seq_path + "/" + meta_src_path), "metadata sequential round trip");
+}
+
+// A split file that can't be created is reported when it is added, and none of its blocks are written
+void test_output_tree() {
+    std::string blocked_out_path = "test/blocked_out";
+    fs::create_directories(blocked_out_path + "/data/big.bin");
+    DataHeader blocked_header{};
+    blocked_header.alias = "data/big.bin";
+    blocked_header.base_size = 4;
+    blocked_header.file_size = 8;
+    blocked_header.block_count = 2;
+    const OutputFile* blocked_file = nullptr;
+    OutputTree blocked_tree(blocked_out_path);
+    bool blocked_added = blocked_tree.add_file(blocked_header, blocked_file);
+    bool blocked_written = blocked_tree.write(*blocked_file, blocked_header, "data", 4);
+    fs::remove_all(blocked_out_path);
+    check(!blocked_added, "an uncreatable split file is reported when added");
+    check(!blocked_written, "an uncreatable split file is never written");
+}
+
+// Table of contents entry of the fixed-size 1.9.0 format
+struct FixedEntry {
+    char alias[256];
+    uint64_t base_size, comp_size, file_offset, file_size;
+    uint32_t block_index, block_count, flags, codec, solid_offset, solid_size;
+    int64_t mtime;
+    uint64_t content_hash, checksum, offset;
+};
+
+// Write an archive in the 1.9.0 layout with every text stored as is, behind the entry
+// that names it. Aliases, mtimes and content hashes are left to the caller
+void write_fixed_archive(const std::string& path, std::vector<FixedEntry>& entries, const std::vector<std::string>& texts) {
+    size_t fixed_header_size = offsetof(FileHeader, index_size); // Padding included, as 1.9.0 wrote it
+    FileHeader fixed_header{};
+    std::strcpy(fixed_header.version, PACKR_FIXED_VERSION);
+    fixed_header.chunk_count = static_cast<uint32_t>(entries.size());
+    uint64_t offset = fixed_header_size;
+    for (size_t i = 0; i < entries.size(); i++) {
+        entries[i].base_size = entries[i].comp_size = entries[i].file_size = texts[i].size();
+        entries[i].block_count = 1;
+        entries[i].flags = PACKR_FLAG_STORED;
+        entries[i].checksum = checksum_data(texts[i].data(), texts[i].size());
+        entries[i].offset = offset;
+        offset += texts[i].size();
+    }
+    fixed_header.index_offset = offset;
+    std::ofstream fixed(path, std::ios::binary);
+    fixed.write(reinterpret_cast<const char*>(&fixed_header), fixed_header_size);
+    for (const std::string& text : texts) fixed << text;
+    fixed.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(FixedEntry));
+}
+
+// Fixed-size format test: an archive in the 1.9.0 layout, one stored file, still extracts
+void test_fixed_format() {
+    std::string fixed_arc_path = "test/fixed.packr";
+    std::string fixed_out_path = "test/fixed_out";
+    std::string text = "Written before paths had a table of their own\n";
+    std::vector<FixedEntry> entries(1);
+    std::strcpy(entries[0].alias, "fixed/old_file.txt");
+    entries[0].content_hash = hash_data(text.data(), text.size());
+    write_fixed_archive(fixed_arc_path, entries, { text });
+    Packr::decompress(fixed_arc_path, fixed_out_path);
+    check(read_bytes(fixed_out_path + "/fixed/old_file.txt") == text, "fixed-size archive reads back");
+
+    // Two different files behind the same content hash, as a collision would leave them.
+    // An update copies both as they are, and must not make one a reference to the other
+    std::string collide_src_path = "test/collide_src";
+    std::string collide_probe_path = "test/collide_probe.packr";
+    std::string collide_arc_path = "test/collide.packr";
+    std::string collide_out_path = "test/collide_out";
+    std::vector<std::string> texts = { "First file of the pair\n", "Other file, same size\n\n" };
+    fs::create_directories(collide_src_path);
+    std::ofstream(collide_src_path + "/a.txt") << texts[0];
+    std::ofstream(collide_src_path + "/b.txt") << texts[1];
+    Packr::archive(collide_src_path, collide_probe_path);
+    std::vector<FixedEntry> pair(2);
+    for (const IndexEntry& probed : Packr::list(collide_probe_path)) {
+        size_t i = probed.header.alias == collide_src_path + "/a.txt" ? 0 : 1;
+        std::strcpy(pair[i].alias, probed.header.alias.c_str());
+        pair[i].mtime = probed.header.mtime;
+        pair[i].content_hash = 42;
+    }
+    write_fixed_archive(collide_arc_path, pair, texts);
+    Packr::update(collide_arc_path, collide_src_path, 2);
+    Packr::decompress(collide_arc_path, collide_out_path);
+    check(same_tree(collide_src_path, collide_out_path + "/" + collide_src_path), "files with the same hash stay apart");
+}
+
+// Original format test: archives the first release wrote with archive() and compress()
+void test_original_format() {
+    std::string legacy_src_path = "test_fixtures/legacy";
+    std::string legacy_arc_path = "test_fixtures/baseline_archive.packr";
+    std::string legacy_comp_path = "test_fixtures/baseline_compressed.packr";
+    std::string legacy_unarch_path = "test/legacy_unarchived";
+    std::string legacy_decomp_path = "test/legacy_decompressed";
+    Packr::unarchive(legacy_arc_path, legacy_unarch_path);
+    Packr::decompress_parallel(legacy_comp_path, legacy_decomp_path, 4);
+    check(Packr::verify(legacy_arc_path, 4, true) && Packr::verify(legacy_comp_path, 4, true), "original format archives verify");
+    check(same_tree(legacy_src_path, legacy_unarch_path + "/" + legacy_src_path), "original format archive round trip");
+    check(same_tree(legacy_src_path, legacy_decomp_path + "/" + legacy_src_path), "original format compress round trip");
+}
+
+// Level test: every level's match finder must produce data the inflater reads back
+void test_levels(std::string& in_path) {
+    for (int level = 0; level <= PACKR_MAX_LEVEL; level++) {
+        std::string level_arc_path = "test/level_" + std::to_string(level) + ".packr";
+        std::string level_out_path = "test/level_" + std::to_string(level);
+        PackrOptions level_options;
+        level_options.level = level;
+        Packr::compress_parallel(in_path, level_arc_path, 4, level_options);
+        Packr::decompress_parallel(level_arc_path, level_out_path, 4);
+        std::cout << "Level " << level << ": " << fs::file_size(level_arc_path) << " bytes" << std::endl;
+        check(same_tree(in_path, level_out_path + "/" + in_path), "level " + std::to_string(level) + " round trip");
+    }
+}
+
+// Auto mode test: whatever threads and level the budget settles on, the archive must read back
+void test_auto_mode(std::string& in_path) {
+    std::string tuned_arc_path = "test/tuned.packr";
+    std::string tuned_out_path = "test/tuned_out";
+    PackrOptions tuned_options;
+    tuned_options.target_seconds = 5;
+    tuned_options.target_speed = 1;
+    PackrStats tuned_stats = Packr::compress_parallel(in_path, tuned_arc_path, PACKR_AUTO_THREADS, tuned_options);
+    PackrStats tuned_out_stats = Packr::decompress_parallel(tuned_arc_path, tuned_out_path, PACKR_AUTO_THREADS);
+    std::cout << "Auto mode: level " << tuned_stats.level << " with " << tuned_stats.threads << " threads, extracted with "
+              << tuned_out_stats.threads << std::endl;
+    check(tuned_stats.threads >= 1 && tuned_out_stats.threads >= 1, "auto mode picks a thread count");
+    check(tuned_stats.level >= 0 && tuned_stats.level <= PACKR_MAX_LEVEL, "auto mode picks a valid level");
+    check(same_tree(in_path, tuned_out_path + "/" + in_path), "auto mode round trip");
+}
+
+// Thread count test, timings live in the bench target
+void test_thread_counts(std::string& in_path) {
+    std::string seq_path = "test/out_seq.packr";
+    std::string p5_path = "test/out_p5.packr";
+    std::string p10_path = "test/out_p10.packr";
+    Packr::compress(in_path, seq_path);
+    Packr::compress_parallel(in_path, p5_path, 5);
+    Packr::compress_parallel(in_path, p10_path, 10);
 
     std::string out_decomp_seq_path = "test/decompressed_seq";
     std::string out_decomp_p5_path = "test/decompressed_p5";
     std::string out_decomp_p10_path = "test/decompressed_p10";
+    Packr::decompress(seq_path, out_decomp_seq_path);
+    Packr::decompress_parallel(p5_path, out_decomp_p5_path, 5);
+    Packr::decompress_parallel(p10_path, out_decomp_p10_path, 10);
+    check(same_tree(in_path, out_decomp_seq_path + "/" + in_path), "sequential round trip");
+    check(same_tree(in_path, out_decomp_p5_path + "/" + in_path), "5 thread round trip");
+    check(same_tree(in_path, out_decomp_p10_path + "/" + in_path), "10 thread round trip");
+}
+
+// Run one test, an exception it didn't expect counts as a failure and the next test still runs
+void run_test(const std::string& name, const std::function<void()>& test) {
+    std::cout << "== " << name << std::endl;
+    try {
+        test();
+    }
+    catch (const std::exception& e) {
+        check(false, name + " threw: " + e.what());
+    }
+}
+
+int main() {
+    std::string in_path = "test_data";
 
-    time_run([&] {
-        Packr::decompress(seq_path, out_decomp_seq_path);
-    }, "Sequential");
+    // Start from an empty output directory, outputs are never overwritten
+    fs::remove_all("test");
+    fs::create_directories("test");
 
-    time_run([&] {
-        Packr::decompress_parallel(p5_path, out_decomp_p5_path, 5);
-    }, "Parallel (5 threads)");
+    // Inputs and archives later tests read again
+    std::string block_arc_path = "test/blocks.packr";
+    std::string solid_src_path = "test/solid_src";
+    std::string solid_arc_path = "test/solid.packr";
+    std::string stream_src_path = "test/stream_src";
+    std::string stream_arc_path = "test/stream.packr";
 
-    time_run([&] {
-        Packr::decompress_parallel(p10_path, out_decomp_p10_path, 10);
-    }, "Parallel (10 threads)");
+    run_test("Integrity", [&] { test_integrity(in_path); });
+    run_test("Block mode", [&] { test_blocks(in_path, block_arc_path); });
+    run_test("Random access", [&] { test_extract(in_path, block_arc_path); });
+    run_test("Verify", [&] { test_verify(block_arc_path); });
+    run_test("Write failure", [&] { test_write_failure(); });
+    run_test("Update", [&] { test_update(in_path); });
+    run_test("Adaptive", [&] { test_adaptive(in_path); });
+    run_test("Solid", [&] { test_solid(in_path, solid_src_path, solid_arc_path); });
+    run_test("Dictionary", [&] { test_dictionary(solid_src_path); });
+    run_test("io_uring", [&] { test_uring(in_path, solid_src_path); });
+    run_test("Codecs", [&] { test_codecs(in_path, solid_src_path); });
+    run_test("Duplicates", [&] { test_duplicates(); });
+    run_test("Stream windows", [&] { test_stream_windows(in_path, stream_src_path, stream_arc_path); });
+    run_test("Pipe", [&] { test_pipe(in_path, stream_src_path); });
+    run_test("Stream failures", [&] { test_stream_failures(); });
+    run_test("Reader", [&] { test_reader(block_arc_path, solid_arc_path, stream_src_path, stream_arc_path); });
+    run_test("Long paths", [&] { test_long_paths(); });
+    run_test("Metadata", [&] { test_metadata(); });
+    run_test("Output tree", [&] { test_output_tree(); });
+    run_test("Fixed-size format", [&] { test_fixed_format(); });
+    run_test("Original format", [&] { test_original_format(); });
+    run_test("Levels", [&] { test_levels(in_path); });
+    run_test("Auto mode", [&] { test_auto_mode(in_path); });
+    run_test("Thread counts", [&] { test_thread_counts(in_path); });
 
-}
\ No newline at end of file
+    if (failures > 0) {
+        std::cerr << failures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}
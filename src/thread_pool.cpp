@@ -0,0 +1,178 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+
+void TaskGroup::add(size_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pending += count;
+}
+
+void TaskGroup::finish(std::exception_ptr task_error) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (task_error && !error) {
+        error = task_error;
+    }
+    if (--pending == 0) {
+        done_cv.notify_all();
+    }
+}
+
+void TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    done_cv.wait(lock, [&] { return pending == 0; });
+
+    if (error) {
+        std::exception_ptr task_error = error;
+        error = nullptr;
+        std::rethrow_exception(task_error);
+    }
+}
+
+
+ThreadPool::ThreadPool(int num_threads) {
+    if (num_threads < 1) num_threads = 1;
+
+    for (int i = 0; i < num_threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+    }
+    // Only start threads once every deque exists, they steal from each other
+    for (int i = 0; i < num_threads; i++) {
+        threads.emplace_back(&ThreadPool::run, this, static_cast<size_t>(i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+        stopping = true;
+    }
+    wake_cv.notify_all();
+
+    // Workers drain whatever is still queued before they exit
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+void ThreadPool::submit(TaskGroup& group, std::vector<PoolTask>& tasks) {
+    if (tasks.empty()) return;
+
+    // Biggest tasks first, so a big task queued last can't set the job's tail
+    std::stable_sort(tasks.begin(), tasks.end(), [](const PoolTask& a, const PoolTask& b) {
+        return a.size > b.size;
+    });
+
+    // Every task reports back to its group, errors included
+    group.add(tasks.size());
+    for (auto& task : tasks) {
+        task.group = &group;
+    }
+
+    // Deal tasks out round-robin, each worker's share stays sorted biggest first
+    size_t count = workers.size();
+    std::vector<std::vector<PoolTask>> shares(count);
+    size_t first = next_worker.fetch_add(1) % count;
+    for (size_t i = 0; i < tasks.size(); i++) {
+        shares[(first + i) % count].push_back(std::move(tasks[i]));
+    }
+    tasks.clear();
+
+    for (size_t w = 0; w < count; w++) {
+        if (shares[w].empty()) continue;
+
+        // (CRITICAL) Merge the share into the worker's deque
+        std::lock_guard<std::mutex> lock(workers[w]->mutex);
+        std::deque<PoolTask> merged;
+        std::merge(std::make_move_iterator(workers[w]->tasks.begin()),
+                   std::make_move_iterator(workers[w]->tasks.end()),
+                   std::make_move_iterator(shares[w].begin()),
+                   std::make_move_iterator(shares[w].end()),
+                   std::back_inserter(merged),
+                   [](const PoolTask& a, const PoolTask& b) { return a.size > b.size; });
+        workers[w]->tasks.swap(merged);
+        queued += shares[w].size();
+    }
+
+    // Wake sleeping workers, taking the lock so none of them misses the wakeup
+    {
+        std::lock_guard<std::mutex> lock(wake_mutex);
+    }
+    wake_cv.notify_all();
+}
+
+bool ThreadPool::pop_task(size_t id, PoolTask& task) {
+    // Own deque first
+    {
+        std::lock_guard<std::mutex> lock(workers[id]->mutex);
+        if (!workers[id]->tasks.empty()) {
+            task = std::move(workers[id]->tasks.front());
+            workers[id]->tasks.pop_front();
+            queued--;
+            return true;
+        }
+    }
+
+    // Otherwise find the victim holding the biggest task
+    size_t count = workers.size();
+    size_t victim = count;
+    uint64_t victim_size = 0;
+    for (size_t i = 1; i < count; i++) {
+        size_t w = (id + i) % count;
+        std::lock_guard<std::mutex> lock(workers[w]->mutex);
+        if (!workers[w]->tasks.empty() &&
+            (victim == count || workers[w]->tasks.front().size > victim_size)) {
+            victim = w;
+            victim_size = workers[w]->tasks.front().size;
+        }
+    }
+    if (victim == count) return false;
+
+    // And steal it, unless its owner got there first
+    std::lock_guard<std::mutex> lock(workers[victim]->mutex);
+    if (workers[victim]->tasks.empty()) return false;
+    task = std::move(workers[victim]->tasks.front());
+    workers[victim]->tasks.pop_front();
+    queued--;
+    return true;
+}
+
+void ThreadPool::run_task(PoolTask& task) {
+    std::exception_ptr error;
+    try {
+        task.fn();
+    }
+    catch (...) {
+        error = std::current_exception();
+    }
+
+    // Let go of the task before its caller can see it finished
+    task.fn = nullptr;
+    task.group->finish(error);
+}
+
+void ThreadPool::run(size_t id) {
+    while (true) {
+        PoolTask task;
+        if (pop_task(id, task)) {
+            run_task(task);
+            continue;
+        }
+
+        // Sleep until there is something to take or the pool shuts down
+        std::unique_lock<std::mutex> lock(wake_mutex);
+        wake_cv.wait(lock, [&] { return stopping || queued.load() > 0; });
+        if (stopping && queued.load() == 0) return;
+    }
+}
+
+std::shared_ptr<ThreadPool> ThreadPool::shared(int num_threads) {
+    static std::mutex shared_mutex;
+    static std::shared_ptr<ThreadPool> pool;
+    if (num_threads < 1) num_threads = 1;
+
+    // Operations still holding an older pool keep it alive until they finish
+    std::lock_guard<std::mutex> lock(shared_mutex);
+    if (!pool || pool->size() != num_threads) {
+        pool = std::make_shared<ThreadPool>(num_threads);
+    }
+    return pool;
+}
@@ -0,0 +1,72 @@
+#ifndef THREAD_POOL_HPP
+    #define THREAD_POOL_HPP
+    #include <cstdint>
+    #include <vector>
+    #include <deque>
+    #include <memory>
+    #include <functional>
+    #include <exception>
+    #include <thread>
+    #include <mutex>
+    #include <condition_variable>
+    #include <atomic>
+
+    class TaskGroup;
+
+    // Struct for a unit of work, size is the number of bytes it touches
+    struct PoolTask {
+        std::function<void()> fn;
+        uint64_t size = 0;
+        TaskGroup* group = nullptr; // Set by submit()
+    };
+
+    // Tracks the tasks of one batch, so its caller only waits for those
+    class TaskGroup {
+        private:
+            std::mutex mutex;
+            std::condition_variable done_cv;
+            size_t pending = 0;
+            std::exception_ptr error;
+
+            friend class ThreadPool;
+            void add(size_t count);
+            void finish(std::exception_ptr task_error);
+        public:
+            void wait(); // Block until every task finished, rethrows the first task error
+    };
+
+    // Implements a persistent pool of workers with one deque of tasks each.
+    // Workers take the biggest task from their own deque, and when it runs dry
+    // they steal the biggest task left in any other worker's deque.
+    class ThreadPool {
+        private:
+            struct Worker {
+                std::mutex mutex;
+                std::deque<PoolTask> tasks; // Kept sorted biggest first
+            };
+            std::vector<std::unique_ptr<Worker>> workers;
+            std::vector<std::thread> threads;
+
+            // Workers sleep here while every deque is empty
+            std::mutex wake_mutex;
+            std::condition_variable wake_cv;
+            std::atomic<size_t> queued{0};
+            bool stopping = false;
+
+            std::atomic<size_t> next_worker{0};
+
+            void run(size_t id);
+            bool pop_task(size_t id, PoolTask& task);
+            static void run_task(PoolTask& task);
+        public:
+            ThreadPool(int num_threads);
+            ~ThreadPool();
+
+            // Sort tasks biggest first and deal them out to the workers
+            void submit(TaskGroup& group, std::vector<PoolTask>& tasks);
+            int size() const { return static_cast<int>(threads.size()); }
+
+            // Pool shared by every Packr operation, only recreated when the size changes
+            static std::shared_ptr<ThreadPool> shared(int num_threads);
+    };
+#endif
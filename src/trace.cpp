@@ -0,0 +1,159 @@
+#include "trace.hpp"
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+// Counter columns of a slot
+enum {
+    COUNTER_NS = 0,
+    COUNTER_CALLS,
+    COUNTER_BYTES_IN,
+    COUNTER_BYTES_OUT,
+};
+
+std::mutex Tracer::slots_mutex;
+std::vector<Tracer::ThreadSlot*> Tracer::slots;
+std::atomic<bool> Tracer::recording{false};
+
+const char* get_stage_name(TraceStage stage) {
+    switch (stage) {
+        case STAGE_SCAN: return "scan";
+        case STAGE_READ: return "read";
+        case STAGE_HASH: return "hash";
+        case STAGE_COMPRESS: return "compress";
+        case STAGE_DECOMPRESS: return "decompress";
+        case STAGE_WRITE: return "write";
+        case STAGE_LOCK_WAIT: return "lock_wait";
+        case STAGE_FLUSH: return "flush";
+        default: return "unknown";
+    }
+}
+
+uint64_t Tracer::now_ns() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+Tracer::ThreadSlot& Tracer::get_slot() {
+    // Hands the slot back when its thread exits, its counters stay in the totals
+    struct SlotHandle {
+        ThreadSlot* slot = nullptr;
+        ~SlotHandle() {
+            if (slot) slot->in_use = false;
+        }
+    };
+    thread_local SlotHandle handle;
+    if (handle.slot) return *handle.slot;
+
+    // (CRITICAL) Take a free slot, or add one, once per thread
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    for (ThreadSlot* slot : slots) {
+        if (!slot->in_use) {
+            handle.slot = slot;
+            break;
+        }
+    }
+    if (!handle.slot) {
+        // Slots are never freed, a snapshot may be reading them at any time
+        slots.push_back(new ThreadSlot());
+        handle.slot = slots.back();
+    }
+    handle.slot->in_use = true;
+    return *handle.slot;
+}
+
+void Tracer::record(TraceStage stage, uint64_t start_ns, uint64_t bytes_in, uint64_t bytes_out,
+                    const char* detail) {
+    uint64_t end_ns = now_ns();
+    ThreadSlot& slot = get_slot();
+    auto& counters = slot.counters[stage];
+    counters[COUNTER_NS].fetch_add(end_ns - start_ns, std::memory_order_relaxed);
+    counters[COUNTER_CALLS].fetch_add(1, std::memory_order_relaxed);
+    counters[COUNTER_BYTES_IN].fetch_add(bytes_in, std::memory_order_relaxed);
+    counters[COUNTER_BYTES_OUT].fetch_add(bytes_out, std::memory_order_relaxed);
+
+    if (recording.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(slot.events_mutex);
+        slot.events.push_back({ stage, start_ns, end_ns - start_ns, bytes_in, bytes_out,
+                                detail ? detail : "" });
+    }
+}
+
+TraceTotals Tracer::snapshot() {
+    TraceTotals totals;
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    for (ThreadSlot* slot : slots) {
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            StageStats& stage = totals.stages[s];
+            stage.ns += slot->counters[s][COUNTER_NS].load(std::memory_order_relaxed);
+            stage.calls += slot->counters[s][COUNTER_CALLS].load(std::memory_order_relaxed);
+            stage.bytes_in += slot->counters[s][COUNTER_BYTES_IN].load(std::memory_order_relaxed);
+            stage.bytes_out += slot->counters[s][COUNTER_BYTES_OUT].load(std::memory_order_relaxed);
+        }
+    }
+    return totals;
+}
+
+// Escape a file name for a JSON string
+static std::string escape_json(const std::string& text) {
+    std::string escaped;
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            escaped += ' ';
+        }
+        else {
+            escaped += c;
+        }
+    }
+    return escaped;
+}
+
+bool Tracer::write_chrome_trace(const std::string& path) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(slots_mutex);
+
+    // Timestamps start at the first span, in microseconds
+    uint64_t origin = UINT64_MAX;
+    for (ThreadSlot* slot : slots) {
+        std::lock_guard<std::mutex> events_lock(slot->events_mutex);
+        for (const TraceEvent& event : slot->events) {
+            origin = std::min(origin, event.start_ns);
+        }
+    }
+
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (size_t tid = 0; tid < slots.size(); tid++) {
+        std::lock_guard<std::mutex> events_lock(slots[tid]->events_mutex);
+        for (const TraceEvent& event : slots[tid]->events) {
+            out << (first ? "" : ",\n")
+                << "{\"name\":\"" << get_stage_name(event.stage) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << tid
+                << ",\"ts\":" << (event.start_ns - origin) / 1000.0
+                << ",\"dur\":" << event.duration_ns / 1000.0
+                << ",\"args\":{\"bytes_in\":" << event.bytes_in << ",\"bytes_out\":" << event.bytes_out;
+            if (!event.detail.empty()) {
+                out << ",\"file\":\"" << escape_json(event.detail) << "\"";
+            }
+            out << "}}";
+            first = false;
+        }
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+void Tracer::clear_events() {
+    std::lock_guard<std::mutex> lock(slots_mutex);
+    for (ThreadSlot* slot : slots) {
+        std::lock_guard<std::mutex> events_lock(slot->events_mutex);
+        slot->events.clear();
+    }
+}
@@ -0,0 +1,117 @@
+#ifndef TRACE_HPP
+    #define TRACE_HPP
+    #include <cstdint>
+    #include <string>
+    #include <vector>
+    #include <mutex>
+    #include <atomic>
+
+    // Stages of Packr's hot paths that get counted and timed
+    enum TraceStage {
+        STAGE_SCAN = 0, // Walking the input directories
+        STAGE_READ, // Reading input files, or faulting archive pages in
+        STAGE_HASH, // Content hashes and checksums
+        STAGE_COMPRESS,
+        STAGE_DECOMPRESS,
+        STAGE_WRITE, // Writing chunks to the archive or extracted files
+        STAGE_LOCK_WAIT, // Waiting on a contended lock or on back-pressure
+        STAGE_FLUSH, // Writing the table of contents
+        STAGE_COUNT
+    };
+    const char* get_stage_name(TraceStage stage);
+
+    // Struct for one stage's totals
+    struct StageStats {
+        uint64_t ns = 0;
+        uint64_t calls = 0;
+        uint64_t bytes_in = 0;
+        uint64_t bytes_out = 0;
+    };
+
+    // Struct for every stage's totals at some point in time
+    struct TraceTotals {
+        StageStats stages[STAGE_COUNT];
+    };
+
+    // Struct for one timed span, as shown in a Chrome trace
+    struct TraceEvent {
+        TraceStage stage;
+        uint64_t start_ns;
+        uint64_t duration_ns;
+        uint64_t bytes_in;
+        uint64_t bytes_out;
+        std::string detail; // File the span worked on, if any
+    };
+
+    // Implements the process-wide collector of per-thread counters.
+    // Every thread only ever adds to its own slot, so recording takes no shared lock,
+    // and totals are summed over all slots when an operation asks for them.
+    class Tracer {
+        private:
+            struct ThreadSlot {
+                std::atomic<uint64_t> counters[STAGE_COUNT][4] = {};
+                std::atomic<bool> in_use{false};
+                std::mutex events_mutex; // Only contended while exporting
+                std::vector<TraceEvent> events;
+            };
+
+            static std::mutex slots_mutex;
+            static std::vector<ThreadSlot*> slots; // Reused once their thread exits
+            static std::atomic<bool> recording;
+
+            static ThreadSlot& get_slot();
+        public:
+            static uint64_t now_ns();
+            static void record(TraceStage stage, uint64_t start_ns, uint64_t bytes_in, uint64_t bytes_out,
+                               const char* detail);
+
+            static TraceTotals snapshot(); // Sum of every thread's counters so far
+
+            // Keep every span for export, not just the totals
+            static void set_recording(bool enabled) { recording = enabled; }
+            static bool is_recording() { return recording; }
+            static bool write_chrome_trace(const std::string& path); // Trace-event JSON for chrome://tracing
+            static void clear_events();
+    };
+
+    // Times the enclosing scope as one span of a stage
+    class TraceScope {
+        private:
+            TraceStage stage;
+            uint64_t start_ns;
+            uint64_t bytes_in;
+            uint64_t bytes_out = 0;
+            const char* detail;
+        public:
+            TraceScope(TraceStage stage, uint64_t bytes_in = 0, const char* detail = nullptr)
+                : stage(stage), start_ns(Tracer::now_ns()), bytes_in(bytes_in), detail(detail) {}
+            TraceScope(TraceStage stage, uint64_t bytes_in, const std::string& detail)
+                : TraceScope(stage, bytes_in, detail.c_str()) {}
+            ~TraceScope() { Tracer::record(stage, start_ns, bytes_in, bytes_out, detail); }
+
+            void set_bytes_out(uint64_t bytes) { bytes_out = bytes; }
+    };
+
+    // Instrumentation compiles to nothing unless PACKR_TRACE is defined
+    #ifdef PACKR_TRACE
+        #define PACKR_TRACE_CONCAT_(a, b) a##b
+        #define PACKR_TRACE_NAME_(line) PACKR_TRACE_CONCAT_(trace_scope_, line)
+        #define PACKR_SCOPE(...) TraceScope PACKR_TRACE_NAME_(__LINE__)(__VA_ARGS__)
+        #define PACKR_NAMED_SCOPE(name, ...) TraceScope name(__VA_ARGS__)
+        #define PACKR_SCOPE_OUT(name, bytes) name.set_bytes_out(bytes)
+    #else
+        #define PACKR_SCOPE(...) ((void)0)
+        #define PACKR_NAMED_SCOPE(name, ...) ((void)0)
+        #define PACKR_SCOPE_OUT(name, bytes) ((void)0)
+    #endif
+
+    // Lock a mutex, counting the time spent waiting when it is contended
+    template <typename Lock>
+    void lock_timed(Lock& lock) {
+    #ifdef PACKR_TRACE
+        if (lock.try_lock()) return;
+        TraceScope scope(STAGE_LOCK_WAIT);
+    #endif
+        lock.lock();
+    }
+#endif